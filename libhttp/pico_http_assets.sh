@@ -0,0 +1,116 @@
+#!/bin/bash
+#
+# Turns a directory of web content into a compiled-in asset table for
+# pico_http_server_set_assets().
+#
+#   ./pico_http_assets.sh <directory> [symbol] > assets.c
+#
+# The table is named <symbol> (default pico_http_assets) and its length
+# <symbol>_count. Every file gets its identity content, a gzip variant
+# when compressing makes it smaller, and strong ETags derived from the
+# SHA-1 of the content, one per variant. An index.html also answers for
+# its directory.
+
+DIR=$1
+SYM=${2:-pico_http_assets}
+
+if [ -z "$DIR" ] || [ ! -d "$DIR" ]; then
+    echo "usage: $0 <directory> [symbol]" >&2
+    exit 1
+fi
+
+for tool in gzip od sha1sum; do
+    if ! command -v $tool > /dev/null; then
+        echo "$0: $tool is required" >&2
+        exit 1
+    fi
+done
+
+TMP=`mktemp -d`
+trap "rm -rf $TMP" EXIT
+
+mimetype() {
+    case "${1,,}" in
+        *.html|*.htm|*.shtm|*.shtml) echo "text/html" ;;
+        *.css) echo "text/css" ;;
+        *.js) echo "application/x-javascript" ;;
+        *.json) echo "application/json" ;;
+        *.xml) echo "text/xml" ;;
+        *.txt) echo "text/plain" ;;
+        *.svg) echo "image/svg+xml" ;;
+        *.ico) echo "image/x-icon" ;;
+        *.gif) echo "image/gif" ;;
+        *.jpg|*.jpeg) echo "image/jpeg" ;;
+        *.png) echo "image/png" ;;
+        *.bmp) echo "image/bmp" ;;
+        *.ttf) echo "application/x-font-ttf" ;;
+        *.woff) echo "font/woff" ;;
+        *.woff2) echo "font/woff2" ;;
+        *.pdf) echo "application/pdf" ;;
+        *) echo "application/octet-stream" ;;
+    esac
+}
+
+# file content as a C initializer, an empty file still needs one element
+bytes() {
+    if [ -s "$1" ]; then
+        od -An -v -tx1 "$1" | sed -e 's/ *\([0-9a-f][0-9a-f]\)/0x\1, /g' -e 's/^/    /' -e 's/, *$/,/'
+    else
+        echo "    0"
+    fi
+}
+
+echo "/* Generated by pico_http_assets.sh from $DIR, do not edit */"
+echo "#include <stddef.h>"
+echo "#include <stdint.h>"
+echo "#include \"pico_http_server.h\""
+echo
+
+# paths in strcmp order, the server looks them up with a binary search
+( cd "$DIR" && find . -type f | sed 's|^\./|/|' ) | LC_ALL=C sort > $TMP/files
+
+n=0
+while read -r path; do
+    file="$DIR$path"
+    len=`stat -c %s "$file"`
+    echo "static const uint8_t asset_${n}[] = {"
+    bytes "$file"
+    echo "};"
+    gzip -9 -n -c "$file" > $TMP/gz
+    gzlen=`stat -c %s $TMP/gz`
+    if [ $gzlen -lt $len ]; then
+        echo "static const uint8_t asset_${n}_gz[] = {"
+        bytes $TMP/gz
+        echo "};"
+        gzetag=`sha1sum $TMP/gz | cut -c1-16`
+        echo "$n $len $gzlen $gzetag $path" >> $TMP/entries
+    else
+        echo "$n $len 0 - $path" >> $TMP/entries
+    fi
+    echo
+    n=$((n + 1))
+done < $TMP/files
+
+entry() {
+    local n=$1 len=$2 gzlen=$3 gzetag=$4 path=$5 file=$6
+    local etag=`sha1sum "$file" | cut -c1-16`
+    local gz="NULL, 0, NULL"
+    if [ $gzlen -ne 0 ]; then
+        gz="asset_${n}_gz, $gzlen, \"\\\"$gzetag\\\"\""
+    fi
+    echo "    { \"$path\", \"`mimetype "$file"`\", \"\\\"$etag\\\"\", asset_${n}, $len, $gz },"
+}
+
+echo "const struct pico_http_static_asset ${SYM}[] = {"
+if [ -f $TMP/entries ]; then
+    while read -r n len gzlen gzetag path; do
+        echo "$path $n $len $gzlen $gzetag $path"
+        case "$path" in
+            */index.html) echo "${path%index.html} $n $len $gzlen $gzetag $path" ;;
+        esac
+    done < $TMP/entries | LC_ALL=C sort -k1,1 | while read -r key n len gzlen gzetag path; do
+        entry $n $len $gzlen $gzetag "$key" "$DIR$path"
+    done
+fi
+echo "};"
+echo "const uint16_t ${SYM}_count = sizeof(${SYM}) / sizeof(${SYM}[0]);"
@@ -9,19 +9,187 @@
 #include "pico_tcp.h"
 #include "pico_tree.h"
 #include "pico_socket.h"
+#ifdef PICO_HTTP_SERVER_DEFLATE
+#include <zlib.h>
+#endif
 
+/* Pending connections of a listener of the default server */
+#ifndef BACKLOG
 #define BACKLOG                             10
+#endif
+
+/* Seconds announced to the clients turned away when the server is full */
+#ifndef HTTP_RETRY_AFTER
+#define HTTP_RETRY_AFTER        "5"
+#endif
+
+/* Listening sockets of one server instance */
+#ifndef HTTP_SERVER_LISTENERS
+#define HTTP_SERVER_LISTENERS   2u
+#endif
 
 #define HTTP_SERVER_CLOSED      0
 #define HTTP_SERVER_LISTEN      1
 
 #define HTTP_HEADER_MAX_LINE    256u
-#define HTTP_OK_HEADER_FIXED    160u
-
-#define consume_char(c) (pico_socket_read(client->sck, &c, 1u))
-
-//TODO: check in rfc what to add
 
+/* Size of the per-connection receive buffer, the request header must fit in it */
+#ifndef HTTP_RX_BUFFER_SIZE
+#define HTTP_RX_BUFFER_SIZE     1024u
+#endif
+
+#define HTTP_HDR_NONE           0xFFu
+
+/* Persistent connections, see pico_http_server_set_keepalive() */
+#ifndef HTTP_KEEPALIVE_TIMEOUT_MS
+#define HTTP_KEEPALIVE_TIMEOUT_MS       5000u
+#endif
+#ifndef HTTP_KEEPALIVE_MAX_REQUESTS
+#define HTTP_KEEPALIVE_MAX_REQUESTS     100u
+#endif
+
+/* Deadlines of a connection : the whole request header from its first
+ * byte, the gap between two segments of a request body and the answer
+ * of the application, see pico_http_server_set_timeouts() */
+#ifndef HTTP_HEADER_TIMEOUT_MS
+#define HTTP_HEADER_TIMEOUT_MS          10000u
+#endif
+#ifndef HTTP_BODY_TIMEOUT_MS
+#define HTTP_BODY_TIMEOUT_MS            30000u
+#endif
+#ifndef HTTP_RESPONSE_TIMEOUT_MS
+#define HTTP_RESPONSE_TIMEOUT_MS        30000u
+#endif
+
+/* Client addresses followed by the rate limiter of a server, a power of
+ * 2; an address is looked up in HTTP_RATE_PROBE entries from its hash */
+#ifndef HTTP_RATE_BUCKETS
+#define HTTP_RATE_BUCKETS       32u
+#endif
+#define HTTP_RATE_PROBE         4u
+
+/* Outgoing chunks that can be queued on one connection */
+#ifndef HTTP_SEND_QUEUE_LEN
+#define HTTP_SEND_QUEUE_LEN     8u
+#endif
+
+/* Queued bytes above which submitting reports HTTP_RETURN_BUSY */
+#ifndef HTTP_SEND_HIGH_WATER
+#define HTTP_SEND_HIGH_WATER    8192u
+#endif
+
+/* Size of the per-connection transmit stage, writes are coalesced up to
+ * the smaller of this and the MSS of the connection */
+#ifndef HTTP_TX_BUFFER_SIZE
+#define HTTP_TX_BUFFER_SIZE     1460u
+#endif
+
+/* Room for the headers added with pico_http_add_header(), per connection */
+#ifndef HTTP_EXTRA_HEADERS_SIZE
+#define HTTP_EXTRA_HEADERS_SIZE 128u
+#endif
+
+/* Ranges served from one request, a part of a multipart/byteranges
+ * answer takes two send queue slots and the closing boundary one */
+#define HTTP_RANGE_MAX          ((HTTP_SEND_QUEUE_LEN - 1u) / 2u)
+#define HTTP_RANGE_BOUNDARY     "pico_http_byteranges"
+
+/* window of a multipart/form-data body, holds the headers of a part */
+#ifndef HTTP_MULTIPART_BUFFER_SIZE
+#define HTTP_MULTIPART_BUFFER_SIZE  512u
+#endif
+
+/* Connection slots of the default server carved at start, 0 allocates
+ * the connections as they are accepted */
+#ifndef HTTP_SERVER_POOL_CONNECTIONS
+#define HTTP_SERVER_POOL_CONNECTIONS    0u
+#endif
+
+/* Room of a pooled connection for the buffers submitted as HTTP_BUFFER_COPY */
+#ifndef HTTP_POOL_COPY_SIZE
+#define HTTP_POOL_COPY_SIZE     2048u
+#endif
+
+/* the parts of a pool slot start on pointer aligned offsets */
+#define http_pool_align(size)   (((uint32_t)(size) + sizeof(void *) - 1u) & ~(uint32_t)(sizeof(void *) - 1u))
+
+/* "\r\n--" followed by a boundary of at most 70 characters */
+#define HTTP_MULTIPART_DELIM_MAX    74u
+
+/* path parameters captured by a route, like ":id" in "/users/:id" */
+#ifndef HTTP_ROUTE_PARAMS_MAX
+#define HTTP_ROUTE_PARAMS_MAX       4u
+#endif
+
+/* methods that can be routed, HTTP_METHOD_GET and HTTP_METHOD_POST */
+#define HTTP_ROUTE_METHODS          2u
+
+/* room needed for a chunk size line : 8 hex digits and CRLF */
+#define HTTP_CHUNK_LINE_MAX     10u
+
+/* framing around a reserved chunk : 4 hex digits, CRLF, then CRLF */
+#define HTTP_RESERVE_LINE       6u
+#define HTTP_RESERVE_FRAMING    (HTTP_RESERVE_LINE + 2u)
+
+/* A connection ID holds the index of the connection in the connection
+ * table in its low bits and the generation of that entry above them, so
+ * a stale ID does not match once the entry is reused. The table bounds
+ * the connections of all the servers together; a build needing more
+ * raises it, at the cost of fewer generations per entry */
+#ifndef HTTP_CONN_SLOT_BITS
+#define HTTP_CONN_SLOT_BITS     8u
+#endif
+#define HTTP_CONN_SLOTS         (1u << HTTP_CONN_SLOT_BITS)
+#define HTTP_CONN_GENERATIONS   (1u << (16u - HTTP_CONN_SLOT_BITS))
+
+/* Bytes a connection writes in its turn before the next connection with
+ * pending output gets the socket layer */
+#ifndef HTTP_TX_QUANTUM
+#define HTTP_TX_QUANTUM         4096u
+#endif
+
+/* Compression of the responses asking for it, see pico_http_compress().
+ * A compressed response holds about (1 << (window bits + 2)) +
+ * (1 << (memory level + 9)) bytes of zlib state while it is sent. */
+#ifndef HTTP_DEFLATE_WINDOW_BITS
+#define HTTP_DEFLATE_WINDOW_BITS    10u
+#endif
+#ifndef HTTP_DEFLATE_MEM_LEVEL
+#define HTTP_DEFLATE_MEM_LEVEL      3u
+#endif
+#ifndef HTTP_DEFLATE_LEVEL
+#define HTTP_DEFLATE_LEVEL          6
+#endif
+
+/* priority classes, HTTP_PRIORITY_INTERACTIVE and HTTP_PRIORITY_BULK */
+#define HTTP_PRIORITIES         2u
+
+/* Comment sent on an idle text/event-stream response, or ping on an idle
+ * WebSocket, so proxies and browsers do not drop it */
+#ifndef HTTP_EVENT_HEARTBEAT_MS
+#define HTTP_EVENT_HEARTBEAT_MS     15000u
+#endif
+
+/* WebSocket handshake and closing codes, RFC 6455 */
+#define HTTP_WS_GUID                "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define HTTP_WS_KEY_LEN             24u
+#define HTTP_WS_ACCEPT_LEN          28u
+#define HTTP_WS_HEADER_MAX          10u     /* frame header sent, without a mask */
+#define HTTP_WS_CONTROL_MAX         125u
+#define HTTP_WS_STATUS_PROTOCOL     1002u
+#define HTTP_WS_STATUS_TOO_BIG      1009u
+
+/* Period of the server housekeeping timer, the resolution of the deadlines */
+#define HTTP_SERVER_TICK_MS     500u
+
+/* The deadlines sit on a wheel of two levels : the first one has a slot
+ * per tick, the second a slot per turn of the first. Deadlines further
+ * than HTTP_WHEEL_SPAN ticks are cut down to it. */
+#define HTTP_WHEEL_BITS         6u
+#define HTTP_WHEEL_SLOTS        (1u << HTTP_WHEEL_BITS)
+#define HTTP_WHEEL_SPAN         (HTTP_WHEEL_SLOTS * (HTTP_WHEEL_SLOTS - 1u))
+
+/* Complete answers written as they are, the connection closes behind them */
 static const char return_fail_header[] =
     "HTTP/1.1 404 Not Found\r\n\
 Host: localhost\r\n\
@@ -36,46 +204,310 @@ Connection: close\r\n\
 \r\n\
 <html><body>There was a problem with your request !</body></html>";
 
+static const char too_many_header[] =
+    "HTTP/1.1 429 Too Many Requests\r\n\
+Host: localhost\r\n\
+Retry-After: 1\r\n\
+Content-Length: 0\r\n\
+Connection: close\r\n\
+\r\n";
+
+static const char busy_header[] =
+    "HTTP/1.1 503 Service Unavailable\r\n\
+Host: localhost\r\n\
+Retry-After: " HTTP_RETRY_AFTER "\r\n\
+Content-Length: 0\r\n\
+Connection: close\r\n\
+\r\n";
 
-int32_t construct_return_ok_header(char* headerstring, uint8_t cacheable, const char* contenttype)
+/*
+ * Fragments of the response header, concatenated as they are.
+ * Their lengths are known at compile time, so a response header is
+ * put together with a few copies and without any formatting.
+ */
+static const char http_hdr_status_ok[] = "HTTP/1.1 200 OK\r\nHost: localhost\r\n";
+static const char http_hdr_status_not_modified[] = "HTTP/1.1 304 Not Modified\r\nHost: localhost\r\n";
+static const char http_hdr_status_partial[] = "HTTP/1.1 206 Partial Content\r\nHost: localhost\r\n";
+static const char http_hdr_status_range_nok[] = "HTTP/1.1 416 Range Not Satisfiable\r\nHost: localhost\r\n";
+static const char http_hdr_cacheable[] = "Cache-control: public, max-age=86400\r\n";
+static const char http_hdr_content_type[] = "Content-Type: ";
+static const char http_hdr_chunked[] = "Transfer-Encoding: chunked\r\n";
+static const char http_hdr_content_length[] = "Content-Length: ";
+static const char http_hdr_keep_alive[] = "Connection: keep-alive\r\n\r\n";
+static const char http_hdr_close[] = "Connection: close\r\n\r\n";
+static const char http_hdr_etag[] = "ETag: ";
+static const char http_hdr_last_modified[] = "Last-Modified: ";
+static const char http_hdr_gzip[] = "Content-Encoding: gzip\r\n";
+static const char http_hdr_deflate[] = "Content-Encoding: deflate\r\n";
+static const char http_hdr_vary[] = "Vary: Accept-Encoding\r\n";
+static const char http_hdr_accept_ranges[] = "Accept-Ranges: bytes\r\n";
+static const char http_hdr_content_range[] = "Content-Range: bytes ";
+static const char http_byteranges_type[] = "multipart/byteranges; boundary=" HTTP_RANGE_BOUNDARY;
+static const char http_byteranges_end[] = "\r\n--" HTTP_RANGE_BOUNDARY "--\r\n";
+static const char http_hdr_switching[] =
+    "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
+
+#define http_fragment_len(fragment)     ((uint16_t)(sizeof(fragment) - 1u))
+
+/* inclusive byte range of a body */
+struct http_range
 {
-    strcat(headerstring, "HTTP/1.1 200 OK\r\n");
-    strcat(headerstring, "Host: localhost\r\n");
-    if (cacheable == HTTP_CACHEABLE_RESOURCE)
-    {
-        strcat(headerstring, "Cache-control: public, max-age=86400\r\n");
-    }
-    if (contenttype != NULL)
-    {
-        sprintf(headerstring, "%sContent-Type: %s\r\n", headerstring, contenttype);
-    }
-    strcat(headerstring, "Transfer-Encoding: chunked\r\n");
-    strcat(headerstring, "Connection: close\r\n");
-    strcat(headerstring, "\r\n");
-    return strlen(headerstring);
-}
+    uint32_t first;
+    uint32_t last;
+};
+
+/* a response header is collected as a list of parts, then copied at once */
+struct http_hdr_part
+{
+    const char *data;
+    uint16_t len;
+};
+
+#define HTTP_HDR_PARTS_MAX      20u
+
+#define http_hdr_part(parts, count, fragment, length) \
+    do { (parts)[(count)].data = (fragment); (parts)[(count)++].len = (length); } while (0)
+
+/* content encoding of the response body */
+#define HTTP_ENCODING_GZIP      1u
+#define HTTP_ENCODING_VARY      2u  /* the body depends on Accept-Encoding */
+#define HTTP_ENCODING_DEFLATE   4u
+
+/*
+ * Perfect hash over the indexed request headers:
+ * ((name[0] | 0x20) + 11 * (name[len - 1] | 0x20) + 26 * len) & 31
+ * The constants were searched offline so that every known header lands
+ * in its own slot. The name is still compared, since unknown headers
+ * can hash to an occupied slot.
+ */
+#define http_header_hash(name, len) \
+    ((uint8_t)(((uint32_t)((name)[0] | 0x20) + 11u * (uint32_t)((name)[(len) - 1u] | 0x20) + 26u * (uint32_t)(len)) & 31u))
+
+static const uint8_t http_header_slots[32] = {
+    HTTP_HDR_SEC_WEBSOCKET_KEY, HTTP_HDR_CONNECTION, HTTP_HDR_UPGRADE, HTTP_HDR_NONE,
+    HTTP_HDR_NONE, HTTP_HDR_ORIGIN, HTTP_HDR_NONE, HTTP_HDR_CONTENT_LENGTH,
+    HTTP_HDR_NONE, HTTP_HDR_NONE, HTTP_HDR_LAST_EVENT_ID, HTTP_HDR_RANGE,
+    HTTP_HDR_HOST, HTTP_HDR_AUTHORIZATION, HTTP_HDR_NONE, HTTP_HDR_SEC_WEBSOCKET_VERSION,
+    HTTP_HDR_IF_RANGE, HTTP_HDR_NONE, HTTP_HDR_CONTENT_TYPE, HTTP_HDR_IF_NONE_MATCH,
+    HTTP_HDR_ACCEPT_ENCODING, HTTP_HDR_USER_AGENT, HTTP_HDR_COOKIE, HTTP_HDR_NONE,
+    HTTP_HDR_NONE, HTTP_HDR_ACCEPT, HTTP_HDR_IF_MODIFIED_SINCE, HTTP_HDR_TRANSFER_ENCODING,
+    HTTP_HDR_NONE, HTTP_HDR_EXPECT, HTTP_HDR_NONE, HTTP_HDR_NONE
+};
+
+/* lower case names, indexed by header id */
+static const char *const http_header_names[HTTP_HDR_COUNT] = {
+    "host", "connection", "content-length", "content-type", "transfer-encoding",
+    "accept-encoding", "if-none-match", "if-modified-since", "range", "if-range",
+    "upgrade", "sec-websocket-key", "sec-websocket-version", "last-event-id", "expect",
+    "user-agent", "accept", "cookie", "authorization", "origin"
+};
+
+/* value of an indexed header, as offset and length inside the receive buffer */
+struct http_header_field
+{
+    uint16_t offset;        /* 0 if the header was not received */
+    uint16_t len;
+};
 
+/* token buckets of a client address, refilled on use */
+struct http_rate_bucket
+{
+    uint32_t addr;
+    uint8_t used;           /* the entry holds the buckets of addr */
+    pico_time last;         /* last refill */
+    uint32_t requests;      /* request tokens, in thousandths */
+    int64_t bytes;          /* byte tokens, in thousandths, negative while in debt */
+};
 
-struct http_server
+/* server instance, with its listeners, connections and settings */
+struct pico_http_server
 {
     uint16_t state;
-    struct pico_socket *sck;
-    uint16_t port;
+    struct pico_socket *sck[HTTP_SERVER_LISTENERS];
     void (*wakeup)(uint16_t ev, uint16_t param);
     uint8_t accepted;
+    uint8_t auto_accept;                /* the server accepts, EV_HTTP_CON reports the connection */
+    uint16_t backlog;
+    uint16_t max_connections;
+    uint16_t connections;
+    uint16_t rx_size;
+    uint16_t tx_size;
+    uint32_t keepalive_timeout;
+    uint16_t keepalive_max;
+    uint32_t header_timeout;
+    uint32_t body_timeout;
+    uint32_t response_timeout;
+    uint16_t rate_requests;             /* per second and client address, 0 for no limit */
+    uint32_t rate_bytes;
+    struct http_rate_bucket rate[HTTP_RATE_BUCKETS];
+    uint8_t deflate_window_bits;
+    uint8_t deflate_mem_level;
+    uint32_t send_highwater;
+    uint32_t event_heartbeat;
+    const struct pico_http_static_asset *assets;
+    uint16_t asset_count;
+    struct http_route_node *routes;
+    uint8_t *pool;                      /* arena of the connection slots, NULL if allocated on accept */
+    uint32_t pool_slot_size;
+    struct http_client *pool_free;      /* free slots */
+    struct pico_tree clients;
+    struct pico_http_server *next;      /* in the list of running servers */
+};
+
+/* multipart/form-data parser of a request body */
+struct http_multipart
+{
+    void (*part)(uint16_t conn, const struct pico_http_part *part);
+    void (*data)(uint16_t conn, const uint8_t *data, uint16_t len);
+    uint8_t state;
+    uint8_t delim_len;
+    uint8_t delim[HTTP_MULTIPART_DELIM_MAX];
+    uint8_t skip[256];      /* Horspool shifts of the delimiter */
+    uint16_t pos;           /* first byte of buf not parsed yet */
+    uint16_t len;           /* bytes in buf */
+    uint8_t buf[HTTP_MULTIPART_BUFFER_SIZE + 1u];
+};
+
+/*
+ * Node of the route tree. Labels point inside the registered patterns,
+ * static children start with distinct characters, a parameter child
+ * matches one whole path segment.
+ */
+struct http_route_node
+{
+    const char *label;
+    uint16_t label_len;
+    struct http_route_node *child;      /* first static child */
+    struct http_route_node *next;       /* next sibling */
+    struct http_route_node *param;      /* ":name" child */
+    void (*handler[HTTP_ROUTE_METHODS])(uint16_t conn);
+};
+
+/* path parameter of the matched route, as offset and length in the resource */
+struct http_route_param
+{
+    const char *name;
+    uint8_t name_len;
+    uint16_t offset;
+    uint16_t len;
+};
+
+/* outgoing chunk waiting in the send queue of a connection */
+struct http_send_desc
+{
+    uint8_t *data;
+    uint32_t len;
+    uint8_t ownership;      /* HTTP_BUFFER_COPY, HTTP_BUFFER_STATIC, HTTP_BUFFER_TAKE or HTTP_BUFFER_SHARED */
+};
+
+/* ownership of a published event, queued on every subscriber */
+#define HTTP_BUFFER_SHARED      3u
+/* ownership of a chunk built in the copy area of a pooled connection */
+#define HTTP_BUFFER_ARENA       4u
+
+/* serialized event of a channel, its text follows the structure */
+struct http_event
+{
+    uint32_t refs;          /* send queues holding it, plus one while in the history */
+    uint32_t id;
+    uint32_t len;
+};
+
+/* event channel of event streams and WebSockets, the subscribers are
+ * linked through their connections */
+struct pico_http_events
+{
+    uint32_t last_id;
+    struct http_client *subscribers;
+    struct http_event **history;    /* ring of the last events, for resuming */
+    uint16_t history_size;
+    uint16_t history_head;          /* oldest event */
+    uint16_t history_count;
 };
 
 struct http_client
 {
     uint16_t connectionID;
+    struct pico_http_server *server;
     struct pico_socket *sck;
-    void *buffer;
-    uint16_t buffer_size;
-    uint16_t buffer_sent;
+    uint32_t peer;          /* address of the client */
+    uint8_t rate_slot;      /* its entry in the rate limiter */
+    struct http_send_desc queue[HTTP_SEND_QUEUE_LEN];
+    uint8_t queue_head;
+    uint8_t queue_count;
+    uint32_t queue_bytes;   /* payload bytes queued, including the head */
+    uint8_t head_stage;     /* part of the head chunk being staged */
+    uint32_t head_sent;     /* payload bytes of the head chunk already out */
+    uint8_t *tx_buf;        /* transmit stage, framing and small payloads */
+    uint16_t tx_cap;        /* allocated size of tx_buf */
+    uint16_t tx_size;       /* usable size of tx_buf, at most one segment */
+    uint16_t tx_len;        /* bytes staged */
+    uint16_t tx_sent;       /* staged bytes already written */
+    uint16_t tx_reserved;   /* room handed out by pico_http_reserve(), 0 if none */
+    uint16_t tx_reserve_at; /* tx_len when it was handed out */
+    uint8_t tx_wanted;      /* a reservation failed, EV_HTTP_SENT once the stage drains */
+    int32_t (*produce)(uint16_t conn, uint8_t *buf, uint16_t len, void *arg);
+    void *produce_arg;
+    uint8_t produce_wait;   /* the producer had nothing ready */
+    uint8_t tx_ready;       /* waiting in the run queue of its priority class */
+    uint8_t pending;        /* HTTP_PENDING_* work left to the next transmit run */
+    uint8_t priority;       /* HTTP_PRIORITY_* class of the connection */
+    uint32_t tx_turn;       /* bytes written in the current turn */
+    struct http_client *tx_next;    /* next connection in the run queue */
+    char *extra_hdr;        /* headers added for the next response */
+    uint16_t extra_len;
+    uint8_t *copy_buf;      /* pooled : room for the HTTP_BUFFER_COPY chunks, a FIFO */
+    uint16_t copy_start;    /* oldest copied byte still queued */
+    uint16_t copy_end;      /* where the next copy goes */
+    uint16_t copy_limit;    /* end of the older copies once wrapped, 0 otherwise */
+    uint8_t copy_count;     /* copies in the send queue */
+    uint8_t pooled;         /* the connection is a slot of the server arena */
+    struct http_client *pool_next;  /* next free slot */
+    uint8_t identity;       /* the body is sent as is, its length was announced */
+    uint32_t content_left;  /* bytes of an identity body not submitted yet */
+    const char *etag;       /* validators sent with the response */
+    uint32_t last_modified;
+    uint8_t encoding;       /* HTTP_ENCODING_* flags of the response */
+#ifdef PICO_HTTP_SERVER_DEFLATE
+    uint8_t compress;       /* HTTP_ENCODING_* asked with pico_http_compress() */
+    uint8_t deflate_dirty;  /* input went in since the last flush */
+    z_stream *deflate;      /* compressor of the response body, NULL if sent as is */
+#endif
+    uint8_t accept_ranges;  /* the response is a static buffer that can be sliced */
+    uint8_t auto_response;  /* answered by the server, the application did not see it */
+    uint8_t events;         /* the response is a text/event-stream */
+    void (*ws_message)(uint16_t conn, uint8_t opcode, const uint8_t *data, uint32_t len, uint8_t fin);
+    uint8_t ws_closing;     /* a close frame was sent, the answer ends the connection */
+    uint8_t ws_fragmented;  /* a fragmented message waits for its continuations */
+    struct pico_http_events *channel;   /* channel the connection is subscribed to */
+    struct http_client *channel_next;
     char *resource;
     uint16_t state;
     uint16_t method;
     char *body;
+    uint8_t *rx_buf;        /* receive buffer, holds the request header */
+    uint16_t rx_size;       /* usable size of rx_buf */
+    uint16_t rx_len;        /* bytes available in rx_buf */
+    uint16_t rx_scan;       /* where the scan for the next '\n' resumes */
+    uint16_t line_start;    /* start of the line being parsed */
+    uint16_t hdr_len;       /* length of the header including the empty line */
+    uint16_t body_pos;      /* next unread body byte in rx_buf */
+    uint8_t body_state;     /* HTTP_BODY_* decoding state of the request body */
+    uint8_t body_chunked;   /* the request body has chunked framing */
+    uint8_t body_paused;    /* EV_HTTP_BODY is held back, the TCP window fills up */
+    uint32_t body_left;     /* payload bytes left in the body or in the chunk */
+    uint16_t body_end;      /* end of a buffered body cut from pipelined data, 0 if none */
+    uint8_t body_end_byte;  /* first pipelined byte, replaced by the terminator of body */
+    struct http_multipart *multipart;
+    struct http_header_field headers[HTTP_HDR_COUNT];
+    struct http_route_param params[HTTP_ROUTE_PARAMS_MAX];
+    uint8_t param_count;
+    uint8_t keep_alive;     /* reuse the connection after this response */
+    uint16_t requests;      /* requests served on this connection */
+    uint8_t timeout_kind;   /* HTTP_TIMEOUT_* deadline on the wheel */
+    uint32_t expires;       /* wheel tick of the deadline */
+    struct http_client *wheel_next;
+    struct http_client **wheel_link;    /* link to this connection, NULL when not on the wheel */
 };
 
 /* Local states for clients */
@@ -85,23 +517,142 @@ struct http_client
 #define HTTP_WAIT_RESPONSE          3
 #define HTTP_WAIT_DATA              4
 #define HTTP_WAIT_STATIC_DATA       5
-#define HTTP_SENDING_DATA           6
-#define HTTP_SENDING_STATIC_DATA    7
+#define HTTP_FLUSHING               6
 #define HTTP_SENDING_FINAL          8
 #define HTTP_ERROR                  9
 #define HTTP_CLOSED                 10
-
-static struct http_server server = {
-    0
+#define HTTP_WEBSOCKET              11  /* upgraded, the frame engine owns the socket */
+
+/* Work deferred to the transmit run, so the application is not re-entered */
+#define HTTP_PENDING_REQUEST        1u  /* parse the next request of a persistent connection */
+#define HTTP_PENDING_BODY           2u  /* signal a body of which reading was resumed */
+#define HTTP_PENDING_FRAMES         4u  /* WebSocket frames came with the handshake */
+#define HTTP_PENDING_DROP           8u  /* close, the connection could not take an event */
+
+/* States of the multipart/form-data parser */
+#define HTTP_MP_PREAMBLE            0
+#define HTTP_MP_DELIMITER           1
+#define HTTP_MP_HEADERS             2
+#define HTTP_MP_DATA                3
+#define HTTP_MP_EPILOGUE            4
+
+/* What a step of the multipart parser found */
+#define HTTP_MP_MORE                0
+#define HTTP_MP_PART                1
+#define HTTP_MP_SLICE               2
+#define HTTP_MP_END                 3
+
+/* Decoding states of a request body */
+#define HTTP_BODY_DONE              0
+#define HTTP_BODY_DATA              1
+#define HTTP_BODY_CHUNK_SIZE        2
+#define HTTP_BODY_CHUNK_END         3
+#define HTTP_BODY_TRAILER           4
+#define HTTP_BODY_ERROR             5
+
+/* Deadline of a connection, depending on what it waits for */
+#define HTTP_TIMEOUT_NONE           0
+#define HTTP_TIMEOUT_IDLE           1
+#define HTTP_TIMEOUT_HEADER         2
+#define HTTP_TIMEOUT_BODY           3
+#define HTTP_TIMEOUT_RESPONSE       4
+#define HTTP_TIMEOUT_HEARTBEAT      5   /* not a deadline, the event stream is idle */
+
+/* Parts of a chunk, in sending order */
+#define HTTP_CHUNK_SIZE_LINE        0
+#define HTTP_CHUNK_PAYLOAD          1
+#define HTTP_CHUNK_TRAIL            2
+
+static int32_t compare_clients(void *ka, void *kb);
+
+/* instance driven by pico_http_server_start() and the calls without a handle */
+static struct pico_http_server default_server = {
+    .backlog = BACKLOG,
+    .rx_size = HTTP_RX_BUFFER_SIZE,
+    .tx_size = HTTP_TX_BUFFER_SIZE,
+    .keepalive_timeout = HTTP_KEEPALIVE_TIMEOUT_MS,
+    .keepalive_max = HTTP_KEEPALIVE_MAX_REQUESTS,
+    .header_timeout = HTTP_HEADER_TIMEOUT_MS,
+    .body_timeout = HTTP_BODY_TIMEOUT_MS,
+    .response_timeout = HTTP_RESPONSE_TIMEOUT_MS,
+    .send_highwater = HTTP_SEND_HIGH_WATER,
+    .event_heartbeat = HTTP_EVENT_HEARTBEAT_MS,
+    .deflate_window_bits = HTTP_DEFLATE_WINDOW_BITS,
+    .deflate_mem_level = HTTP_DEFLATE_MEM_LEVEL,
+    .clients = { &LEAF, compare_clients }
 };
 
+/* servers with at least one listener */
+static struct pico_http_server *servers = NULL;
+
+/* server raising EV_HTTP_CON, and the listener to accept from */
+static struct pico_http_server *accepting = NULL;
+static struct pico_socket *accepting_sck = NULL;
+
+static uint8_t tick_running = 0;
+static pico_time tick_last = 0;    /* when the wheel last advanced without a timer */
+
+/* deadlines of the connections of all the servers */
+static struct http_client *wheel[2][HTTP_WHEEL_SLOTS];
+static uint32_t wheel_now = 0;     /* ticks since the first server started */
+
+/* connections of all the servers, indexed by the low bits of their ID */
+static struct http_client *conn_table[HTTP_CONN_SLOTS];
+static uint16_t conn_generation[HTTP_CONN_SLOTS];
+static uint16_t conn_cursor = 0;   /* where the search for a free entry starts */
+
+/* connections with output waiting for their turn, one queue per priority class */
+static struct http_client *tx_run_head[HTTP_PRIORITIES];
+static struct http_client *tx_run_tail[HTTP_PRIORITIES];
+static uint8_t tx_run_scheduled = 0;
+
 /*
  * Private functions
  */
-static int16_t parse_request(struct http_client *client);
-//static int read_remaining_reader(struct http_client *client);
+static int16_t read_header(struct http_client *client);
 static void send_data(struct http_client *client);
+static void http_send_queue_flush(struct http_client *client);
 static void send_final(struct http_client *client);
+static void http_tx_schedule(struct http_client *client);
+static void http_tx_unready(struct http_client *client);
+static void http_tx_recover(void);
+static void http_defer(struct http_client *client, uint8_t work);
+static int16_t http_serve_asset(struct http_client *client);
+static void http_route_free(struct http_route_node *node);
+static void http_server_close(struct pico_http_server *srv);
+static int16_t http_server_pool(struct pico_http_server *srv, uint16_t slots);
+static void http_accept_all(struct pico_http_server *srv, struct pico_socket *listener);
+static void http_reject(struct pico_socket *listener);
+static int32_t http_send_header(struct http_client *client, uint16_t status, uint16_t code, const char *mimetype, const char *content_range);
+static uint8_t http_header_accepts(const char *value, const char *token);
+static uint8_t http_header_has_token(const char *value, const char *token);
+static int8_t http_parse_uint(const char *str, uint16_t len, uint32_t *value);
+static int32_t http_body_read(struct http_client *client, uint8_t *buf, uint32_t len);
+static inline uint8_t http_body_pending(struct http_client *client);
+static void http_body_signal(struct http_client *client);
+static inline void http_tx_append(struct http_client *client, const void *data, uint16_t len);
+static void http_server_tick(pico_time now, void *arg);
+static void http_tick_arm(void);
+static uint8_t http_timers_needed(void);
+static void http_deadline_update(struct http_client *client, uint8_t restart);
+static void http_wheel_remove(struct http_client *client);
+static int8_t http_rate_admit(struct http_client *client);
+static void http_rate_charge(struct http_client *client, uint32_t bytes);
+static int8_t http_tx_produce(struct http_client *client);
+static void http_deflate_start(struct http_client *client);
+static void http_deflate_end(struct http_client *client);
+static void http_event_release(uint8_t *data);
+static void http_events_unsubscribe(struct http_client *client);
+static void http_heartbeat(struct http_client *client);
+static int16_t http_submit(struct http_client *client, void *buffer, uint32_t len, uint8_t ownership);
+static int32_t http_ws_read(struct http_client *client);
+#ifdef PICO_HTTP_SERVER_DEFLATE
+static int8_t http_deflate_run(struct http_client *client, uint8_t *progress);
+#define http_deflating(client)  ((client)->deflate != NULL)
+#else
+#define http_deflating(client)  0
+#define http_deflate_run(client, progress)  1
+#endif
 static inline int32_t read_data(struct http_client *client);  /* used only in a place */
 static inline struct http_client *find_client(uint16_t conn);
 
@@ -112,28 +663,53 @@ static int32_t compare_clients(void *ka, void *kb)
     return ((struct http_client *)ka)->connectionID - ((struct http_client *)kb)->connectionID;
 }
 
-PICO_TREE_DECLARE(pico_http_clients, compare_clients);
+static void http_request_error(struct http_client *client)
+{
+    /* send out error */
+    client->state = HTTP_ERROR;
+    pico_socket_write(client->sck, (const char *)error_header, sizeof(error_header) - 1);
+    client->server->wakeup(EV_HTTP_ERROR, client->connectionID);
+}
 
-void http_server_cbk(uint16_t ev, struct pico_socket *s)
+/*
+ * Closes a connection on behalf of the server. The application is
+ * notified, and the connection is released if it did not do it itself.
+ */
+static void http_client_expire(struct http_client *client)
+{
+    uint16_t conn = client->connectionID;
+
+    pico_socket_close(client->sck);
+    client->state = HTTP_CLOSED;
+    client->server->wakeup(EV_HTTP_CLOSE, conn);
+    if (find_client(conn))
+        pico_http_close(conn);
+}
+
+static void http_socket_event(uint16_t ev, struct pico_socket *s)
 {
-    struct pico_tree_node *index;
+    struct pico_http_server *srv;
     struct http_client *client = NULL;
     uint8_t server_event = 0u;
+    uint16_t conn = HTTP_SERVER_ID;
+    uint8_t i;
 
-    /* determine the client for the socket */
-    if (s == server.sck)
-    {
-        server_event = 1u;
-    }
-    else
+    /* an accepted socket carries the ID of its connection, which finds
+     * nothing once the connection is released; else it is a listener */
+    client = find_client((uint16_t)(uintptr_t)s->priv);
+    if (client && client->sck != s)
+        client = NULL;
+
+    for (srv = client ? client->server : servers; srv && !client && !server_event; srv = srv->next)
     {
-        pico_tree_foreach(index, &pico_http_clients)
+        for (i = 0; i < HTTP_SERVER_LISTENERS; i++)
         {
-            client = index->keyValue;
-            if (client->sck == s) break;
-
-            client = NULL;
+            if (srv->sck[i] && s == srv->sck[i])
+                server_event = 1u;
         }
+
+        if (server_event)
+            break;
     }
 
     if (!client && !server_event)
@@ -141,774 +717,5180 @@ void http_server_cbk(uint16_t ev, struct pico_socket *s)
         return;
     }
 
-    if (ev & PICO_SOCK_EV_RD)
+    if (client)
+        conn = client->connectionID;
+
+    if ((ev & PICO_SOCK_EV_RD) && client)
     {
 
         if (read_data(client) == HTTP_RETURN_ERROR)
-        {
-            /* send out error */
-            client->state = HTTP_ERROR;
-            pico_socket_write(client->sck, (const char *)error_header, sizeof(error_header) - 1);
-            server.wakeup(EV_HTTP_ERROR, client->connectionID);
-        }
+            http_request_error(client);
+        /* the connection may have been released meanwhile */
+        if (!find_client(conn))
+            return;
+
+        http_deadline_update(client, 1u);
     }
 
-    if (ev & PICO_SOCK_EV_WR)
+    if ((ev & PICO_SOCK_EV_WR) && client)
     {
-        if (client->state == HTTP_SENDING_DATA || client->state == HTTP_SENDING_STATIC_DATA)
+        if (client->state == HTTP_WAIT_DATA || client->state == HTTP_WAIT_STATIC_DATA ||
+            client->state == HTTP_SENDING_FINAL || client->state == HTTP_FLUSHING || client->state == HTTP_WEBSOCKET)
         {
             send_data(client);
-        }
-        else if (client->state == HTTP_SENDING_FINAL)
-        {
-            send_final(client);
+            if (!find_client(conn))
+                return;
         }
     }
 
-    if (ev & PICO_SOCK_EV_CONN)
+    if ((ev & PICO_SOCK_EV_CONN) && srv->auto_accept)
     {
-        server.accepted = 0u;
-        server.wakeup(EV_HTTP_CON, HTTP_SERVER_ID);
-        if (!server.accepted)
-        {
-            pico_socket_close(s); /* reject socket */
-        }
+        http_accept_all(srv, s);
+    }
+    else if (ev & PICO_SOCK_EV_CONN)
+    {
+        srv->accepted = 0u;
+        accepting = srv;
+        accepting_sck = s;
+        srv->wakeup(EV_HTTP_CON, HTTP_SERVER_ID);
+        accepting = NULL;
+        accepting_sck = NULL;
+        if (!srv->accepted)
+            http_reject(s);
     }
 
     if ((ev & PICO_SOCK_EV_CLOSE) || (ev & PICO_SOCK_EV_FIN))
     {
-        server.wakeup(EV_HTTP_CLOSE, (uint16_t)(server_event ? HTTP_SERVER_ID : (client->connectionID)));
+        srv->wakeup(EV_HTTP_CLOSE, (uint16_t)(server_event ? HTTP_SERVER_ID : (client->connectionID)));
     }
 
     if (ev & PICO_SOCK_EV_ERR)
     {
-        server.wakeup(EV_HTTP_ERROR, (uint16_t)(server_event ? HTTP_SERVER_ID : (client->connectionID)));
+        srv->wakeup(EV_HTTP_ERROR, (uint16_t)(server_event ? HTTP_SERVER_ID : (client->connectionID)));
     }
 }
 
-/*
- * API for starting the server. If 0 is passed as a port, the port 80
- * will be used.
- */
-int16_t pico_http_server_start(uint16_t port, void (*wakeup)(uint16_t ev, uint16_t conn))
+void http_server_cbk(uint16_t ev, struct pico_socket *s)
+{
+    /* output left behind by a failed timer goes first, and a wheel
+     * stopped by one starts again */
+    http_tx_recover();
+    if (!tick_running && http_timers_needed())
+        http_tick_arm();
+
+    http_socket_event(ev, s);
+
+    /* the output of the callbacks, for the connections no timer writes */
+    http_tx_recover();
+}
+
+/* opens one more listener of a server, the port is in network order */
+static int16_t http_server_listen(struct pico_http_server *srv, uint16_t port)
 {
     struct pico_ip4 anything = {
         0
     };
+    struct pico_http_server *it;
+    struct pico_socket *sck;
+    uint8_t i;
 
-    server.port = (uint16_t)(port ? short_be(port) : short_be(80u));
-
-    if (!wakeup)
+    for (i = 0; i < HTTP_SERVER_LISTENERS && srv->sck[i]; i++)
+        ;
+    if (i == HTTP_SERVER_LISTENERS)
     {
         pico_err = PICO_ERR_EINVAL;
         return HTTP_RETURN_ERROR;
     }
 
-    server.sck = pico_socket_open(PICO_PROTO_IPV4, PICO_PROTO_TCP, &http_server_cbk);
+    sck = pico_socket_open(PICO_PROTO_IPV4, PICO_PROTO_TCP, &http_server_cbk);
 
-    if (!server.sck)
+    if (!sck)
     {
         pico_err = PICO_ERR_EFAULT;
         return HTTP_RETURN_ERROR;
     }
 
-    if (pico_socket_bind(server.sck, &anything, &server.port) != 0)
+    if (pico_socket_bind(sck, &anything, &port) != 0)
     {
+        pico_socket_close(sck);
         pico_err = PICO_ERR_EADDRNOTAVAIL;
         return HTTP_RETURN_ERROR;
     }
 
-    if (pico_socket_listen(server.sck, BACKLOG) != 0)
+    if (pico_socket_listen(sck, srv->backlog) != 0)
     {
+        pico_socket_close(sck);
         pico_err = PICO_ERR_EADDRINUSE;
         return HTTP_RETURN_ERROR;
     }
 
-    server.wakeup = wakeup;
-    server.state = HTTP_SERVER_LISTEN;
+    srv->sck[i] = sck;
+    srv->state = HTTP_SERVER_LISTEN;
+    for (it = servers; it && it != srv; it = it->next)
+        ;
+    if (!it)
+    {
+        srv->next = servers;
+        servers = srv;
+    }
+
+    if (!tick_running && http_timers_needed())
+        http_tick_arm();
+    else if (!tick_running)
+        tick_last = PICO_TIME_MS();
+
     return HTTP_RETURN_OK;
 }
 
 /*
- * API for accepting new connections. This function should be
- * called when the event EV_HTTP_CON is triggered, if not called
- * when noticed the connection will be considered rejected and the
- * socket will be dropped.
- *
- * Returns the ID of the new connection or a negative value if error.
+ * API for starting the server. If 0 is passed as a port, the port 80
+ * will be used.
  */
-int32_t pico_http_server_accept(void)
+int16_t pico_http_server_start(uint16_t port, void (*wakeup)(uint16_t ev, uint16_t conn))
 {
-    struct pico_ip4 orig;
-    struct http_client *client;
-    uint16_t port;
-
-    client = PICO_ZALLOC(sizeof(struct http_client));
-    if (!client)
+    if (!wakeup)
     {
-        pico_err = PICO_ERR_ENOMEM;
+        pico_err = PICO_ERR_EINVAL;
         return HTTP_RETURN_ERROR;
     }
 
-    client->sck = pico_socket_accept(server.sck, &orig, &port);
+    default_server.wakeup = wakeup;
+    if (HTTP_SERVER_POOL_CONNECTIONS && !default_server.pool &&
+        http_server_pool(&default_server, HTTP_SERVER_POOL_CONNECTIONS) < 0)
+        return HTTP_RETURN_ERROR;
 
-    if (!client->sck)
+    return http_server_listen(&default_server, (uint16_t)(port ? short_be(port) : short_be(80u)));
+}
+
+/*
+ * Creates a server instance with its own listeners, connections and
+ * settings, so busy and quiet services can be tuned separately. The
+ * fields of config left to 0 take the compile time defaults. It starts
+ * listening on config->port, 80 if 0; more ports can be added with
+ * pico_http_server_listen(). Connection IDs are unique across instances,
+ * so the calls taking a connection work for all of them.
+ *
+ * With config->pool_connections set, the connections are carved out of
+ * one arena here and reused; max_connections is capped to the pool.
+ * Accepting them, parsing requests and sending responses, events and
+ * WebSocket frames does not touch the allocator. Such a server arms no
+ * timer either : its output is written at the end of the socket event,
+ * and its deadlines advance with pico_http_server_poll(). Only the
+ * optional features allocate : event channels, response compression and
+ * chunks given with HTTP_BUFFER_TAKE.
+ */
+struct pico_http_server *pico_http_server_create(const struct pico_http_server_config *config,
+                                                 void (*wakeup)(uint16_t ev, uint16_t conn))
+{
+    struct pico_http_server *srv;
+
+    if (!config || !wakeup || (config->rx_buffer_size && config->rx_buffer_size < HTTP_HEADER_MAX_LINE) ||
+        (config->tx_buffer_size && config->tx_buffer_size < HTTP_HEADER_MAX_LINE) ||
+        (config->deflate_window_bits && (config->deflate_window_bits < 9u || config->deflate_window_bits > 15u)) ||
+        config->deflate_mem_level > 9u)
+    {
+        pico_err = PICO_ERR_EINVAL;
+        return NULL;
+    }
+
+    srv = PICO_ZALLOC(sizeof(struct pico_http_server));
+    if (!srv)
     {
         pico_err = PICO_ERR_ENOMEM;
-        PICO_FREE(client);
-        return HTTP_RETURN_ERROR;
+        return NULL;
     }
 
-    server.accepted = 1u;
-    /* buffer used for async sending */
-    client->state = HTTP_WAIT_HDR;
-    client->buffer = NULL;
-    client->buffer_size = 0;
-    client->body = NULL;
-    client->connectionID = pico_rand() & 0x7FFF;
+    srv->wakeup = wakeup;
+    srv->backlog = config->backlog ? config->backlog : BACKLOG;
+    srv->max_connections = config->max_connections;
+    srv->auto_accept = config->auto_accept ? 1u : 0u;
+    srv->rx_size = config->rx_buffer_size ? config->rx_buffer_size : HTTP_RX_BUFFER_SIZE;
+    srv->tx_size = config->tx_buffer_size ? config->tx_buffer_size : HTTP_TX_BUFFER_SIZE;
+    srv->keepalive_timeout = config->keepalive_timeout_ms ? config->keepalive_timeout_ms : HTTP_KEEPALIVE_TIMEOUT_MS;
+    srv->keepalive_max = config->keepalive_max_requests ? config->keepalive_max_requests : HTTP_KEEPALIVE_MAX_REQUESTS;
+    srv->send_highwater = config->send_highwater ? config->send_highwater : HTTP_SEND_HIGH_WATER;
+    srv->header_timeout = config->header_timeout_ms ? config->header_timeout_ms : HTTP_HEADER_TIMEOUT_MS;
+    srv->body_timeout = config->body_timeout_ms ? config->body_timeout_ms : HTTP_BODY_TIMEOUT_MS;
+    srv->response_timeout = config->response_timeout_ms ? config->response_timeout_ms : HTTP_RESPONSE_TIMEOUT_MS;
+    srv->event_heartbeat = config->event_heartbeat_ms ? config->event_heartbeat_ms : HTTP_EVENT_HEARTBEAT_MS;
+    srv->rate_requests = config->rate_requests;
+    srv->rate_bytes = config->rate_bytes;
+    srv->deflate_window_bits = config->deflate_window_bits ? config->deflate_window_bits : HTTP_DEFLATE_WINDOW_BITS;
+    srv->deflate_mem_level = config->deflate_mem_level ? config->deflate_mem_level : HTTP_DEFLATE_MEM_LEVEL;
+    srv->clients.root = &LEAF;
+    srv->clients.compare = compare_clients;
+
+    if (config->pool_connections && http_server_pool(srv, config->pool_connections) < 0)
+    {
+        PICO_FREE(srv);
+        return NULL;
+    }
 
-    /* add element to the tree, if duplicate because the rand */
-    /* regenerate */
-    while (pico_tree_insert(&pico_http_clients, client) != NULL)
-        client->connectionID = pico_rand() & 0x7FFF;
-    return client->connectionID;
+    if (http_server_listen(srv, (uint16_t)(config->port ? short_be(config->port) : short_be(80u))) < 0)
+    {
+        PICO_FREE(srv->pool);
+        PICO_FREE(srv);
+        return NULL;
+    }
+
+    return srv;
 }
 
 /*
- * Function used for getting the resource asked by the
- * client. It is useful after the request header (EV_HTTP_REQ)
- * from client was received, otherwise NULL is returned.
+ * Adds a listening port to a server instance, at most
+ * HTTP_SERVER_LISTENERS per instance.
  */
-char *pico_http_get_resource(uint16_t conn)
+int16_t pico_http_server_listen(struct pico_http_server *srv, uint16_t port)
 {
-    struct http_client *client = find_client(conn);
+    if (!srv || !srv->wakeup || !port)
+    {
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
 
-    if (!client)
-        return NULL;
-    else
-        return client->resource;
+    return http_server_listen(srv, short_be(port));
 }
 
 /*
- * Function used for getting the method coming from client
- * (e.g. POST, GET...)
- * Should only be used after header was read (EV_HTTP_REQ)
+ * API for admission control. At most max_connections connections are
+ * open at once, 0 for no limit; the ones past it get a 503 with a
+ * Retry-After of HTTP_RETRY_AFTER seconds. With auto_accept set, the
+ * server accepts all the pending connections itself and reports each
+ * one with EV_HTTP_CON and its connection ID, pico_http_server_accept()
+ * is not needed anymore.
  */
-
-int16_t pico_http_get_method(uint16_t conn)
+int16_t pico_http_server_set_admission(uint16_t max_connections, uint8_t auto_accept)
 {
-    struct http_client *client = find_client(conn);
-
-    if (!client)
-        return 0;
-    else
-        return client->method;
+    default_server.max_connections = max_connections;
+    default_server.auto_accept = auto_accept ? 1u : 0u;
+    return HTTP_RETURN_OK;
 }
 
 /*
- * Function used for getting the body of the request header
- * It is useful after a POST request header (EV_HTTP_REQ)
- * from client was received, otherwise NULL is returned.
+ * API for limiting the rate of each client address, 0 for no limit.
+ * A client gets requests_per_s requests and bytes_per_s bytes of request
+ * headers and responses per second, with a burst of one second; past
+ * that its requests are answered with a 429 before any handler runs.
+ * Addresses are followed in a table of HTTP_RATE_BUCKETS entries.
  */
-char *pico_http_get_body(uint16_t conn)
+int16_t pico_http_server_set_rate_limit(uint16_t requests_per_s, uint32_t bytes_per_s)
 {
-    struct http_client *client = find_client(conn);
-
-    if (!client)
-        return NULL;
-    else
-        return client->body;
+    default_server.rate_requests = requests_per_s;
+    default_server.rate_bytes = bytes_per_s;
+    memset(default_server.rate, 0, sizeof(default_server.rate));
+    return HTTP_RETURN_OK;
 }
 
-
 /*
- * After the resource was asked by the client (EV_HTTP_REQ)
- * before doing anything else, the server has to let know
- * the client if the resource can be provided or not.
- *
- * This is controlled via the code parameter which can
- * have three values :
- *
- * HTTP_RESOURCE_FOUND, HTTP_STATIC_RESOURCE_FOUND or HTTP_RESOURCE_NOT_FOUND
- *
- * If a resource is reported not found the 404 header will be sent and the connection
- * will be closed , otherwise the 200 header is sent and the user should
- * immediately submit (static) data.
- *
+ * API for setting the amount of queued outgoing data above which
+ * pico_http_submit_data reports HTTP_RETURN_BUSY.
  */
-int32_t pico_http_respond_mimetype(uint16_t conn, uint16_t code, const char* mimetype)
+int16_t pico_http_server_set_highwater(uint32_t bytes)
 {
-    struct http_client *client = find_client(conn);
-
-    if (!client)
+    if (!bytes)
     {
-        dbg("Client not found !\n");
+        pico_err = PICO_ERR_EINVAL;
         return HTTP_RETURN_ERROR;
     }
 
-    if (client->state == HTTP_WAIT_RESPONSE)
-    {
-        if (code & HTTP_RESOURCE_FOUND)
-        {
-            client->state = (code & HTTP_STATIC_RESOURCE) ? HTTP_WAIT_STATIC_DATA : HTTP_WAIT_DATA;
-            uint16_t len = HTTP_OK_HEADER_FIXED;
-            if (mimetype != NULL)
-                len += (uint16_t)strlen(mimetype);
-            char *retheader = PICO_ZALLOC(len);
-            if (!retheader)
-            {
-                pico_err = PICO_ERR_ENOMEM;
-                return HTTP_RETURN_ERROR;
-            }
-            if (code & HTTP_CACHEABLE_RESOURCE)
-            {
-                int32_t length = construct_return_ok_header(retheader, HTTP_CACHEABLE_RESOURCE, mimetype);
-                uint8_t rv = pico_socket_write(client->sck, retheader, length ); /* remove \0 */
-                PICO_FREE(retheader);
-                return rv;
-            }
-            else
-            {
-                int32_t length = construct_return_ok_header(retheader, HTTP_STATIC_RESOURCE, mimetype);
-                uint8_t rv = pico_socket_write(client->sck, retheader, length ); /* remove \0 */
-                PICO_FREE(retheader);
-                return rv;
-            }
-        }
-        else
-        {
-            int32_t length;
-            length = pico_socket_write(client->sck, (const uint8_t *)return_fail_header, sizeof(return_fail_header) - 1); /* remove \0 */
-            pico_socket_close(client->sck);
-            client->state = HTTP_CLOSED;
-            return length;
-        }
-    }
-    else
-    {
-        dbg("Bad state for the client \n");
-        return HTTP_RETURN_ERROR;
-    }
+    default_server.send_highwater = bytes;
+    return HTTP_RETURN_OK;
 }
 
 /*
- * After the resource was asked by the client (EV_HTTP_REQ)
- * before doing anything else, the server has to let know
- * the client if the resource can be provided or not.
- *
- * This is controlled via the code parameter which can
- * have three values :
- *
- * HTTP_RESOURCE_FOUND, HTTP_STATIC_RESOURCE_FOUND or HTTP_RESOURCE_NOT_FOUND
- *
- * If a resource is reported not found the 404 header will be sent and the connection
- * will be closed , otherwise the 200 header is sent and the user should
- * immediately submit (static) data.
+ * API for configuring persistent connections.
  *
-*/
-int32_t pico_http_respond(uint16_t conn, uint16_t code)
+ * An idle connection waiting for its next request is closed after
+ * timeout_ms, 0 keeps it open. After max_requests requests the
+ * connection is closed once the response is sent, 1 disables persistent
+ * connections.
+ */
+int16_t pico_http_server_set_keepalive(uint32_t timeout_ms, uint16_t max_requests)
 {
-    struct http_client *client = find_client(conn);
-
-    if (!client)
+    if (!max_requests)
     {
-        dbg("Client not found !\n");
+        pico_err = PICO_ERR_EINVAL;
         return HTTP_RETURN_ERROR;
     }
 
-    if (client->state == HTTP_WAIT_RESPONSE)
+    default_server.keepalive_timeout = timeout_ms;
+    default_server.keepalive_max = max_requests;
+    return HTTP_RETURN_OK;
+}
+
+/*
+ * API for the deadlines of a connection, with a resolution of
+ * HTTP_SERVER_TICK_MS. A connection is closed when its request header
+ * is not complete header_ms after its first byte, when its request body
+ * stalls for body_ms, or when the application did not start answering
+ * response_ms after the request. 0 disables a deadline.
+ */
+int16_t pico_http_server_set_timeouts(uint32_t header_ms, uint32_t body_ms, uint32_t response_ms)
+{
+    default_server.header_timeout = header_ms;
+    default_server.body_timeout = body_ms;
+    default_server.response_timeout = response_ms;
+    return HTTP_RETURN_OK;
+}
+
+/*
+ * API for the period of the comments sent on an idle text/event-stream
+ * response, 0 for none.
+ */
+int16_t pico_http_server_set_heartbeat(uint32_t heartbeat_ms)
+{
+    default_server.event_heartbeat = heartbeat_ms;
+    return HTTP_RETURN_OK;
+}
+
+/*
+ * Installs a table of static assets, as produced by pico_http_assets.sh.
+ * GET requests for a path of the table are answered by the server
+ * directly from the table, the application is not woken up for them.
+ * The table must be sorted by path (strcmp order) and stay valid while
+ * it is installed. Passing NULL removes the table.
+ */
+int16_t pico_http_server_set_assets(const struct pico_http_static_asset *assets, uint16_t count)
+{
+    return pico_http_server_assets(&default_server, assets, count);
+}
+
+/* Same as pico_http_server_set_assets, for a server instance */
+int16_t pico_http_server_assets(struct pico_http_server *srv, const struct pico_http_static_asset *assets, uint16_t count)
+{
+    if (!srv)
     {
-        if (code & HTTP_RESOURCE_FOUND)
-        {
-            client->state = (code & HTTP_STATIC_RESOURCE) ? HTTP_WAIT_STATIC_DATA : HTTP_WAIT_DATA;
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
+
+    srv->assets = assets;
+    srv->asset_count = assets ? count : 0u;
+    return HTTP_RETURN_OK;
+}
+
+static struct http_route_node *http_route_node(const char *label, uint16_t len)
+{
+    struct http_route_node *node = PICO_ZALLOC(sizeof(struct http_route_node));
 
-            /* Try to guess MIME type */
-            const char* mimetype = pico_http_get_mimetype(client->resource);
+    if (!node)
+    {
+        pico_err = PICO_ERR_ENOMEM;
+        return NULL;
+    }
+
+    node->label = label;
+    node->label_len = len;
+    return node;
+}
+
+/*
+ * Registers the handler of a method for a path pattern, like
+ * "/api/users/:id/posts". A ":name" segment matches any non empty
+ * segment, read back with pico_http_get_param(). Static segments win
+ * over parameters. The pattern is not copied and must stay valid.
+ * Requests that match a route are handed to its handler instead of
+ * raising EV_HTTP_REQ. Routes are dropped when the server is closed.
+ */
+int16_t pico_http_server_add_route(uint16_t method, const char *pattern, void (*handler)(uint16_t conn))
+{
+    return pico_http_server_route(&default_server, method, pattern, handler);
+}
+
+/* Same as pico_http_server_add_route, for a server instance */
+int16_t pico_http_server_route(struct pico_http_server *srv, uint16_t method, const char *pattern,
+                               void (*handler)(uint16_t conn))
+{
+    struct http_route_node *node, *child, **link, *mid;
+    uint16_t len, common;
+    uint8_t params = 0;
+
+    if (!srv || !method || method > HTTP_ROUTE_METHODS || !pattern || pattern[0] != '/' || !handler)
+    {
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
+
+    if (!srv->routes)
+    {
+        srv->routes = http_route_node("", 0);
+        if (!srv->routes)
+            return HTTP_RETURN_ERROR;
+    }
+
+    node = srv->routes;
+    while (*pattern)
+    {
+        if (*pattern == ':')
+        {
+            len = (uint16_t)strcspn(pattern, "/");
+            if (pattern[-1] != '/' || len < 2u || len > 0xFFu || ++params > HTTP_ROUTE_PARAMS_MAX)
+            {
+                pico_err = PICO_ERR_EINVAL;
+                return HTTP_RETURN_ERROR;
+            }
 
-            uint16_t len = HTTP_OK_HEADER_FIXED;
-            if (mimetype != NULL)
-                len += (uint16_t)strlen(mimetype);
-            char *retheader = PICO_ZALLOC(len);
-            if (!retheader)
+            if (!node->param)
             {
-                pico_err = PICO_ERR_ENOMEM;
+                node->param = http_route_node(pattern, len);
+                if (!node->param)
+                    return HTTP_RETURN_ERROR;
+            }
+            else if (node->param->label_len != len || memcmp(node->param->label, pattern, len))
+            {
+                /* one name per parameter position */
+                pico_err = PICO_ERR_EINVAL;
                 return HTTP_RETURN_ERROR;
             }
 
-            if (code & HTTP_CACHEABLE_RESOURCE)
-            {
-                int32_t length = construct_return_ok_header(retheader, HTTP_CACHEABLE_RESOURCE, mimetype);
-                uint8_t rv = pico_socket_write(client->sck, retheader, length ); /* remove \0 */
-                PICO_FREE(retheader);
-                retheader = NULL;
-                return rv;
-            }
-            else
+            node = node->param;
+            pattern += len;
+            continue;
+        }
+
+        len = (uint16_t)strcspn(pattern, ":");
+        for (link = &node->child; *link && (*link)->label[0] != pattern[0]; link = &(*link)->next)
+            ;
+
+        child = *link;
+        if (!child)
+        {
+            child = http_route_node(pattern, len);
+            if (!child)
+                return HTTP_RETURN_ERROR;
+
+            *link = child;
+            node = child;
+            pattern += len;
+            continue;
+        }
+
+        for (common = 0; common < len && common < child->label_len && pattern[common] == child->label[common]; common++)
+            ;
+
+        if (common < child->label_len)
+        {
+            /* the edge is split where the labels differ */
+            mid = http_route_node(child->label, common);
+            if (!mid)
+                return HTTP_RETURN_ERROR;
+
+            mid->next = child->next;
+            mid->child = child;
+            child->next = NULL;
+            child->label += common;
+            child->label_len = (uint16_t)(child->label_len - common);
+            *link = mid;
+            child = mid;
+        }
+
+        node = child;
+        pattern += common;
+    }
+
+    if (node->handler[method - 1u])
+    {
+        pico_err = PICO_ERR_EEXIST;
+        return HTTP_RETURN_ALREADYIN;
+    }
+
+    node->handler[method - 1u] = handler;
+    return HTTP_RETURN_OK;
+}
+
+/*
+ * Carves the connection slots of a server out of one arena. A slot holds
+ * the connection, its multipart parser, its added headers, its copies and
+ * its receive and transmit buffers, so serving a request does not
+ * allocate anything.
+ */
+static int16_t http_server_pool(struct pico_http_server *srv, uint16_t slots)
+{
+    struct http_client *slot;
+    uint16_t i;
+
+    srv->pool_slot_size = http_pool_align(sizeof(struct http_client)) + http_pool_align(sizeof(struct http_multipart)) +
+                          http_pool_align(HTTP_EXTRA_HEADERS_SIZE) + http_pool_align(HTTP_POOL_COPY_SIZE) +
+                          http_pool_align((uint32_t)srv->rx_size + 1u) + http_pool_align(srv->tx_size);
+    srv->pool = PICO_ZALLOC(srv->pool_slot_size * slots);
+    if (!srv->pool)
+    {
+        pico_err = PICO_ERR_ENOMEM;
+        return HTTP_RETURN_ERROR;
+    }
+
+    srv->pool_free = NULL;
+    for (i = slots; i > 0; i--)
+    {
+        slot = (struct http_client *)(srv->pool + srv->pool_slot_size * (i - 1u));
+        slot->pool_next = srv->pool_free;
+        srv->pool_free = slot;
+    }
+
+    if (!srv->max_connections || srv->max_connections > slots)
+        srv->max_connections = slots;
+
+    return HTTP_RETURN_OK;
+}
+
+/* takes a free slot of the server, or allocates a connection if it has no pool */
+static struct http_client *http_client_alloc(struct pico_http_server *srv)
+{
+    struct http_client *client;
+    uint8_t *slot;
+
+    if (srv->pool)
+    {
+        client = srv->pool_free;
+        if (!client)
+        {
+            pico_err = PICO_ERR_EAGAIN;
+            return NULL;
+        }
+
+        srv->pool_free = client->pool_next;
+        memset(client, 0, sizeof(struct http_client));
+        client->pooled = 1u;
+        slot = (uint8_t *)client + http_pool_align(sizeof(struct http_client)) + http_pool_align(sizeof(struct http_multipart));
+        client->extra_hdr = (char *)slot;
+        slot += http_pool_align(HTTP_EXTRA_HEADERS_SIZE);
+        client->copy_buf = slot;
+        slot += http_pool_align(HTTP_POOL_COPY_SIZE);
+        client->rx_buf = slot;
+        client->rx_buf[0] = 0;
+        slot += http_pool_align((uint32_t)srv->rx_size + 1u);
+        client->tx_buf = slot;
+        return client;
+    }
+
+    client = PICO_ZALLOC(sizeof(struct http_client));
+    if (!client)
+    {
+        pico_err = PICO_ERR_ENOMEM;
+        return NULL;
+    }
+
+    /* one extra byte to keep the buffered body NUL terminated */
+    client->rx_buf = PICO_ZALLOC((uint32_t)srv->rx_size + 1u);
+    if (!client->rx_buf)
+    {
+        pico_err = PICO_ERR_ENOMEM;
+        PICO_FREE(client);
+        return NULL;
+    }
+
+    client->tx_buf = PICO_ZALLOC(srv->tx_size);
+    if (!client->tx_buf)
+    {
+        pico_err = PICO_ERR_ENOMEM;
+        PICO_FREE(client->rx_buf);
+        PICO_FREE(client);
+        return NULL;
+    }
+
+    return client;
+}
+
+/* drops the queued chunks and gives the connection back to its server */
+static void http_client_free(struct pico_http_server *srv, struct http_client *client)
+{
+    http_tx_unready(client);
+    http_wheel_remove(client);
+    http_send_queue_flush(client);
+    http_deflate_end(client);
+    http_events_unsubscribe(client);
+    if (client->pooled)
+    {
+        client->pool_next = srv->pool_free;
+        srv->pool_free = client;
+        return;
+    }
+
+    PICO_FREE(client->multipart);
+    PICO_FREE(client->extra_hdr);
+    PICO_FREE(client->tx_buf);
+    PICO_FREE(client->rx_buf);
+    PICO_FREE(client);
+}
+
+/*
+ * Gives the connection an entry of the connection table and its ID.
+ * The entries are handed out round robin, so a freed one is reused as
+ * late as possible; generation 0 is skipped so no ID is HTTP_SERVER_ID.
+ */
+static int16_t http_conn_register(struct http_client *client)
+{
+    uint16_t i, slot = 0;
+
+    for (i = 0; i < HTTP_CONN_SLOTS; i++)
+    {
+        slot = (uint16_t)((conn_cursor + i) % HTTP_CONN_SLOTS);
+        if (!conn_table[slot])
+            break;
+    }
+
+    if (i == HTTP_CONN_SLOTS)
+    {
+        pico_err = PICO_ERR_EAGAIN;
+        return HTTP_RETURN_ERROR;
+    }
+
+    conn_generation[slot] = (uint16_t)(conn_generation[slot] % (HTTP_CONN_GENERATIONS - 1u) + 1u);
+    client->connectionID = (uint16_t)((conn_generation[slot] << HTTP_CONN_SLOT_BITS) | slot);
+    conn_table[slot] = client;
+    conn_cursor = (uint16_t)((slot + 1u) % HTTP_CONN_SLOTS);
+    return HTTP_RETURN_OK;
+}
+
+static inline void http_conn_unregister(struct http_client *client)
+{
+    conn_table[client->connectionID & (HTTP_CONN_SLOTS - 1u)] = NULL;
+}
+
+/*
+ * Turns a connection away when the server is full : it is accepted,
+ * answered with a 503 that asks to come back later, and closed.
+ * Returns 0 if no connection was pending.
+ */
+static int8_t http_shed(struct pico_socket *listener)
+{
+    struct pico_socket *sck;
+    struct pico_ip4 orig;
+    uint16_t port;
+
+    sck = pico_socket_accept(listener, &orig, &port);
+    if (!sck)
+        return 0;
+
+    dbg("Server full, connection shed\n");
+    pico_socket_write(sck, busy_header, sizeof(busy_header) - 1);
+    pico_socket_close(sck);
+    return 1;
+}
+
+/* drops the pending connection the application did not accept, the
+ * listener stays open */
+static void http_reject(struct pico_socket *listener)
+{
+    struct pico_socket *sck;
+    struct pico_ip4 orig;
+    uint16_t port;
+
+    sck = pico_socket_accept(listener, &orig, &port);
+    if (sck)
+        pico_socket_close(sck);
+}
+
+/*
+ * Takes a pending connection from a listener. *taken tells whether a
+ * connection was pending, it was either accepted or shed.
+ * Returns the ID of the new connection or a negative value if error.
+ */
+static int32_t http_accept(struct pico_http_server *srv, struct pico_socket *listener, uint8_t *taken)
+{
+    struct pico_ip4 orig;
+    struct http_client *client;
+    uint16_t port;
+
+    *taken = 0;
+    if (srv->max_connections && srv->connections >= srv->max_connections)
+    {
+        *taken = (uint8_t)http_shed(listener);
+        pico_err = PICO_ERR_EAGAIN;
+        return HTTP_RETURN_ERROR;
+    }
+
+    client = http_client_alloc(srv);
+    if (!client || http_conn_register(client) < 0)
+    {
+        if (client)
+            http_client_free(srv, client);
+
+        *taken = (uint8_t)http_shed(listener);
+        pico_err = PICO_ERR_EAGAIN;
+        return HTTP_RETURN_ERROR;
+    }
+
+    client->sck = pico_socket_accept(listener, &orig, &port);
+
+    if (!client->sck)
+    {
+        pico_err = PICO_ERR_ENOMEM;
+        http_conn_unregister(client);
+        http_client_free(srv, client);
+        return HTTP_RETURN_ERROR;
+    }
+
+    *taken = 1u;
+    client->sck->priv = (void *)(uintptr_t)client->connectionID;
+    client->server = srv;
+    client->peer = orig.addr;
+    client->rx_size = srv->rx_size;
+    client->tx_cap = srv->tx_size;
+
+    /* coalesce writes up to one segment */
+    client->tx_size = (uint16_t)pico_tcp_get_socket_mss(client->sck);
+    if (client->tx_size < HTTP_HEADER_MAX_LINE || client->tx_size > client->tx_cap)
+        client->tx_size = client->tx_cap;
+
+    srv->connections++;
+    /* buffer used for async sending */
+    client->state = HTTP_WAIT_HDR;
+    client->body = NULL;
+    http_deadline_update(client, 0);
+
+    pico_tree_insert(&srv->clients, client);
+    return client->connectionID;
+}
+
+/*
+ * Auto accept mode : every pending connection of the listener is taken
+ * at once, the application learns about the new ones with EV_HTTP_CON
+ * carrying their ID. Past the connection limit they are shed.
+ */
+static void http_accept_all(struct pico_http_server *srv, struct pico_socket *listener)
+{
+    uint8_t taken;
+    int32_t conn;
+
+    do
+    {
+        conn = http_accept(srv, listener, &taken);
+        if (conn > 0)
+            srv->wakeup(EV_HTTP_CON, (uint16_t)conn);
+    } while (taken && srv->state == HTTP_SERVER_LISTEN);
+}
+
+/*
+ * API for accepting new connections. This function should be
+ * called when the event EV_HTTP_CON is triggered, if not called
+ * when noticed the connection will be considered rejected and the
+ * socket will be dropped.
+ *
+ * At most HTTP_CONN_SLOTS connections are open at once over all the
+ * server instances. Past that or past the connection limit of the
+ * server, the connection is answered with a 503 and closed, and the
+ * call fails with EAGAIN.
+ *
+ * Returns the ID of the new connection or a negative value if error.
+ */
+int32_t pico_http_server_accept(void)
+{
+    struct pico_http_server *srv = accepting;
+    uint8_t taken;
+    int32_t conn;
+
+    if (!srv)
+    {
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
+
+    conn = http_accept(srv, accepting_sck, &taken);
+    if (taken)
+        srv->accepted = 1u;
+
+    return conn;
+}
+
+/*
+ * Function used for getting the resource asked by the
+ * client. It is useful after the request header (EV_HTTP_REQ)
+ * from client was received, otherwise NULL is returned.
+ */
+char *pico_http_get_resource(uint16_t conn)
+{
+    struct http_client *client = find_client(conn);
+
+    if (!client)
+        return NULL;
+    else
+        return client->resource;
+}
+
+/*
+ * Function used for getting the method coming from client
+ * (e.g. POST, GET...)
+ * Should only be used after header was read (EV_HTTP_REQ)
+ */
+
+int16_t pico_http_get_method(uint16_t conn)
+{
+    struct http_client *client = find_client(conn);
+
+    if (!client)
+        return 0;
+    else
+        return client->method;
+}
+
+/*
+ * Function used for getting the body of the request header
+ * It is useful after a POST request header (EV_HTTP_REQ)
+ * from client was received, otherwise NULL is returned.
+ * Only the part of a Content-Length body that arrived with the
+ * header is there, never more than Content-Length bytes; larger
+ * and chunked bodies are streamed with pico_http_read_body().
+ */
+char *pico_http_get_body(uint16_t conn)
+{
+    struct http_client *client = find_client(conn);
+
+    if (!client)
+        return NULL;
+    else
+        return client->body;
+}
+
+/* the request being answered has body data to deliver with EV_HTTP_BODY */
+static inline uint8_t http_body_pending(struct http_client *client)
+{
+    return (uint8_t)(client->body_state != HTTP_BODY_DONE && client->body_state != HTTP_BODY_ERROR &&
+                     !client->body_paused && client->state >= HTTP_WAIT_RESPONSE &&
+                     client->state <= HTTP_SENDING_FINAL);
+}
+
+/*
+ * Streams the request body, after EV_HTTP_REQ or EV_HTTP_BODY.
+ * Copies at most len bytes of payload to buf, a chunked body is
+ * decoded on the fly. Returns the number of bytes copied, 0 when
+ * nothing more is available now : EV_HTTP_BODY signals when more data
+ * arrived. Use pico_http_body_complete() to know if the body ended.
+ */
+int32_t pico_http_read_body(uint16_t conn, void *buf, uint16_t len)
+{
+    struct http_client *client = find_client(conn);
+    int32_t ret;
+
+    if (!client || !buf)
+    {
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
+
+    if (client->state < HTTP_WAIT_RESPONSE || client->state > HTTP_SENDING_FINAL ||
+        client->body_state == HTTP_BODY_ERROR)
+        return HTTP_RETURN_ERROR;
+
+    ret = http_body_read(client, buf, len);
+    if (ret < 0)
+    {
+        dbg("Malformed request body\n");
+        client->body_state = HTTP_BODY_ERROR;
+        client->keep_alive = 0;
+    }
+
+    return ret;
+}
+
+/*
+ * Returns 1 once the whole request body was read, 0 otherwise.
+ */
+int16_t pico_http_body_complete(uint16_t conn)
+{
+    struct http_client *client = find_client(conn);
+
+    if (!client)
+        return HTTP_RETURN_ERROR;
+
+    return (client->body_state == HTTP_BODY_DONE) ? 1 : 0;
+}
+
+/*
+ * Stops or restarts the EV_HTTP_BODY events of a connection. While
+ * paused, the body is left in the socket and the receive window closes,
+ * so a fast client is throttled until the application can take more.
+ */
+int16_t pico_http_pause_body(uint16_t conn, uint8_t pause)
+{
+    struct http_client *client = find_client(conn);
+
+    if (!client)
+    {
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
+
+    if (client->body_paused && !pause)
+    {
+        /* data may have arrived while paused, no RD event will say so */
+        http_defer(client, HTTP_PENDING_BODY);
+    }
+
+    client->body_paused = pause ? 1u : 0u;
+    http_deadline_update(client, 1u);
+    return HTTP_RETURN_OK;
+}
+
+/*
+ * Hands a multipart/form-data request body to the server, after
+ * EV_HTTP_REQ and before any of the body was read. The body is parsed
+ * as it arrives : part is called with the headers of every part, then
+ * data with its content in slices, never buffered as a whole. A NULL
+ * part tells the last one ended. pico_http_pause_body() holds the
+ * callbacks back, a malformed body is answered with a 400.
+ */
+int16_t pico_http_multipart_start(uint16_t conn, void (*part)(uint16_t conn, const struct pico_http_part *part),
+                                  void (*data)(uint16_t conn, const uint8_t *data, uint16_t len))
+{
+    struct http_client *client = find_client(conn);
+    struct http_multipart *mp;
+    const char *value, *boundary;
+    uint16_t len, i;
+
+    if (!client || !part || !data)
+    {
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
+
+    if (client->state != HTTP_WAIT_RESPONSE || client->multipart || client->body_state == HTTP_BODY_DONE ||
+        client->body_state == HTTP_BODY_ERROR || client->body_pos != client->hdr_len)
+        return HTTP_RETURN_ERROR;
+
+    value = pico_http_get_header(conn, HTTP_HDR_CONTENT_TYPE, NULL);
+    if (!http_header_has_token(value, "multipart/form-data"))
+        return HTTP_RETURN_ERROR;
+
+    boundary = strstr(value, "boundary=");
+    if (!boundary)
+        return HTTP_RETURN_ERROR;
+
+    boundary += 9;
+    if (*boundary == '"')
+    {
+        boundary++;
+        len = (uint16_t)(strchr(boundary, '"') ? strchr(boundary, '"') - boundary : 0);
+    }
+    else
+    {
+        len = (uint16_t)strcspn(boundary, "; \t");
+    }
+
+    if (!len || len > HTTP_MULTIPART_DELIM_MAX - 4u)
+        return HTTP_RETURN_ERROR;
+
+    if (client->pooled)
+    {
+        /* the parser follows the connection in its slot */
+        mp = (struct http_multipart *)((uint8_t *)client + http_pool_align(sizeof(struct http_client)));
+        memset(mp, 0, sizeof(struct http_multipart));
+    }
+    else
+    {
+        mp = PICO_ZALLOC(sizeof(struct http_multipart));
+        if (!mp)
+        {
+            pico_err = PICO_ERR_ENOMEM;
+            return HTTP_RETURN_ERROR;
+        }
+    }
+
+    mp->part = part;
+    mp->data = data;
+    mp->delim_len = (uint8_t)(len + 4u);
+    memcpy(mp->delim, "\r\n--", 4);
+    memcpy(mp->delim + 4, boundary, len);
+    memset(mp->skip, mp->delim_len, sizeof(mp->skip));
+    for (i = 0; i < mp->delim_len - 1u; i++)
+        mp->skip[mp->delim[i]] = (uint8_t)(mp->delim_len - 1u - i);
+
+    /* the first delimiter is not preceded by a line break */
+    mp->buf[0] = '\r';
+    mp->buf[1] = '\n';
+    mp->len = 2u;
+    client->multipart = mp;
+
+    /* the parts are delivered from the transmit run, not from inside this call */
+    http_defer(client, HTTP_PENDING_BODY);
+    return HTTP_RETURN_OK;
+}
+
+/*
+ * Function used for getting the value of a request header
+ * from the index built while parsing (HTTP_HDR_HOST, ...).
+ * The value points inside the receive buffer of the connection
+ * and stays valid until the response is complete.
+ * If len is not NULL, it is set to the length of the value.
+ * Returns NULL if the header was not part of the request.
+ */
+const char *pico_http_get_header(uint16_t conn, uint8_t header, uint16_t *len)
+{
+    struct http_client *client = find_client(conn);
+
+    if (!client || header >= HTTP_HDR_COUNT || client->state < HTTP_EOF_HDR ||
+        !client->headers[header].offset)
+        return NULL;
+
+    if (len)
+        *len = client->headers[header].len;
+
+    return (const char *)client->rx_buf + client->headers[header].offset;
+}
+
+/*
+ * Function used for getting a path parameter of the route that
+ * matched the request, by its name without the ':'. The value points
+ * inside the resource and is not NUL terminated, len is set to its
+ * length. Returns NULL if the route has no such parameter.
+ */
+const char *pico_http_get_param(uint16_t conn, const char *name, uint16_t *len)
+{
+    struct http_client *client = find_client(conn);
+    uint16_t name_len;
+    uint8_t i;
+
+    if (!client || !name || !len || !client->resource)
+        return NULL;
+
+    name_len = (uint16_t)strlen(name);
+    for (i = 0; i < client->param_count; i++)
+    {
+        if (client->params[i].name_len == name_len && !memcmp(client->params[i].name, name, name_len))
+        {
+            *len = client->params[i].len;
+            return client->resource + client->params[i].offset;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Adds a header to the next response of the connection. It can be
+ * called after the request was received (EV_HTTP_REQ) and before
+ * responding, for instance to set a cookie.
+ *
+ * The header is copied, name and value do not need to stay valid.
+ * HTTP_RETURN_ERROR is returned when the headers added to this response
+ * don't fit in HTTP_EXTRA_HEADERS_SIZE bytes.
+ */
+int16_t pico_http_add_header(uint16_t conn, const char *name, const char *value)
+{
+    struct http_client *client = find_client(conn);
+    uint16_t name_len, value_len;
+
+    if (!client || !name || !value)
+    {
+        dbg("Wrong connection ID\n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    if (client->state != HTTP_WAIT_RESPONSE)
+    {
+        dbg("Headers can only be added before responding\n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    name_len = (uint16_t)strlen(name);
+    value_len = (uint16_t)strlen(value);
+    if ((uint32_t)client->extra_len + name_len + value_len + 4u > HTTP_EXTRA_HEADERS_SIZE)
+    {
+        dbg("No room for the header\n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    /* the buffer is kept for the following responses of the connection */
+    if (!client->extra_hdr)
+    {
+        client->extra_hdr = PICO_ZALLOC(HTTP_EXTRA_HEADERS_SIZE);
+        if (!client->extra_hdr)
+        {
+            pico_err = PICO_ERR_ENOMEM;
+            return HTTP_RETURN_ERROR;
+        }
+    }
+
+    memcpy(client->extra_hdr + client->extra_len, name, name_len);
+    client->extra_len = (uint16_t)(client->extra_len + name_len);
+    client->extra_hdr[client->extra_len++] = ':';
+    client->extra_hdr[client->extra_len++] = ' ';
+    memcpy(client->extra_hdr + client->extra_len, value, value_len);
+    client->extra_len = (uint16_t)(client->extra_len + value_len);
+    client->extra_hdr[client->extra_len++] = '\r';
+    client->extra_hdr[client->extra_len++] = '\n';
+    return HTTP_RETURN_OK;
+}
+
+/*
+ * Compares the entity tags listed in If-None-Match with etag, using
+ * the weak comparison : a W/ prefix is ignored on both sides.
+ */
+static uint8_t http_etag_matches(const char *list, const char *etag)
+{
+    const char *end;
+    uint16_t len;
+
+    if (etag[0] == 'W' && etag[1] == '/')
+        etag += 2;
+
+    len = (uint16_t)strlen(etag);
+    while (*list)
+    {
+        while (*list == ' ' || *list == '\t' || *list == ',')
+            list++;
+
+        if (*list == '*')
+            return 1u;
+
+        if (list[0] == 'W' && list[1] == '/')
+            list += 2;
+
+        end = list;
+        if (*end == '"')
+        {
+            end = strchr(end + 1, '"');
+            if (!end)
+                return 0;
+
+            end++;
+        }
+        else
+        {
+            while (*end && *end != ',' && *end != ' ' && *end != '\t')
+                end++;
+        }
+
+        if ((uint16_t)(end - list) == len && memcmp(list, etag, len) == 0)
+            return 1u;
+
+        for (list = end; *list && *list != ','; list++)
+            ;
+    }
+
+    return 0;
+}
+
+/*
+ * Checks the conditional headers of a GET against the validators of
+ * the response. If-None-Match takes precedence over If-Modified-Since.
+ */
+static uint8_t http_not_modified(struct http_client *client)
+{
+    const char *value;
+    uint32_t since;
+
+    if (client->method != HTTP_METHOD_GET)
+        return 0;
+
+    value = pico_http_get_header(client->connectionID, HTTP_HDR_IF_NONE_MATCH, NULL);
+    if (value)
+        return (uint8_t)(client->etag && http_etag_matches(value, client->etag));
+
+    value = pico_http_get_header(client->connectionID, HTTP_HDR_IF_MODIFIED_SINCE, NULL);
+    if (value && client->last_modified)
+    {
+        since = pico_http_parse_date(value);
+        return (uint8_t)(since && client->last_modified <= since);
+    }
+
+    return 0;
+}
+
+/* answers 304, the response is complete once the header was sent */
+static int16_t http_send_not_modified(struct http_client *client)
+{
+    client->identity = 1u;
+    client->content_left = 0;
+    if (http_send_header(client, HTTP_NOT_MODIFIED, 0, NULL, NULL) < 0)
+        return HTTP_RETURN_ERROR;
+
+    client->state = HTTP_SENDING_FINAL;
+    return HTTP_RETURN_NOT_MODIFIED;
+}
+
+/*
+ * Attaches validators to the resource asked by the client: an entity
+ * tag (quoted, like "\"v1.2\"") and the last modification time in
+ * seconds since the epoch, each of them can be left out with NULL / 0.
+ * They are sent with the response, the entity tag must stay valid until
+ * it is started.
+ *
+ * It must be called after EV_HTTP_REQ and before responding. When the
+ * request is conditional and the client copy is still valid, the server
+ * answers 304 Not Modified by itself and HTTP_RETURN_NOT_MODIFIED is
+ * returned : the response is then complete and no data must be submitted.
+ */
+int16_t pico_http_set_validators(uint16_t conn, const char *etag, uint32_t last_modified)
+{
+    struct http_client *client = find_client(conn);
+
+    if (!client)
+    {
+        dbg("Client not found !\n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    if (client->state != HTTP_WAIT_RESPONSE)
+    {
+        dbg("Validators can only be set before responding\n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    client->etag = etag;
+    client->last_modified = last_modified;
+    if (!http_not_modified(client))
+        return HTTP_RETURN_OK;
+
+    return http_send_not_modified(client);
+}
+
+/*
+ * Puts a response header in the transmit stage, it leaves together
+ * with the first chunk. Status is HTTP_OK, HTTP_PARTIAL_CONTENT,
+ * HTTP_REQ_RANGE_NOK or HTTP_NOT_MODIFIED, the latter has no body and
+ * so no content headers. content_range is a complete header line or NULL.
+ * Returns the length of the header.
+ */
+static int32_t http_send_header(struct http_client *client, uint16_t status, uint16_t code, const char *mimetype, const char *content_range)
+{
+    struct http_hdr_part part[HTTP_HDR_PARTS_MAX];
+    char content_length[12];
+    char date[PICO_HTTP_DATE_LEN + 1];
+    uint16_t content_length_len;
+    uint32_t len = 0;
+    uint8_t count = 0, i;
+
+    switch (status)
+    {
+    case HTTP_NOT_MODIFIED:
+        http_hdr_part(part, count, http_hdr_status_not_modified, http_fragment_len(http_hdr_status_not_modified));
+        mimetype = NULL;
+        break;
+    case HTTP_PARTIAL_CONTENT:
+        http_hdr_part(part, count, http_hdr_status_partial, http_fragment_len(http_hdr_status_partial));
+        break;
+    case HTTP_REQ_RANGE_NOK:
+        http_hdr_part(part, count, http_hdr_status_range_nok, http_fragment_len(http_hdr_status_range_nok));
+        mimetype = NULL;
+        break;
+    default:
+        http_hdr_part(part, count, http_hdr_status_ok, http_fragment_len(http_hdr_status_ok));
+        break;
+    }
+    if (code & HTTP_CACHEABLE_RESOURCE)
+        http_hdr_part(part, count, http_hdr_cacheable, http_fragment_len(http_hdr_cacheable));
+    if (mimetype)
+    {
+        http_hdr_part(part, count, http_hdr_content_type, http_fragment_len(http_hdr_content_type));
+        http_hdr_part(part, count, mimetype, (uint16_t)strlen(mimetype));
+        http_hdr_part(part, count, "\r\n", 2u);
+    }
+    if (client->etag)
+    {
+        http_hdr_part(part, count, http_hdr_etag, http_fragment_len(http_hdr_etag));
+        http_hdr_part(part, count, client->etag, (uint16_t)strlen(client->etag));
+        http_hdr_part(part, count, "\r\n", 2u);
+    }
+    if (client->last_modified)
+    {
+        pico_http_format_date(client->last_modified, date);
+        date[PICO_HTTP_DATE_LEN] = '\r';
+        http_hdr_part(part, count, http_hdr_last_modified, http_fragment_len(http_hdr_last_modified));
+        http_hdr_part(part, count, date, PICO_HTTP_DATE_LEN + 1u);
+        http_hdr_part(part, count, "\n", 1u);
+    }
+    if (client->encoding & HTTP_ENCODING_VARY)
+        http_hdr_part(part, count, http_hdr_vary, http_fragment_len(http_hdr_vary));
+    if (client->accept_ranges && status == HTTP_OK)
+        http_hdr_part(part, count, http_hdr_accept_ranges, http_fragment_len(http_hdr_accept_ranges));
+    if (content_range)
+        http_hdr_part(part, count, content_range, (uint16_t)strlen(content_range));
+    if (status != HTTP_NOT_MODIFIED)
+    {
+        if (client->encoding & HTTP_ENCODING_GZIP)
+            http_hdr_part(part, count, http_hdr_gzip, http_fragment_len(http_hdr_gzip));
+        else if (client->encoding & HTTP_ENCODING_DEFLATE)
+            http_hdr_part(part, count, http_hdr_deflate, http_fragment_len(http_hdr_deflate));
+
+        if (client->identity)
+        {
+            content_length_len = (uint16_t)pico_itoa(client->content_left, content_length);
+            if (!content_length_len)
+                content_length[content_length_len++] = '0';
+            content_length[content_length_len++] = '\r';
+            content_length[content_length_len++] = '\n';
+            http_hdr_part(part, count, http_hdr_content_length, http_fragment_len(http_hdr_content_length));
+            http_hdr_part(part, count, content_length, content_length_len);
+        }
+        else
+        {
+            http_hdr_part(part, count, http_hdr_chunked, http_fragment_len(http_hdr_chunked));
+        }
+    }
+    if (client->extra_len)
+        http_hdr_part(part, count, client->extra_hdr, client->extra_len);
+    /* the next request can only be found behind a body received completely */
+    if (client->body_state != HTTP_BODY_DONE &&
+        (client->body_chunked || client->body_left > (uint32_t)(client->rx_len - client->body_pos)))
+        client->keep_alive = 0;
+    if (client->keep_alive)
+        http_hdr_part(part, count, http_hdr_keep_alive, http_fragment_len(http_hdr_keep_alive));
+    else
+        http_hdr_part(part, count, http_hdr_close, http_fragment_len(http_hdr_close));
+
+    for (i = 0; i < count; i++)
+        len += part[i].len;
+
+    if (len > (uint32_t)(client->tx_cap - client->tx_len))
+    {
+        dbg("Response header too long\n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    for (i = 0; i < count; i++)
+        http_tx_append(client, part[i].data, part[i].len);
+
+    client->extra_len = 0;
+    http_tx_schedule(client);
+    return (int32_t)len;
+}
+
+/*
+ * After the resource was asked by the client (EV_HTTP_REQ)
+ * before doing anything else, the server has to let know
+ * the client if the resource can be provided or not.
+ *
+ * This is controlled via the code parameter which can
+ * have three values :
+ *
+ * HTTP_RESOURCE_FOUND, HTTP_STATIC_RESOURCE_FOUND or HTTP_RESOURCE_NOT_FOUND
+ *
+ * If a resource is reported not found the 404 header will be sent and the connection
+ * will be closed , otherwise the 200 header is sent and the user should
+ * immediately submit (static) data. The header leaves together with
+ * the first data chunk.
+ *
+ */
+int32_t pico_http_respond_mimetype(uint16_t conn, uint16_t code, const char* mimetype)
+{
+    struct http_client *client = find_client(conn);
+    int32_t length;
+
+    if (!client)
+    {
+        dbg("Client not found !\n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    if (client->state == HTTP_WAIT_RESPONSE)
+    {
+        if (code & HTTP_RESOURCE_FOUND)
+        {
+            client->identity = 0;
+            http_deflate_start(client);
+            length = http_send_header(client, HTTP_OK, code, mimetype, NULL);
+            if (length > 0)
+                client->state = (code & HTTP_STATIC_RESOURCE) ? HTTP_WAIT_STATIC_DATA : HTTP_WAIT_DATA;
+
+            return length;
+        }
+        else
+        {
+            length = pico_socket_write(client->sck, (const uint8_t *)return_fail_header, sizeof(return_fail_header) - 1); /* remove \0 */
+            pico_socket_close(client->sck);
+            client->state = HTTP_CLOSED;
+            return length;
+        }
+    }
+    else
+    {
+        dbg("Bad state for the client \n");
+        return HTTP_RETURN_ERROR;
+    }
+}
+
+/*
+ * Same as pico_http_respond_mimetype, the MIME type is guessed
+ * from the extension of the requested resource.
+ */
+int32_t pico_http_respond(uint16_t conn, uint16_t code)
+{
+    struct http_client *client = find_client(conn);
+
+    if (!client)
+    {
+        dbg("Client not found !\n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    /* Try to guess MIME type */
+    return pico_http_respond_mimetype(conn, code, client->resource ? pico_http_get_mimetype(client->resource) : NULL);
+}
+
+/*
+ * Starts a response with a body of known length, sent without
+ * chunk framing. Returns the length of the header.
+ */
+static int32_t http_start_sized(struct http_client *client, uint16_t status, uint16_t code,
+                                const char *mimetype, uint32_t total_len, const char *content_range)
+{
+    int32_t length;
+
+    client->identity = 1u;
+    client->content_left = total_len;
+    length = http_send_header(client, status, code, mimetype, content_range);
+    if (length < 0)
+        return length;
+
+    if (!total_len)
+        client->state = HTTP_SENDING_FINAL;
+    else
+        client->state = (code & HTTP_STATIC_RESOURCE) ? HTTP_WAIT_STATIC_DATA : HTTP_WAIT_DATA;
+
+    return length;
+}
+
+/*
+ * Same as pico_http_respond_mimetype, for a body of which the total
+ * length is known beforehand. The body is sent without chunk framing
+ * behind a Content-Length header, so the client can follow progress.
+ *
+ * Exactly total_len bytes must be submitted, the response completes
+ * by itself once the last of them was sent : a final NULL buffer is
+ * not needed. If mimetype is NULL it is guessed from the resource.
+ */
+int32_t pico_http_respond_sized(uint16_t conn, uint16_t code, const char *mimetype, uint32_t total_len)
+{
+    struct http_client *client = find_client(conn);
+
+    if (!client)
+    {
+        dbg("Client not found !\n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    if (client->state != HTTP_WAIT_RESPONSE || !(code & HTTP_RESOURCE_FOUND))
+        return pico_http_respond_mimetype(conn, code, mimetype);
+
+    if (!mimetype)
+        mimetype = pico_http_get_mimetype(client->resource);
+
+    return http_start_sized(client, HTTP_OK, code, mimetype, total_len, NULL);
+}
+
+/* writes a Content-Range header line, for "bytes * /total" if range is NULL */
+static uint16_t http_content_range(char *ptr, const struct http_range *range, uint32_t total)
+{
+    uint16_t len = http_fragment_len(http_hdr_content_range);
+
+    memcpy(ptr, http_hdr_content_range, len);
+    if (range)
+    {
+        len = (uint16_t)(len + pico_itoa(range->first, ptr + len));
+        if (!range->first)
+            ptr[len++] = '0';
+        ptr[len++] = '-';
+        len = (uint16_t)(len + pico_itoa(range->last, ptr + len));
+        if (!range->last)
+            ptr[len++] = '0';
+    }
+    else
+    {
+        ptr[len++] = '*';
+    }
+
+    ptr[len++] = '/';
+    len = (uint16_t)(len + pico_itoa(total, ptr + len));
+    if (!total)
+        ptr[len++] = '0';
+    ptr[len++] = '\r';
+    ptr[len++] = '\n';
+    ptr[len] = '\0';
+    return len;
+}
+
+/* boundary and headers in front of a part of a multipart/byteranges body */
+static uint16_t http_range_part_header(char *ptr, const char *mimetype, const struct http_range *range, uint32_t total)
+{
+    uint16_t len = 0, mime_len;
+
+    memcpy(ptr, "\r\n--" HTTP_RANGE_BOUNDARY "\r\n", sizeof(HTTP_RANGE_BOUNDARY) + 5u);
+    len = (uint16_t)(sizeof(HTTP_RANGE_BOUNDARY) + 5u);
+    if (mimetype)
+    {
+        mime_len = (uint16_t)strlen(mimetype);
+        memcpy(ptr + len, http_hdr_content_type, http_fragment_len(http_hdr_content_type));
+        len = (uint16_t)(len + http_fragment_len(http_hdr_content_type));
+        memcpy(ptr + len, mimetype, mime_len);
+        len = (uint16_t)(len + mime_len);
+        ptr[len++] = '\r';
+        ptr[len++] = '\n';
+    }
+
+    len = (uint16_t)(len + http_content_range(ptr + len, range, total));
+    ptr[len++] = '\r';
+    ptr[len++] = '\n';
+    return len;
+}
+
+/*
+ * Parses the Range header of a GET for a body of len bytes.
+ * Returns the number of ranges, 0 if the whole body must be sent and
+ * -1 if none of the ranges can be satisfied. The header is ignored when
+ * it can not be parsed, when it asks more than HTTP_RANGE_MAX ranges, or
+ * when If-Range does not match the validators of the response.
+ */
+static int8_t http_parse_ranges(struct http_client *client, uint32_t len, struct http_range *range)
+{
+    const char *value = pico_http_get_header(client->connectionID, HTTP_HDR_RANGE, NULL);
+    const char *if_range = pico_http_get_header(client->connectionID, HTTP_HDR_IF_RANGE, NULL);
+    uint32_t first, last;
+    uint16_t digits;
+    int8_t count = 0;
+    uint8_t skipped = 0;
+
+    if (!value || client->method != HTTP_METHOD_GET || strncmp(value, "bytes=", 6) != 0)
+        return 0;
+
+    /* the client copy changed, the whole body is needed */
+    if (if_range)
+    {
+        if (if_range[0] == '"' || if_range[0] == 'W')
+        {
+            if (!client->etag || if_range[0] == 'W' || strcmp(if_range, client->etag) != 0)
+                return 0;
+        }
+        else if (!client->last_modified || pico_http_parse_date(if_range) != client->last_modified)
+        {
+            return 0;
+        }
+    }
+
+    value += 6;
+    while (*value)
+    {
+        while (*value == ' ' || *value == '\t')
+            value++;
+
+        if (*value == '-')
+        {
+            /* suffix range, the last bytes */
+            value++;
+            digits = (uint16_t)strspn(value, "0123456789");
+            if (http_parse_uint(value, digits, &last) < 0)
+                return 0;
+
+            value += digits;
+            first = (last < len) ? len - last : 0;
+            last = len - 1u;
+            if (!len || first > last)
+                skipped = 1u;
+        }
+        else
+        {
+            digits = (uint16_t)strspn(value, "0123456789");
+            if (http_parse_uint(value, digits, &first) < 0 || value[digits] != '-')
+                return 0;
+
+            value += digits + 1u;
+            digits = (uint16_t)strspn(value, "0123456789");
+            if (!digits)
+                last = len - 1u;
+            else if (http_parse_uint(value, digits, &last) < 0 || last < first)
+                return 0;
+
+            value += digits;
+            if (first >= len)
+                skipped = 1u;
+            else if (last >= len)
+                last = len - 1u;
+        }
+
+        if (skipped)
+        {
+            skipped = 0;
+        }
+        else
+        {
+            if (count == (int8_t)HTTP_RANGE_MAX)
+                return 0;
+
+            range[count].first = first;
+            range[count].last = last;
+            count++;
+        }
+
+        while (*value == ' ' || *value == '\t')
+            value++;
+
+        if (*value == ',')
+            value++;
+        else if (*value)
+            return 0;
+    }
+
+    return count ? count : -1;
+}
+
+/*
+ * Answers with a static buffer, honouring the Range header: one range
+ * is sent as 206 with Content-Range, several ones as a multipart/byteranges
+ * body. The slices are queued zero-copy.
+ */
+static int32_t http_send_static(struct http_client *client, uint16_t code, const char *mimetype,
+                                const uint8_t *data, uint32_t len)
+{
+    struct http_range range[HTTP_RANGE_MAX];
+    char part[HTTP_HEADER_MAX_LINE];
+    uint32_t total;
+    int32_t length;
+    int8_t count, i;
+
+    client->accept_ranges = 1u;
+    code |= HTTP_STATIC_RESOURCE;
+    count = http_parse_ranges(client, len, range);
+
+    /* part headers must fit in the line buffer */
+    if (count > 1 && mimetype && strlen(mimetype) > HTTP_HEADER_MAX_LINE / 2u)
+        count = 0;
+
+    if (count < 0)
+    {
+        http_content_range(part, NULL, len);
+        return http_start_sized(client, HTTP_REQ_RANGE_NOK, 0, NULL, 0, part);
+    }
+
+    if (count == 0)
+    {
+        length = http_start_sized(client, HTTP_OK, code, mimetype, len, NULL);
+        if (length >= 0 && len)
+            pico_http_submit_buffer(client->connectionID, (void *)data, len, HTTP_BUFFER_STATIC);
+
+        return length;
+    }
+
+    if (count == 1)
+    {
+        http_content_range(part, &range[0], len);
+        total = range[0].last - range[0].first + 1u;
+        length = http_start_sized(client, HTTP_PARTIAL_CONTENT, code, mimetype, total, part);
+        if (length >= 0)
+            pico_http_submit_buffer(client->connectionID, (void *)(data + range[0].first), total, HTTP_BUFFER_STATIC);
+
+        return length;
+    }
+
+    total = http_fragment_len(http_byteranges_end);
+    for (i = 0; i < count; i++)
+        total += http_range_part_header(part, mimetype, &range[i], len) + range[i].last - range[i].first + 1u;
+
+    length = http_start_sized(client, HTTP_PARTIAL_CONTENT, code, http_byteranges_type, total, NULL);
+    if (length < 0)
+        return length;
+
+    for (i = 0; i < count; i++)
+    {
+        if (pico_http_submit_buffer(client->connectionID, part, http_range_part_header(part, mimetype, &range[i], len), HTTP_BUFFER_COPY) < 0)
+            break;
+
+        pico_http_submit_buffer(client->connectionID, (void *)(data + range[i].first),
+                                range[i].last - range[i].first + 1u, HTTP_BUFFER_STATIC);
+    }
+
+    if (i < count)
+    {
+        /* out of memory, the body can not be completed */
+        client->keep_alive = 0;
+        client->state = HTTP_SENDING_FINAL;
+        return length;
+    }
+
+    pico_http_submit_buffer(client->connectionID, (void *)http_byteranges_end, http_fragment_len(http_byteranges_end), HTTP_BUFFER_STATIC);
+    return length;
+}
+
+/*
+ * Same as pico_http_respond_sized, the body being the static buffer
+ * data of len bytes, which must stay valid until the response was sent.
+ * The server queues the data itself and answers Range requests with
+ * the matching slices (206 Partial Content), so no data must be submitted.
+ * If mimetype is NULL it is guessed from the resource.
+ */
+int32_t pico_http_respond_static(uint16_t conn, uint16_t code, const char *mimetype, const void *data, uint32_t len)
+{
+    struct http_client *client = find_client(conn);
+
+    if (!client)
+    {
+        dbg("Client not found !\n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    if (client->state != HTTP_WAIT_RESPONSE || !(code & HTTP_RESOURCE_FOUND))
+        return pico_http_respond_mimetype(conn, code, mimetype);
+
+    if (!data && len)
+    {
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
+
+    if (!mimetype)
+        mimetype = pico_http_get_mimetype(client->resource);
+
+    return http_send_static(client, code, mimetype, data, len);
+}
+
+/*
+ * API used to submit data to the client.
+ * Server sends data using Transfer-Encoding: chunked, unless the
+ * response was started with pico_http_respond_sized.
+ *
+ * With this function the user will submit a data chunk to
+ * be sent. If it's static data the function will not allocate a buffer.
+ * The chunk is queued and sent once the stack runs again and then on
+ * WR events from sockets, so more chunks can be submitted before the
+ * previous ones are sent. Small chunks submitted together are packed
+ * in a single segment.
+ * After each turn of transmission EV_HTTP_PROGRESS is called and at
+ * the end of each chunk EV_HTTP_SENT is called.
+ *
+ * To let the client know this is the last chunk, the user
+ * should pass a NULL buffer.
+ *
+ * Data rendered on the fly can avoid the copy with pico_http_reserve()
+ * and pico_http_commit().
+ */
+int16_t pico_http_submit_data(uint16_t conn, void *buffer, uint32_t len)
+{
+    struct http_client *client = find_client(conn);
+
+    if (!client)
+    {
+        dbg("Wrong connection ID\n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    return pico_http_submit_buffer(conn, buffer, len,
+                                   (client->state == HTTP_WAIT_STATIC_DATA) ? HTTP_BUFFER_STATIC : HTTP_BUFFER_COPY);
+}
+
+/*
+ * Room for a copied chunk in the copy area of a pooled connection. The
+ * copies leave in the order they were queued, so the area is used as a
+ * ring of contiguous blocks; NULL if the block does not fit yet.
+ */
+static uint8_t *http_copy_alloc(struct http_client *client, uint16_t len)
+{
+    uint16_t offset;
+
+    if (!client->copy_count)
+    {
+        client->copy_start = 0;
+        client->copy_end = 0;
+        client->copy_limit = 0;
+    }
+
+    if (client->copy_limit)
+    {
+        /* wrapped, the room is between the newer and the older copies */
+        if ((uint16_t)(client->copy_start - client->copy_end) < len)
+            return NULL;
+    }
+    else if ((uint16_t)(HTTP_POOL_COPY_SIZE - client->copy_end) < len)
+    {
+        /* go back to the start of the area if the oldest copy left room there */
+        if (client->copy_start < len)
+            return NULL;
+
+        client->copy_limit = client->copy_end;
+        client->copy_end = 0;
+    }
+
+    offset = client->copy_end;
+    client->copy_end = (uint16_t)(client->copy_end + len);
+    client->copy_count++;
+    return client->copy_buf + offset;
+}
+
+/* releases the oldest copy of a pooled connection */
+static void http_copy_release(struct http_client *client, uint8_t *data, uint32_t len)
+{
+    if (!--client->copy_count)
+        return;
+
+    client->copy_start = (uint16_t)((data - client->copy_buf) + len);
+    if (client->copy_limit && client->copy_start == client->copy_limit)
+    {
+        client->copy_start = 0;
+        client->copy_limit = 0;
+    }
+}
+
+/*
+ * Same as pico_http_submit_data, with the ownership of the buffer
+ * given explicitly :
+ *
+ * HTTP_BUFFER_COPY - the data is copied, the buffer can be reused at once
+ * HTTP_BUFFER_STATIC - the buffer must stay valid until EV_HTTP_SENT
+ * HTTP_BUFFER_TAKE - the buffer was allocated with PICO_ZALLOC and is
+ *                    freed by the server once it is sent
+ *
+ * Returns HTTP_RETURN_BUSY when the chunk was queued but the amount
+ * of queued data reached the high-water mark, the user should then wait
+ * for EV_HTTP_SENT before submitting more. A chunk is only refused when
+ * the queue is already full, or, on a server with a connection pool, when
+ * a copy does not fit in the HTTP_POOL_COPY_SIZE bytes of the connection.
+ */
+int16_t pico_http_submit_buffer(uint16_t conn, void *buffer, uint32_t len, uint8_t ownership)
+{
+    struct http_client *client = find_client(conn);
+
+    if (!client)
+    {
+        dbg("Wrong connection ID\n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    if (client->state == HTTP_WEBSOCKET || ownership > HTTP_BUFFER_TAKE)
+    {
+        /* raw bytes would break the framing, see pico_http_websocket_send() */
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
+
+    return http_submit(client, buffer, len, ownership);
+}
+
+/* queues a chunk on a connection answering a request or upgraded */
+static int16_t http_submit(struct http_client *client, void *buffer, uint32_t len, uint8_t ownership)
+{
+    struct http_send_desc *desc;
+
+    if (client->identity && (!buffer || !len) &&
+        (client->state == HTTP_SENDING_FINAL || client->state == HTTP_FLUSHING))
+    {
+        /* the sized body is already complete */
+        return HTTP_RETURN_OK;
+    }
+
+    if (client->state != HTTP_WAIT_DATA && client->state != HTTP_WAIT_STATIC_DATA &&
+        (client->state != HTTP_WEBSOCKET || !buffer || !len))
+    {
+        dbg("Client is in a different state than accepted\n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    if (!buffer || !len)
+    {
+        if (client->identity)
+        {
+            dbg("Body shorter than the announced length\n");
+            return HTTP_RETURN_ERROR;
+        }
+
+        /* last chunk, sent once the queue is drained */
+        client->state = HTTP_SENDING_FINAL;
+        http_tx_schedule(client);
+        return HTTP_RETURN_OK;
+    }
+
+    if (client->identity && len > client->content_left)
+    {
+        dbg("Body longer than the announced length\n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    if (client->queue_count >= HTTP_SEND_QUEUE_LEN)
+    {
+        dbg("Send queue full\n");
+        return HTTP_RETURN_CONN_BUSY;
+    }
+
+    desc = &client->queue[(client->queue_head + client->queue_count) % HTTP_SEND_QUEUE_LEN];
+    desc->data = buffer;
+    desc->len = len;
+    desc->ownership = ownership;
+    if (ownership == HTTP_BUFFER_ARENA)
+    {
+        /* already in place, released like a copy */
+        desc->ownership = HTTP_BUFFER_COPY;
+    }
+    else if (ownership == HTTP_BUFFER_COPY && client->pooled)
+    {
+        if (len > HTTP_POOL_COPY_SIZE)
+        {
+            dbg("Buffer larger than the copy room of the connection\n");
+            pico_err = PICO_ERR_EINVAL;
+            return HTTP_RETURN_ERROR;
+        }
+
+        desc->data = http_copy_alloc(client, (uint16_t)len);
+        if (!desc->data)
+        {
+            dbg("No room left for copies\n");
+            return HTTP_RETURN_CONN_BUSY;
+        }
+
+        memcpy(desc->data, buffer, len);
+    }
+    else if (ownership == HTTP_BUFFER_COPY)
+    {
+        desc->data = PICO_ZALLOC(len);
+        if (!desc->data)
+        {
+            pico_err = PICO_ERR_ENOMEM;
+            return HTTP_RETURN_ERROR;
+        }
+
+        /* taking over the buffer */
+        memcpy(desc->data, buffer, len);
+    }
+
+    client->queue_count++;
+    client->queue_bytes += len;
+    if (client->identity)
+    {
+        client->content_left -= len;
+        if (!client->content_left)
+            client->state = HTTP_SENDING_FINAL;
+    }
+    http_tx_schedule(client);
+
+    if (client->queue_bytes >= client->server->send_highwater || client->queue_count >= HTTP_SEND_QUEUE_LEN)
+        return HTTP_RETURN_BUSY;
+
+    return HTTP_RETURN_OK;
+}
+
+/*
+ * Room for a chunk the server builds itself, checked against the send
+ * queue first so that queuing it cannot fail. A pooled connection takes
+ * it from its copy area and does not touch the allocator.
+ */
+static int16_t http_chunk_alloc(struct http_client *client, uint32_t len, uint8_t **buf)
+{
+    if (client->queue_count >= HTTP_SEND_QUEUE_LEN)
+    {
+        dbg("Send queue full\n");
+        return HTTP_RETURN_CONN_BUSY;
+    }
+
+    if (!client->pooled)
+    {
+        *buf = PICO_ZALLOC(len);
+        if (!*buf)
+        {
+            pico_err = PICO_ERR_ENOMEM;
+            return HTTP_RETURN_ERROR;
+        }
+
+        return HTTP_RETURN_OK;
+    }
+
+    if (len > HTTP_POOL_COPY_SIZE)
+    {
+        dbg("Chunk larger than the copy room of the connection\n");
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
+
+    *buf = http_copy_alloc(client, (uint16_t)len);
+    return *buf ? HTTP_RETURN_OK : HTTP_RETURN_CONN_BUSY;
+}
+
+/* queues a chunk from http_chunk_alloc() */
+static int16_t http_chunk_submit(struct http_client *client, uint8_t *buf, uint32_t len)
+{
+    return http_submit(client, buf, len, client->pooled ? HTTP_BUFFER_ARENA : HTTP_BUFFER_TAKE);
+}
+
+/*
+ * Room for a chunk at the end of the transmit stage, after its framing.
+ * A sized body gets no framing and the room stops at its length.
+ */
+static uint16_t http_tx_room(struct http_client *client)
+{
+    uint16_t framing = client->identity ? 0u : HTTP_RESERVE_FRAMING;
+    uint16_t room;
+
+    if (client->tx_len + framing >= client->tx_size)
+        return 0;
+
+    room = (uint16_t)(client->tx_size - client->tx_len - framing);
+    if (client->identity && room > client->content_left)
+        room = (uint16_t)client->content_left;
+
+    return room;
+}
+
+#define http_tx_room_data(client) \
+    ((client)->tx_buf + (client)->tx_len + ((client)->identity ? 0u : HTTP_RESERVE_LINE))
+
+/* adds the chunk rendered in the room of the stage, with its framing */
+static void http_tx_commit(struct http_client *client, uint16_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    uint8_t *line;
+
+    if (client->identity)
+    {
+        client->tx_len = (uint16_t)(client->tx_len + len);
+        client->content_left -= len;
+        if (!client->content_left)
+            client->state = HTTP_SENDING_FINAL;
+
+        return;
+    }
+
+    /* the size line has a fixed width, leading zeroes are allowed */
+    line = client->tx_buf + client->tx_len;
+    line[0] = (uint8_t)hex[(len >> 12) & 0xF];
+    line[1] = (uint8_t)hex[(len >> 8) & 0xF];
+    line[2] = (uint8_t)hex[(len >> 4) & 0xF];
+    line[3] = (uint8_t)hex[len & 0xF];
+    line[4] = '\r';
+    line[5] = '\n';
+    client->tx_len = (uint16_t)(client->tx_len + HTTP_RESERVE_LINE + len);
+    client->tx_buf[client->tx_len++] = '\r';
+    client->tx_buf[client->tx_len++] = '\n';
+}
+
+/*
+ * Hands out writable room in the transmit stage of a connection, so a
+ * dynamic chunk can be rendered in place instead of being copied. The
+ * room is at least 1 byte and its size is stored in *len; the chunk is
+ * sent once pico_http_commit() gives its length, which must happen
+ * before returning to the stack.
+ *
+ * Returns NULL with EAGAIN while earlier chunks are still queued or the
+ * stage is full, EV_HTTP_SENT tells when to try again.
+ */
+uint8_t *pico_http_reserve(uint16_t conn, uint16_t *len)
+{
+    struct http_client *client = find_client(conn);
+    uint16_t room;
+
+    if (!client || !len || (client->state != HTTP_WAIT_DATA && client->state != HTTP_WAIT_STATIC_DATA) ||
+        http_deflating(client))
+    {
+        dbg("Client is in a different state than accepted\n");
+        pico_err = PICO_ERR_EINVAL;
+        return NULL;
+    }
+
+    /* the reserved chunk has to follow what is already queued */
+    room = http_tx_room(client);
+    if (client->queue_count || !room)
+    {
+        /* the queued chunks raise EV_HTTP_SENT already */
+        client->tx_wanted = client->queue_count ? 0u : 1u;
+        pico_err = PICO_ERR_EAGAIN;
+        return NULL;
+    }
+
+    client->tx_reserved = room;
+    client->tx_reserve_at = client->tx_len;
+    *len = room;
+    return http_tx_room_data(client);
+}
+
+/*
+ * Sends the first len bytes of the room given by pico_http_reserve() as
+ * a chunk. The chunk framing is written around them in place.
+ */
+int16_t pico_http_commit(uint16_t conn, uint16_t len)
+{
+    struct http_client *client = find_client(conn);
+
+    if (!client || !client->tx_reserved || len > client->tx_reserved || client->tx_len != client->tx_reserve_at)
+    {
+        dbg("Nothing reserved\n");
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
+
+    client->tx_reserved = 0;
+    if (!len)
+        return HTTP_RETURN_OK;
+
+    http_tx_commit(client, len);
+    http_tx_schedule(client);
+    return HTTP_RETURN_OK;
+}
+
+/*
+ * Installs a producer for the body of the response, instead of
+ * submitting it. Whenever the socket can take more, the server calls
+ * produce(conn, buf, len, arg) with room in the transmit stage; it
+ * writes at most len bytes to buf and returns how many, 0 once the body
+ * is complete, or a negative value when nothing is ready yet, then
+ * pico_http_resume_producer() tells when it is. Queued chunks go out
+ * before the produced ones. The producer is dropped with the response;
+ * returning more than len resets the connection.
+ */
+int16_t pico_http_set_producer(uint16_t conn, int32_t (*produce)(uint16_t conn, uint8_t *buf, uint16_t len, void *arg),
+                               void *arg)
+{
+    struct http_client *client = find_client(conn);
+
+    if (!client || !produce || client->state != HTTP_WAIT_DATA || http_deflating(client))
+    {
+        dbg("Client is in a different state than accepted\n");
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
+
+    client->produce = produce;
+    client->produce_arg = arg;
+    client->produce_wait = 0;
+    http_tx_schedule(client);
+    return HTTP_RETURN_OK;
+}
+
+/* calls the producer of the connection again, after it had nothing ready */
+int16_t pico_http_resume_producer(uint16_t conn)
+{
+    struct http_client *client = find_client(conn);
+
+    if (!client || !client->produce)
+    {
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
+
+    client->produce_wait = 0;
+    http_tx_schedule(client);
+    return HTTP_RETURN_OK;
+}
+
+/*
+ * Lets the producer fill the room of the stage. Returns 0 if the
+ * connection went away from the callback.
+ */
+static int8_t http_tx_produce(struct http_client *client)
+{
+    uint16_t conn = client->connectionID;
+    uint16_t room = http_tx_room(client);
+    int32_t len;
+
+    /* a nearly full stage goes out first */
+    if (!room || (client->tx_len && room < client->tx_size / 4u))
+        return 1;
+
+    len = client->produce(conn, http_tx_room_data(client), room, client->produce_arg);
+    if (!find_client(conn))
+        return 0;
+
+    if (len > (int32_t)room)
+    {
+        /* it wrote past the stage already, nothing of it can be trusted */
+        dbg("Producer overran its room\n");
+        client->produce = NULL;
+        http_client_expire(client);
+        return 0;
+    }
+
+    if (len < 0)
+    {
+        client->produce_wait = 1u;
+    }
+    else if (len == 0)
+    {
+        client->produce = NULL;
+        if (client->identity)
+        {
+            dbg("Body shorter than the announced length\n");
+            http_client_expire(client);
+            return 0;
+        }
+
+        client->state = HTTP_SENDING_FINAL;
+    }
+    else
+    {
+        http_tx_commit(client, (uint16_t)len);
+    }
+
+    return 1;
+}
+
+/*
+ * API for compressing the body of the next response on the fly, called
+ * before pico_http_respond(). The body is compressed with gzip, or with
+ * deflate, if the Accept-Encoding of the request allows it; the server
+ * has to be built with PICO_HTTP_SERVER_DEFLATE. Only chunked responses
+ * are compressed, a sized or static body is sent as announced, and the
+ * body has to be submitted : reserving room or installing a producer is
+ * refused. Returns 1 if the body will be compressed, 0 if not.
+ */
+int16_t pico_http_compress(uint16_t conn)
+{
+    struct http_client *client = find_client(conn);
+#ifdef PICO_HTTP_SERVER_DEFLATE
+    const char *accept;
+#endif
+
+    if (!client || client->state != HTTP_WAIT_RESPONSE)
+    {
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
+
+#ifdef PICO_HTTP_SERVER_DEFLATE
+    accept = pico_http_get_header(conn, HTTP_HDR_ACCEPT_ENCODING, NULL);
+    client->encoding |= HTTP_ENCODING_VARY;
+    if (http_header_accepts(accept, "gzip"))
+        client->compress = HTTP_ENCODING_GZIP;
+    else if (http_header_accepts(accept, "deflate"))
+        client->compress = HTTP_ENCODING_DEFLATE;
+    else
+        client->compress = 0;
+
+    return client->compress ? 1 : 0;
+#else
+    return 0;
+#endif
+}
+
+#ifdef PICO_HTTP_SERVER_DEFLATE
+/* zlib state comes from the picoTCP allocator */
+static voidpf http_zalloc(voidpf opaque, uInt items, uInt size)
+{
+    return PICO_ZALLOC((size_t)items * size);
+}
+
+static void http_zfree(voidpf opaque, voidpf address)
+{
+    PICO_FREE(address);
+}
+#endif
+
+/* sets up the compressor of a chunked response, it is sent as is without memory */
+static void http_deflate_start(struct http_client *client)
+{
+#ifdef PICO_HTTP_SERVER_DEFLATE
+    struct pico_http_server *srv = client->server;
+    int window_bits = srv->deflate_window_bits;
+
+    if (!client->compress || client->deflate)
+        return;
+
+    client->deflate = PICO_ZALLOC(sizeof(z_stream));
+    if (!client->deflate)
+    {
+        dbg("No memory for the compressor\n");
+        client->compress = 0;
+        return;
+    }
+
+    client->deflate->zalloc = http_zalloc;
+    client->deflate->zfree = http_zfree;
+    client->deflate->opaque = NULL;
+    /* a window of 9 bits is not supported with a zlib or gzip wrapper */
+    if (window_bits < 10)
+        window_bits = 10;
+    if (client->compress == HTTP_ENCODING_GZIP)
+        window_bits += 16;
+
+    if (deflateInit2(client->deflate, HTTP_DEFLATE_LEVEL, Z_DEFLATED, window_bits,
+                     srv->deflate_mem_level, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        dbg("No memory for the compressor\n");
+        PICO_FREE(client->deflate);
+        client->deflate = NULL;
+        client->compress = 0;
+        return;
+    }
+
+    client->encoding |= client->compress;
+    client->compress = 0;
+    client->deflate_dirty = 0;
+#endif
+}
+
+/* releases the compressor of the response, if any */
+static void http_deflate_end(struct http_client *client)
+{
+#ifdef PICO_HTTP_SERVER_DEFLATE
+    if (!client->deflate)
+        return;
+
+    deflateEnd(client->deflate);
+    PICO_FREE(client->deflate);
+    client->deflate = NULL;
+#endif
+}
+
+
+/*
+ * When EV_HTTP_PROGRESS is triggered you can use this
+ * function to check the state of the chunk being sent.
+ */
+
+int16_t pico_http_get_progress(uint16_t conn, uint32_t *sent, uint32_t *total)
+{
+    struct http_client *client = find_client(conn);
+
+    if(!client)
+    {
+        dbg("Wrong connection id !\n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    if (client->queue_count)
+    {
+        *sent = client->head_sent;
+        *total = client->queue[client->queue_head].len;
+    }
+    else
+    {
+        *sent = 0;
+        *total = 0;
+    }
+
+    return HTTP_RETURN_OK;
+}
+
+/* closes the listeners and the connections of a server, its routes are dropped */
+static void http_server_close(struct pico_http_server *srv)
+{
+    struct pico_tree_node *index, *tmp;
+    struct pico_http_server **link;
+    uint8_t i;
+
+    for (i = 0; i < HTTP_SERVER_LISTENERS; i++)
+    {
+        if (srv->sck[i])
+            pico_socket_close(srv->sck[i]);
+
+        srv->sck[i] = NULL;
+    }
+
+    /* destroy the tree */
+    pico_tree_foreach_safe(index, &srv->clients, tmp)
+    {
+        struct http_client *client = index->keyValue;
+
+        pico_socket_close(client->sck);
+        pico_tree_delete(&srv->clients, client);
+        http_conn_unregister(client);
+        http_client_free(srv, client);
+    }
+
+    for (link = &servers; *link; link = &(*link)->next)
+    {
+        if (*link == srv)
+        {
+            *link = srv->next;
+            break;
+        }
+    }
+
+    http_route_free(srv->routes);
+    srv->routes = NULL;
+    PICO_FREE(srv->pool);
+    srv->pool = NULL;
+    srv->pool_free = NULL;
+    srv->connections = 0;
+    srv->next = NULL;
+    srv->state = HTTP_SERVER_CLOSED;
+}
+
+/*
+ * This API can be used to close either a client
+ * or the server ( if you pass HTTP_SERVER_ID as a connection ID).
+ */
+int16_t pico_http_close(uint16_t conn)
+{
+    /* close the server */
+    if (conn == HTTP_SERVER_ID)
+    {
+        if (default_server.state == HTTP_SERVER_LISTEN)
+        {
+            http_server_close(&default_server);
+            return HTTP_RETURN_OK;
+        }
+        else /* nothing to close */
+            return HTTP_RETURN_ERROR;
+    } /* close a connection in this case */
+    else
+    {
+        struct http_client *client = find_client(conn);
+
+        if (!client)
+        {
+            dbg("Client not found..\n");
+            return HTTP_RETURN_ERROR;
+        }
+
+        pico_tree_delete(&client->server->clients, client);
+        http_conn_unregister(client);
+        client->server->connections--;
+
+        if (client->state != HTTP_CLOSED || !client->sck)
+            pico_socket_close(client->sck);
+
+        http_client_free(client->server, client);
+        return HTTP_RETURN_OK;
+    }
+}
+
+/*
+ * Closes a server instance made with pico_http_server_create(), its
+ * listeners and connections, and releases it.
+ */
+int16_t pico_http_server_destroy(struct pico_http_server *srv)
+{
+    if (!srv || srv == &default_server)
+    {
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
+
+    http_server_close(srv);
+    PICO_FREE(srv);
+    return HTTP_RETURN_OK;
+}
+
+/*
+ * Returns the length of the request method at the start of the line
+ * and stores its identifier, 0 if the method is not supported.
+ */
+static uint16_t parse_request_method(const char *line, uint16_t len, uint16_t *method)
+{
+    if (len > 4u && memcmp(line, "GET ", 4u) == 0)
+    {
+        *method = HTTP_METHOD_GET;
+        return 3u;
+    }
+
+    if (len > 5u && memcmp(line, "POST ", 5u) == 0)
+    {
+        *method = HTTP_METHOD_POST;
+        return 4u;
+    }
+
+    return 0;
+}
+
+/*
+ * Parses the request line ("<METHOD> <resource> HTTP/1.x").
+ * The resource is terminated in place inside the receive buffer,
+ * so no copy of it is made.
+ */
+static int16_t parse_request_line(struct http_client *client, char *line, uint16_t len)
+{
+    uint16_t method_length;
+    uint16_t index;
+
+    method_length = parse_request_method(line, len, &client->method);
+    if (!method_length)
+    {
+        dbg("Wrong command\n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    /* start reading the resource, go after ' ' */
+    index = (uint16_t)(method_length + 1u);
+    while (index < len && line[index] != ' ')
+        index++;
+
+    if (index == method_length + 1u || index + 9u > len || memcmp(line + index + 1, "HTTP/1.", 7u))
+    {
+        dbg("No terminator or wrong protocol...\n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    line[index] = '\0';
+    client->resource = line + method_length + 1;
+
+    /* HTTP/1.1 connections are persistent unless told otherwise */
+    client->keep_alive = (line[index + 8] != '0');
+    return HTTP_RETURN_OK;
+}
+
+/*
+ * Maps a header name to its id with the perfect hash,
+ * HTTP_HDR_NONE if the header is not indexed.
+ */
+static uint8_t http_header_id(const char *name, uint16_t len)
+{
+    const char *known;
+    uint8_t id;
+    uint16_t i;
+
+    if (len < 4u)
+        return HTTP_HDR_NONE;
+
+    id = http_header_slots[http_header_hash(name, len)];
+    if (id == HTTP_HDR_NONE)
+        return HTTP_HDR_NONE;
+
+    known = http_header_names[id];
+    for (i = 0; i < len; i++)
+    {
+        /* known names only contain letters and '-', for which | 0x20 lowers the case */
+        if ((char)(name[i] | 0x20) != known[i] || !known[i])
+            return HTTP_HDR_NONE;
+    }
+
+    return known[len] ? HTTP_HDR_NONE : id;
+}
+
+/*
+ * Parses a "<name>: <value>" header line. Values of the known
+ * headers are recorded in the index and terminated in place.
+ */
+static int16_t parse_header_field(struct http_client *client, char *line, uint16_t len)
+{
+    char *colon = memchr(line, ':', len);
+    uint16_t name_len;
+    uint16_t start;
+    uint8_t id;
+
+    if (!colon || colon == line)
+    {
+        dbg("Malformed header line\n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    name_len = (uint16_t)(colon - line);
+    id = http_header_id(line, name_len);
+    if (id == HTTP_HDR_NONE || client->headers[id].offset)
+        return HTTP_RETURN_OK;
+
+    /* strip the optional white space around the value */
+    start = (uint16_t)(name_len + 1u);
+    while (start < len && (line[start] == ' ' || line[start] == '\t'))
+        start++;
+    while (len > start && (line[len - 1] == ' ' || line[len - 1] == '\t'))
+        len--;
+
+    /* the byte after the value is white space or the line end, never data */
+    line[len] = '\0';
+    client->headers[id].offset = (uint16_t)((uint8_t *)line + start - client->rx_buf);
+    client->headers[id].len = (uint16_t)(len - start);
+    return HTTP_RETURN_OK;
+}
+
+/*
+ * Checks if a comma separated header value contains the
+ * token, the token must be given in lower case.
+ */
+static uint8_t http_header_has_token(const char *value, const char *token)
+{
+    uint16_t len = (uint16_t)strlen(token);
+    uint16_t i;
+
+    while (value && *value)
+    {
+        while (*value == ' ' || *value == '\t' || *value == ',')
+            value++;
+
+        for (i = 0; i < len && value[i] && (char)(value[i] | 0x20) == token[i]; i++)
+            ;
+
+        if (i == len && (!value[i] || value[i] == ',' || value[i] == ' ' || value[i] == ';' || value[i] == '\t'))
+            return 1u;
+
+        value = strchr(value, ',');
+    }
+
+    return 0;
+}
+
+/*
+ * Same as http_header_has_token, except that a token listed with
+ * a zero quality value (";q=0") counts as refused.
+ */
+static uint8_t http_header_accepts(const char *value, const char *token)
+{
+    uint16_t len = (uint16_t)strlen(token);
+    uint16_t i;
+
+    while (value && *value)
+    {
+        while (*value == ' ' || *value == '\t' || *value == ',')
+            value++;
+
+        for (i = 0; i < len && value[i] && (char)(value[i] | 0x20) == token[i]; i++)
+            ;
+
+        if (i == len && (!value[i] || value[i] == ',' || value[i] == ' ' || value[i] == ';' || value[i] == '\t'))
+        {
+            value += len;
+            while (*value == ' ' || *value == '\t')
+                value++;
+
+            if (*value != ';')
+                return 1u;
+
+            value++;
+            while (*value == ' ' || *value == '\t')
+                value++;
+
+            if ((value[0] | 0x20) != 'q' || value[1] != '=' || value[2] != '0')
+                return 1u;
+
+            /* q=0, q=0.0 or q=0.000 refuse the token */
+            for (value += 3; *value == '.' || *value == '0'; value++)
+                ;
+            return (uint8_t)(*value >= '1' && *value <= '9');
+        }
+
+        value = strchr(value, ',');
+    }
+
+    return 0;
+}
+
+/* parses a decimal number, returns -1 on garbage or overflow */
+static int8_t http_parse_uint(const char *str, uint16_t len, uint32_t *value)
+{
+    uint32_t result = 0;
+    uint16_t i;
+
+    if (!len)
+        return -1;
+
+    for (i = 0; i < len; i++)
+    {
+        if (str[i] < '0' || str[i] > '9' || result > (0xFFFFFFFFu - 9u) / 10u)
+            return -1;
+
+        result = result * 10u + (uint32_t)(str[i] - '0');
+    }
+
+    *value = result;
+    return 0;
+}
+
+/* parses the size of a chunk, extensions behind it are ignored */
+static int8_t http_parse_hex(const char *str, uint16_t len, uint32_t *value)
+{
+    uint32_t result = 0;
+    uint16_t i;
+    uint8_t digit;
+
+    for (i = 0; i < len; i++)
+    {
+        if (str[i] >= '0' && str[i] <= '9')
+            digit = (uint8_t)(str[i] - '0');
+        else if ((str[i] | 0x20) >= 'a' && (str[i] | 0x20) <= 'f')
+            digit = (uint8_t)((str[i] | 0x20) - 'a' + 10);
+        else
+            break;
+
+        if (result > 0x0FFFFFFFu)
+            return -1;
+
+        result = (result << 4) | digit;
+    }
+
+    if (!i || (i < len && str[i] != ';' && str[i] != ' ' && str[i] != '\t'))
+        return -1;
+
+    *value = result;
+    return 0;
+}
+
+/*
+ * Finds the next framing line of a chunked body. Lines are collected in
+ * the receive buffer behind the header, reading from the socket when fill
+ * is set. Returns HTTP_RETURN_OK with the line length (terminator excluded)
+ * and the offset behind it, or HTTP_RETURN_BUSY if the line is incomplete.
+ */
+static int16_t http_body_line(struct http_client *client, uint8_t fill, uint16_t *len, uint16_t *next)
+{
+    uint8_t *eol;
+    uint16_t end, space;
+    int32_t ret;
+
+    for (;;)
+    {
+        eol = memchr(client->rx_buf + client->body_pos, '\n', (size_t)(client->rx_len - client->body_pos));
+        if (eol)
+        {
+            end = (uint16_t)(eol - client->rx_buf);
+            *next = (uint16_t)(end + 1u);
+            *len = (uint16_t)(end - client->body_pos);
+            if (*len > 0 && client->rx_buf[end - 1] == '\r')
+                (*len)--;
+
+            return HTTP_RETURN_OK;
+        }
+
+        if ((uint16_t)(client->rx_len - client->body_pos) > HTTP_HEADER_MAX_LINE)
+            return HTTP_RETURN_ERROR;
+
+        if (!fill)
+            return HTTP_RETURN_BUSY;
+
+        /* the payload read so far is dropped, the header stays */
+        if (client->body_pos > client->hdr_len)
+        {
+            memmove(client->rx_buf + client->hdr_len, client->rx_buf + client->body_pos, (size_t)(client->rx_len - client->body_pos));
+            client->rx_len = (uint16_t)(client->rx_len - (client->body_pos - client->hdr_len));
+            client->body_pos = client->hdr_len;
+        }
+
+        space = (uint16_t)(client->rx_size - client->rx_len);
+        if (!space)
+            return HTTP_RETURN_ERROR;
+
+        ret = pico_socket_read(client->sck, client->rx_buf + client->rx_len, space);
+        if (ret < 0)
+            return HTTP_RETURN_ERROR;
+
+        if (ret == 0)
+            return HTTP_RETURN_BUSY;
+
+        client->rx_len = (uint16_t)(client->rx_len + ret);
+        client->rx_buf[client->rx_len] = 0;
+    }
+}
+
+/*
+ * Decodes up to len bytes of the request body into buf. Bytes already
+ * buffered behind the header come first, the rest of the payload is
+ * read from the socket straight into buf. With a NULL buf the buffered
+ * part of the body is skipped, nothing is read from the socket.
+ * Returns the number of payload bytes, or HTTP_RETURN_ERROR.
+ */
+static int32_t http_body_read(struct http_client *client, uint8_t *buf, uint32_t len)
+{
+    uint32_t copied = 0, n;
+    uint16_t line, next;
+    int32_t ret;
+    int16_t found;
+
+    while (client->body_state != HTTP_BODY_DONE)
+    {
+        if (client->body_state == HTTP_BODY_DATA)
+        {
+            if (copied == len)
+                break;
+
+            n = len - copied;
+            if (n > client->body_left)
+                n = client->body_left;
+
+            if (client->body_pos < client->rx_len)
+            {
+                if (n > (uint32_t)(client->rx_len - client->body_pos))
+                    n = (uint32_t)(client->rx_len - client->body_pos);
+
+                if (buf)
+                    memcpy(buf + copied, client->rx_buf + client->body_pos, n);
+
+                client->body_pos = (uint16_t)(client->body_pos + n);
+            }
+            else
+            {
+                if (!buf)
+                    break;
+
+                ret = pico_socket_read(client->sck, buf + copied, (int)n);
+                if (ret < 0)
+                    return HTTP_RETURN_ERROR;
+
+                if (ret == 0)
+                    break;
+
+                n = (uint32_t)ret;
+            }
+
+            copied += n;
+            client->body_left -= n;
+            if (!client->body_left)
+                client->body_state = client->body_chunked ? HTTP_BODY_CHUNK_END : HTTP_BODY_DONE;
+
+            continue;
+        }
+
+        found = http_body_line(client, buf != NULL, &line, &next);
+        if (found == HTTP_RETURN_ERROR)
+            return HTTP_RETURN_ERROR;
+
+        if (found == HTTP_RETURN_BUSY)
+            break;
+
+        if (client->body_state == HTTP_BODY_CHUNK_SIZE)
+        {
+            if (http_parse_hex((const char *)client->rx_buf + client->body_pos, line, &client->body_left) < 0)
+                return HTTP_RETURN_ERROR;
+
+            client->body_state = client->body_left ? HTTP_BODY_DATA : HTTP_BODY_TRAILER;
+        }
+        else if (client->body_state == HTTP_BODY_CHUNK_END)
+        {
+            if (line)
+                return HTTP_RETURN_ERROR;
+
+            client->body_state = HTTP_BODY_CHUNK_SIZE;
+        }
+        else if (!line)
+        {
+            /* trailer fields are ignored until the empty line */
+            client->body_state = HTTP_BODY_DONE;
+        }
+
+        client->body_pos = next;
+    }
+
+    return (int32_t)copied;
+}
+
+/*
+ * Finds out how the request body is framed. A chunked transfer coding
+ * wins over Content-Length, other codings are refused.
+ */
+static int16_t http_body_start(struct http_client *client)
+{
+    struct http_header_field *field = &client->headers[HTTP_HDR_TRANSFER_ENCODING];
+
+    client->body_pos = client->hdr_len;
+    client->body_state = HTTP_BODY_DONE;
+    client->body_chunked = 0;
+    client->body_left = 0;
+
+    if (field->offset)
+    {
+        if (!http_header_has_token((const char *)client->rx_buf + field->offset, "chunked"))
+            return HTTP_RETURN_ERROR;
+
+        client->body_chunked = 1u;
+        client->body_state = HTTP_BODY_CHUNK_SIZE;
+        return HTTP_RETURN_OK;
+    }
+
+    field = &client->headers[HTTP_HDR_CONTENT_LENGTH];
+    if (field->offset)
+    {
+        if (http_parse_uint((const char *)client->rx_buf + field->offset, field->len, &client->body_left) < 0)
+            return HTTP_RETURN_ERROR;
+
+        if (client->body_left)
+            client->body_state = HTTP_BODY_DATA;
+    }
+
+    return HTTP_RETURN_OK;
+}
+
+/* gives the pipelined data back the byte that terminated the body */
+static inline void http_body_uncut(struct http_client *client)
+{
+    if (client->body_end)
+        client->rx_buf[client->body_end] = client->body_end_byte;
+
+    client->body_end = 0;
+}
+
+/*
+ * Decides if the connection can be reused once this request is answered.
+ */
+static void check_keepalive(struct http_client *client)
+{
+    const char *value;
+
+    value = (const char *)client->rx_buf + client->headers[HTTP_HDR_CONNECTION].offset;
+    if (client->headers[HTTP_HDR_CONNECTION].offset)
+    {
+        if (http_header_has_token(value, "close"))
+            client->keep_alive = 0;
+    }
+
+    if ((uint32_t)client->requests + 1u >= client->server->keepalive_max)
+        client->keep_alive = 0;
+}
+
+/* Boyer-Moore-Horspool search of the part delimiter, returns its offset or -1 */
+static int32_t http_multipart_find(const struct http_multipart *mp, const uint8_t *buf, uint16_t len)
+{
+    uint16_t last = (uint16_t)(mp->delim_len - 1u);
+    uint16_t i = 0;
+    int32_t j;
+
+    while ((uint32_t)i + mp->delim_len <= len)
+    {
+        for (j = last; buf[i + j] == mp->delim[j]; j--)
+        {
+            if (!j)
+                return i;
+        }
+        i = (uint16_t)(i + mp->skip[buf[i + last]]);
+    }
+
+    return -1;
+}
+
+/*
+ * Parses the header lines of a part, which are complete in the window
+ * and NUL terminated in place. Only Content-Disposition and Content-Type
+ * are looked at.
+ */
+static int16_t http_multipart_headers(char *line, struct pico_http_part *part)
+{
+    char *end, *next, *value, *key;
+
+    memset(part, 0, sizeof(struct pico_http_part));
+    while (*line)
+    {
+        end = strchr(line, '\n');
+        if (!end)
+            return HTTP_RETURN_ERROR;
+
+        next = end + 1;
+        *end = 0;
+        if (end > line && end[-1] == '\r')
+            end[-1] = 0;
+
+        value = strchr(line, ':');
+        if (value)
+        {
+            *value++ = 0;
+            while (*value == ' ' || *value == '\t')
+                value++;
+
+            if (http_header_id(line, (uint16_t)strlen(line)) == HTTP_HDR_CONTENT_TYPE)
+            {
+                part->content_type = value;
+            }
+            else if (http_header_has_token(line, "content-disposition"))
+            {
+                /* form-data; name="field"; filename="file.bin" */
+                while ((value = strchr(value, ';')) != NULL)
+                {
+                    *value++ = 0;
+                    while (*value == ' ' || *value == '\t')
+                        value++;
+
+                    key = value;
+                    value = strchr(value, '=');
+                    if (!value)
+                        break;
+
+                    *value++ = 0;
+                    if (*value == '"')
+                    {
+                        value++;
+                        end = strchr(value, '"');
+                        if (!end)
+                            return HTTP_RETURN_ERROR;
+
+                        *end = 0;
+                        if (http_header_has_token(key, "name"))
+                            part->name = value;
+                        else if (http_header_has_token(key, "filename"))
+                            part->filename = value;
+
+                        value = end + 1;
+                    }
+                    else if (http_header_has_token(key, "name"))
+                    {
+                        part->name = value;
+                    }
+                    else if (http_header_has_token(key, "filename"))
+                    {
+                        part->filename = value;
+                    }
+                }
+            }
+        }
+
+        line = next;
+    }
+
+    return HTTP_RETURN_OK;
+}
+
+/*
+ * Runs the multipart parser over the window until it finds a part,
+ * a slice of part data or the closing delimiter. Data that may be the
+ * start of a delimiter is kept back, everything else is handed out as
+ * soon as it arrived. Returns HTTP_MP_* or HTTP_RETURN_ERROR.
+ */
+static int8_t http_multipart_step(struct http_multipart *mp, struct pico_http_part *part,
+                                  const uint8_t **slice, uint16_t *slice_len)
+{
+    uint8_t *buf;
+    uint16_t avail;
+    int32_t off;
+    char *eol;
+
+    for (;;)
+    {
+        buf = mp->buf + mp->pos;
+        avail = (uint16_t)(mp->len - mp->pos);
+        switch (mp->state)
+        {
+        case HTTP_MP_PREAMBLE:
+        case HTTP_MP_DATA:
+            off = http_multipart_find(mp, buf, avail);
+            if (off < 0)
+            {
+                if (avail < mp->delim_len)
+                    return HTTP_MP_MORE;
+
+                off = avail - (mp->delim_len - 1);
+            }
+            else if (!off)
+            {
+                mp->pos = (uint16_t)(mp->pos + mp->delim_len);
+                mp->state = HTTP_MP_DELIMITER;
+                break;
+            }
+
+            mp->pos = (uint16_t)(mp->pos + off);
+            if (mp->state == HTTP_MP_DATA)
+            {
+                *slice = buf;
+                *slice_len = (uint16_t)off;
+                return HTTP_MP_SLICE;
+            }
+
+            break;
+
+        case HTTP_MP_DELIMITER:
+            /* transport padding, then CRLF or the closing "--" */
+            while (avail && (*buf == ' ' || *buf == '\t'))
+            {
+                buf++;
+                avail--;
+                mp->pos++;
+            }
+            if (avail < 2u)
+                return HTTP_MP_MORE;
+
+            mp->pos = (uint16_t)(mp->pos + 2u);
+            if (buf[0] == '-' && buf[1] == '-')
+            {
+                mp->state = HTTP_MP_EPILOGUE;
+                return HTTP_MP_END;
+            }
+
+            if (buf[0] != '\r' || buf[1] != '\n')
+                return HTTP_RETURN_ERROR;
+
+            mp->state = HTTP_MP_HEADERS;
+            break;
+
+        case HTTP_MP_HEADERS:
+            /* the whole header block, up to the empty line, has to be in the window */
+            eol = (char *)buf;
+            while ((eol = memchr(eol, '\n', (size_t)(avail - ((uint8_t *)eol - buf)))) != NULL)
+            {
+                if (eol == (char *)buf || eol[-1] == '\n')
+                    break;
+
+                if (eol[-1] == '\r' && (eol - 1 == (char *)buf || eol[-2] == '\n'))
+                {
+                    eol--;
+                    break;
+                }
+
+                eol++;
+            }
+            if (!eol)
+            {
+                if (avail >= HTTP_MULTIPART_BUFFER_SIZE)
+                    return HTTP_RETURN_ERROR;
+
+                return HTTP_MP_MORE;
+            }
+
+            mp->pos = (uint16_t)(mp->pos + ((uint8_t *)eol - buf) + ((*eol == '\r') ? 2u : 1u));
+            *eol = 0;
+            if (http_multipart_headers((char *)buf, part) < 0)
+                return HTTP_RETURN_ERROR;
+
+            mp->state = HTTP_MP_DATA;
+            return HTTP_MP_PART;
+
+        default:
+            /* the epilogue is ignored */
+            mp->pos = mp->len;
+            return HTTP_MP_MORE;
+        }
+    }
+}
+
+/* the multipart body can not be parsed, the request is refused */
+static void http_multipart_error(struct http_client *client)
+{
+    dbg("Malformed multipart body\n");
+    client->body_state = HTTP_BODY_ERROR;
+    client->keep_alive = 0;
+    if (client->state == HTTP_WAIT_RESPONSE)
+        http_request_error(client);
+    else
+        client->server->wakeup(EV_HTTP_ERROR, client->connectionID);
+}
+
+/*
+ * Feeds the request body through the multipart parser and hands the
+ * parts to the application, until the body is drained, paused, or
+ * has to wait for more data.
+ */
+static void http_multipart_run(struct http_client *client)
+{
+    struct http_multipart *mp = client->multipart;
+    struct pico_http_part part;
+    const uint8_t *slice = NULL;
+    uint16_t conn = client->connectionID;
+    uint16_t slice_len = 0;
+    int32_t ret;
+    int8_t event;
+
+    while (!client->body_paused && client->body_state != HTTP_BODY_ERROR &&
+           client->state >= HTTP_WAIT_RESPONSE && client->state <= HTTP_SENDING_FINAL)
+    {
+        event = http_multipart_step(mp, &part, &slice, &slice_len);
+        if (event == HTTP_MP_MORE)
+        {
+            if (client->body_state == HTTP_BODY_DONE)
+            {
+                if (mp->state != HTTP_MP_EPILOGUE)
+                    http_multipart_error(client);
+
+                return;
+            }
+
+            if (mp->pos)
+            {
+                memmove(mp->buf, mp->buf + mp->pos, (size_t)(mp->len - mp->pos));
+                mp->len = (uint16_t)(mp->len - mp->pos);
+                mp->pos = 0;
+            }
+
+            ret = http_body_read(client, mp->buf + mp->len, (uint32_t)(HTTP_MULTIPART_BUFFER_SIZE - mp->len));
+            if (ret < 0)
+            {
+                http_multipart_error(client);
+                return;
+            }
+
+            mp->len = (uint16_t)(mp->len + ret);
+            if (!ret && client->body_state != HTTP_BODY_DONE)
+                return;
+
+            continue;
+        }
+
+        if (event < 0)
+        {
+            http_multipart_error(client);
+            return;
+        }
+
+        if (event == HTTP_MP_PART)
+            mp->part(conn, &part);
+        else if (event == HTTP_MP_SLICE)
+            mp->data(conn, slice, slice_len);
+        else
+            mp->part(conn, NULL);
+
+        /* the application may have closed the connection */
+        if (!find_client(conn))
+            return;
+    }
+}
+
+/* lets the application know the request body progressed */
+static void http_body_signal(struct http_client *client)
+{
+    if (client->multipart)
+        http_multipart_run(client);
+    else if (http_body_pending(client))
+        client->server->wakeup(EV_HTTP_BODY, client->connectionID);
+}
+
+/*
+ * Parses the complete lines available in the receive buffer.
+ * The scan for the line terminator resumes where the previous call
+ * stopped, so a header that arrives in many segments is only walked once.
+ */
+static int16_t parse_header(struct http_client *client)
+{
+    char *buf = (char *)client->rx_buf;
+    char *eol;
+    uint16_t end;
+    uint16_t len;
+
+    while (client->rx_scan < client->rx_len)
+    {
+        eol = memchr(buf + client->rx_scan, '\n', (size_t)(client->rx_len - client->rx_scan));
+        if (!eol)
+        {
+            client->rx_scan = client->rx_len;
+            len = (uint16_t)(client->rx_len - client->line_start);
+            if (client->state == HTTP_WAIT_HDR && len > HTTP_HEADER_MAX_LINE)
+            {
+                dbg("Size exceeded \n");
+                return HTTP_RETURN_ERROR;
+            }
+
+            return HTTP_RETURN_OK;
+        }
+
+        end = (uint16_t)(eol - buf);
+        len = (uint16_t)(end - client->line_start);
+        if (len > 0 && buf[end - 1] == '\r')
+            len--;
+
+        if (client->state == HTTP_WAIT_HDR)
+        {
+            if (len > HTTP_HEADER_MAX_LINE)
+            {
+                dbg("Size exceeded \n");
+                return HTTP_RETURN_ERROR;
+            }
+
+            /* empty lines in front of the request line are ignored */
+            if (len > 0)
+            {
+                if (parse_request_line(client, buf + client->line_start, len) < 0)
+                    return HTTP_RETURN_ERROR;
+
+                client->state = HTTP_WAIT_EOF_HDR;
+            }
+        }
+        else if (len == 0)
+        {
+            client->state = HTTP_EOF_HDR;
+            client->hdr_len = (uint16_t)(end + 1u);
+            client->rx_scan = client->hdr_len;
+            client->line_start = client->hdr_len;
+            return HTTP_RETURN_OK;
+        }
+        else if (parse_header_field(client, buf + client->line_start, len) < 0)
+        {
+            return HTTP_RETURN_ERROR;
+        }
+
+        client->rx_scan = (uint16_t)(end + 1u);
+        client->line_start = client->rx_scan;
+    }
+
+    return HTTP_RETURN_OK;
+}
+
+/*
+ * Fills the receive buffer from the socket and feeds the parser
+ * until the header is complete or the socket is drained.
+ * A header that does not fit in the buffer is refused.
+ */
+static int16_t read_header(struct http_client *client)
+{
+    int32_t len;
+    uint16_t space;
+
+    /* a pipelined request may already be waiting in the buffer */
+    if (parse_header(client) < 0)
+        return HTTP_RETURN_ERROR;
+
+    while (client->state == HTTP_WAIT_HDR || client->state == HTTP_WAIT_EOF_HDR)
+    {
+        space = (uint16_t)(client->rx_size - client->rx_len);
+        if (!space)
+        {
+            dbg("Header too large\n");
+            return HTTP_RETURN_ERROR;
+        }
+
+        len = pico_socket_read(client->sck, client->rx_buf + client->rx_len, space);
+        if (len < 0)
+            return HTTP_RETURN_ERROR;
+
+        if (len == 0)
+            break;
+
+        client->rx_len = (uint16_t)(client->rx_len + len);
+        if (parse_header(client) < 0)
+            return HTTP_RETURN_ERROR;
+    }
+
+    if (client->state == HTTP_EOF_HDR)
+    {
+        client->rx_buf[client->rx_len] = 0;
+        if (http_body_start(client) < 0)
+            return HTTP_RETURN_ERROR;
+
+        /* the start of a sized body that came with the header, terminated
+         * before a pipelined request if one follows */
+        if (client->body_state == HTTP_BODY_DATA && client->rx_len > client->hdr_len)
+        {
+            client->body = (char *)client->rx_buf + client->hdr_len;
+            if ((uint32_t)(client->rx_len - client->hdr_len) > client->body_left)
+            {
+                client->body_end = (uint16_t)(client->hdr_len + client->body_left);
+                client->body_end_byte = client->rx_buf[client->body_end];
+                client->rx_buf[client->body_end] = 0;
+            }
+        }
+
+        check_keepalive(client);
+    }
+
+    return HTTP_RETURN_OK;
+}
+/* releases the descriptor at the head of the send queue */
+static void http_send_queue_pop(struct http_client *client)
+{
+    struct http_send_desc *desc = &client->queue[client->queue_head];
+
+    if (desc->ownership == HTTP_BUFFER_COPY && client->pooled)
+        http_copy_release(client, desc->data, desc->len);
+    else if (desc->ownership == HTTP_BUFFER_SHARED)
+        http_event_release(desc->data);
+    else if (desc->ownership != HTTP_BUFFER_STATIC)
+        PICO_FREE(desc->data);
+
+    client->queue_bytes -= desc->len;
+    client->queue_head = (uint8_t)((client->queue_head + 1u) % HTTP_SEND_QUEUE_LEN);
+    client->queue_count--;
+    client->head_stage = HTTP_CHUNK_SIZE_LINE;
+    client->head_sent = 0;
+}
+
+/* drops everything still queued, used when the connection goes away */
+static void http_send_queue_flush(struct http_client *client)
+{
+    while (client->queue_count)
+        http_send_queue_pop(client);
+}
+
+/*
+ * Writes the transmit stage to the socket.
+ * Returns 0 once the stage is empty, -1 if the socket is full.
+ */
+static int8_t http_tx_flush(struct http_client *client)
+{
+    int32_t length;
+
+    while (client->tx_sent < client->tx_len)
+    {
+        length = pico_socket_write(client->sck, client->tx_buf + client->tx_sent, (int)(client->tx_len - client->tx_sent));
+        if (length <= 0)
+            return -1;
+
+        client->tx_sent = (uint16_t)(client->tx_sent + length);
+        client->tx_turn += (uint32_t)length;
+        http_rate_charge(client, (uint32_t)length);
+    }
+
+    client->tx_len = 0;
+    client->tx_sent = 0;
+    return 0;
+}
+
+/* appends to the transmit stage, the caller made sure it fits */
+static inline void http_tx_append(struct http_client *client, const void *data, uint16_t len)
+{
+    memcpy(client->tx_buf + client->tx_len, data, len);
+    client->tx_len = (uint16_t)(client->tx_len + len);
+}
+
+/*
+ * Runs the work deferred to the transmit run of a connection, one kind
+ * at a time : a new request makes a resumed body of the previous one
+ * stale. Returns 0 if the connection went away.
+ */
+static int8_t http_pending_run(struct http_client *client)
+{
+    uint16_t conn = client->connectionID;
+    uint8_t work = client->pending;
+
+    client->pending = 0;
+    if (work & HTTP_PENDING_DROP)
+    {
+        http_client_expire(client);
+        return 0;
+    }
+
+    if ((work & HTTP_PENDING_FRAMES) && client->state == HTTP_WEBSOCKET)
+        http_ws_read(client);
+    else if ((work & HTTP_PENDING_REQUEST) && client->state == HTTP_WAIT_HDR && read_data(client) == HTTP_RETURN_ERROR)
+        http_request_error(client);
+    else if ((work & HTTP_PENDING_BODY) && !(work & HTTP_PENDING_REQUEST))
+        http_body_signal(client);
+
+    return (int8_t)(find_client(conn) != NULL);
+}
+
+/*
+ * Gives a turn to the connections waiting in the run queues. The
+ * interactive class goes first; a connection that used up its quantum
+ * goes back to the end of its queue and waits for the next run, so the
+ * stack gets to run between the turns.
+ */
+static void http_tx_run(pico_time now, void *arg)
+{
+    struct http_client *client;
+    uint16_t count;
+    uint8_t prio;
+
+    tx_run_scheduled = 0;
+    for (prio = 0; prio < HTTP_PRIORITIES; prio++)
+    {
+        /* only the connections queued before this run */
+        count = 0;
+        for (client = tx_run_head[prio]; client; client = client->tx_next)
+            count++;
+
+        while (count-- && tx_run_head[prio])
+        {
+            client = tx_run_head[prio];
+            http_tx_unready(client);
+            if (client->pending && !http_pending_run(client))
+                continue;
+
+            if (client->state == HTTP_WAIT_DATA || client->state == HTTP_WAIT_STATIC_DATA ||
+                client->state == HTTP_SENDING_FINAL || client->state == HTTP_FLUSHING || client->state == HTTP_WEBSOCKET)
+                send_data(client);
+        }
+    }
+}
+
+/*
+ * Data is not written from the submitting call : everything submitted
+ * before the stack runs again is packed in as few segments as possible.
+ * The connection waits for its turn in the queue of its priority class.
+ */
+static void http_tx_schedule(struct http_client *client)
+{
+    uint8_t prio = client->priority;
+
+    if (client->tx_ready)
+        return;
+
+    client->tx_ready = 1u;
+    client->tx_next = NULL;
+    if (tx_run_tail[prio])
+        tx_run_tail[prio]->tx_next = client;
+    else
+        tx_run_head[prio] = client;
+
+    tx_run_tail[prio] = client;
+    /* a pooled connection is written at the end of the socket event or
+     * by pico_http_server_poll(), a timer would allocate */
+    if (!tx_run_scheduled && !client->pooled)
+    {
+        tx_run_scheduled = 1u;
+        if (!pico_timer_add(0, http_tx_run, NULL))
+        {
+            /* the caller may still use the connection, the queues are
+             * drained on the next socket event or tick instead */
+            dbg("No timer for the transmit run\n");
+            tx_run_scheduled = 0;
+        }
+    }
+}
+
+/* leaves work to the transmit run of the connection */
+static void http_defer(struct http_client *client, uint8_t work)
+{
+    client->pending |= work;
+    http_tx_schedule(client);
+}
+
+/* drains the run queues directly when no timer is armed for them */
+static void http_tx_recover(void)
+{
+    uint8_t prio;
+
+    for (prio = 0; prio < HTTP_PRIORITIES; prio++)
+    {
+        if (!tx_run_scheduled && tx_run_head[prio])
+        {
+            http_tx_run(PICO_TIME_MS(), NULL);
+            return;
+        }
+    }
+}
+
+/* takes a connection out of its run queue */
+static void http_tx_unready(struct http_client *client)
+{
+    struct http_client **link = &tx_run_head[client->priority];
+    struct http_client *prev = NULL;
+
+    if (!client->tx_ready)
+        return;
+
+    while (*link != client)
+    {
+        prev = *link;
+        link = &prev->tx_next;
+    }
+
+    *link = client->tx_next;
+    if (tx_run_tail[client->priority] == client)
+        tx_run_tail[client->priority] = prev;
+
+    client->tx_next = NULL;
+    client->tx_ready = 0;
+}
+
+/*
+ * API for choosing the priority class of a connection. The
+ * HTTP_PRIORITY_INTERACTIVE connections, the default, get their turn
+ * before the HTTP_PRIORITY_BULK ones, so small answers are not held
+ * back by large downloads.
+ */
+int16_t pico_http_set_priority(uint16_t conn, uint8_t priority)
+{
+    struct http_client *client = find_client(conn);
+    uint8_t ready;
+
+    if (!client || priority >= HTTP_PRIORITIES)
+    {
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
+
+    ready = client->tx_ready;
+    http_tx_unready(client);
+    client->priority = priority;
+    if (ready)
+        http_tx_schedule(client);
+
+    return HTTP_RETURN_OK;
+}
+
+/* reports the payload sent so far in this turn, 0 if the connection was closed meanwhile */
+static int8_t http_tx_progress(struct http_client *client, uint8_t *progress)
+{
+    uint16_t conn = client->connectionID;
+
+    if (!*progress)
+        return 1;
+
+    *progress = 0;
+    client->server->wakeup(EV_HTTP_PROGRESS, conn);
+    return find_client(conn) ? 1 : 0;
+}
+
+#ifdef PICO_HTTP_SERVER_DEFLATE
+/*
+ * Compresses the send queue into the room of the stage, every run of
+ * output becomes a chunk. A queued buffer is released and reported with
+ * EV_HTTP_SENT once the compressor took all of it. When the queue runs
+ * dry the output is flushed, so the client is not kept waiting for data
+ * the application already submitted; the end of the body finishes the
+ * stream and releases the compressor. Returns 0 if the connection went
+ * away from the callback.
+ */
+static int8_t http_deflate_run(struct http_client *client, uint8_t *progress)
+{
+    z_stream *zs = client->deflate;
+    struct http_send_desc *desc = NULL;
+    uint16_t conn = client->connectionID;
+    uint16_t room;
+    uint32_t consumed;
+    int flush, ret;
+
+    for (;;)
+    {
+        /* a nearly full stage goes out first */
+        room = http_tx_room(client);
+        if (!room || (client->tx_len && room < client->tx_size / 4u))
+            return 1;
+
+        zs->avail_in = 0;
+        if (client->queue_count)
+        {
+            desc = &client->queue[client->queue_head];
+            zs->next_in = desc->data + client->head_sent;
+            zs->avail_in = (uInt)(desc->len - client->head_sent);
+            flush = Z_NO_FLUSH;
+        }
+        else if (client->state == HTTP_SENDING_FINAL)
+        {
+            flush = Z_FINISH;
+        }
+        else if (client->deflate_dirty)
+        {
+            flush = Z_SYNC_FLUSH;
+        }
+        else
+        {
+            return 1;
+        }
+
+        zs->next_out = http_tx_room_data(client);
+        zs->avail_out = room;
+        ret = deflate(zs, flush);
+        if (zs->avail_out < room)
+        {
+            http_tx_commit(client, (uint16_t)(room - zs->avail_out));
+            *progress = 1u;
+        }
+
+        if (flush == Z_NO_FLUSH)
+        {
+            consumed = desc->len - client->head_sent - zs->avail_in;
+            client->head_sent += consumed;
+            if (consumed)
+                client->deflate_dirty = 1u;
+
+            if (client->head_sent == desc->len)
+            {
+                http_send_queue_pop(client);
+                if (!http_tx_progress(client, progress))
+                    return 0;
+
+                client->server->wakeup(EV_HTTP_SENT, conn);
+                if (!find_client(conn))
+                    return 0;
+            }
+        }
+        else if (ret == Z_STREAM_END)
+        {
+            http_deflate_end(client);
+            return 1;
+        }
+        else if (zs->avail_out)
+        {
+            /* all the pending output is in the stage */
+            client->deflate_dirty = 0;
+        }
+    }
+}
+#endif
+
+/*
+ * Drains the send queue for as long as the socket accepts data, for at
+ * most HTTP_TX_QUANTUM bytes; the connection then waits for its next
+ * turn. Every descriptor goes out as one chunk : size line, payload,
+ * trail. Framing and small payloads are gathered in the transmit stage
+ * and written at once, payloads bigger than the stage are written in
+ * place once the stage was flushed. EV_HTTP_PROGRESS is raised once per
+ * turn and before the EV_HTTP_SENT of a chunk.
+ */
+void send_data(struct http_client *client)
+{
+    struct http_send_desc *desc;
+    uint16_t conn = client->connectionID;
+    uint32_t room, length;
+    uint8_t progress = 0;
+    int32_t written;
+
+    client->tx_turn = 0;
+    for (;;)
+    {
+        if (http_deflating(client) && !http_deflate_run(client, &progress))
+            return;
+
+        while (client->queue_count && !http_deflating(client))
+        {
+            desc = &client->queue[client->queue_head];
+            room = (client->tx_len < client->tx_size) ? (uint32_t)(client->tx_size - client->tx_len) : 0u;
+            if (client->head_stage == HTTP_CHUNK_SIZE_LINE)
+            {
+                if (client->identity || client->state == HTTP_WEBSOCKET)
+                {
+                    /* no framing around an identity body or WebSocket frames */
+                    client->head_stage = HTTP_CHUNK_PAYLOAD;
+                    continue;
+                }
+
+                if (room < HTTP_CHUNK_LINE_MAX)
+                    break;
+
+                client->tx_len = (uint16_t)(client->tx_len + pico_itoaHex(desc->len, (char *)client->tx_buf + client->tx_len));
+                client->tx_buf[client->tx_len++] = '\r';
+                client->tx_buf[client->tx_len++] = '\n';
+                client->head_stage = HTTP_CHUNK_PAYLOAD;
+            }
+            else if (client->head_stage == HTTP_CHUNK_PAYLOAD)
+            {
+                length = desc->len - client->head_sent;
+                if (!client->tx_len && length >= client->tx_size)
+                {
+                    if (client->tx_turn >= HTTP_TX_QUANTUM)
+                    {
+                        http_tx_schedule(client);
+                        http_tx_progress(client, &progress);
+                        return;
+                    }
+
+                    /* the rest of the quantum, but not less than a segment */
+                    if (length > HTTP_TX_QUANTUM - client->tx_turn)
+                        length = (HTTP_TX_QUANTUM - client->tx_turn > client->tx_size) ?
+                                 HTTP_TX_QUANTUM - client->tx_turn : client->tx_size;
+
+                    written = pico_socket_write(client->sck, desc->data + client->head_sent, (int)length);
+                    if (written <= 0)
+                    {
+                        http_tx_progress(client, &progress);
+                        return;
+                    }
+
+                    length = (uint32_t)written;
+                    client->tx_turn += length;
+                    http_rate_charge(client, length);
+                }
+                else
+                {
+                    if (length > room)
+                        length = room;
+
+                    if (!length)
+                        break;
+
+                    memcpy(client->tx_buf + client->tx_len, desc->data + client->head_sent, length);
+                    client->tx_len = (uint16_t)(client->tx_len + length);
+                }
+
+                client->head_sent += length;
+                if (client->head_sent == desc->len)
+                    client->head_stage = HTTP_CHUNK_TRAIL;
+
+                progress = 1u;
+            }
+            else
+            {
+                /* chunk trail */
+                if (!client->identity && client->state != HTTP_WEBSOCKET)
+                {
+                    if (room < 2u)
+                        break;
+
+                    client->tx_buf[client->tx_len++] = '\r';
+                    client->tx_buf[client->tx_len++] = '\n';
+                }
+                http_send_queue_pop(client);
+                if (!http_tx_progress(client, &progress))
+                    return;
+
+                client->server->wakeup(EV_HTTP_SENT, conn);
+                /* the connection may have been closed from the callback */
+                if (!find_client(conn))
+                    return;
+            }
+        }
+
+        if (!client->queue_count && client->produce && !client->produce_wait && client->state == HTTP_WAIT_DATA)
+        {
+            if (!http_tx_produce(client))
+                return;
+        }
+
+        if (!client->queue_count && client->state == HTTP_SENDING_FINAL && !http_deflating(client))
+        {
+            if (client->identity)
+            {
+                client->state = HTTP_FLUSHING;
+            }
+            else if (client->tx_len + 5u <= client->tx_size)
+            {
+                memcpy(client->tx_buf + client->tx_len, "0\r\n\r\n", 5u);
+                client->tx_len = (uint16_t)(client->tx_len + 5u);
+                client->state = HTTP_FLUSHING;
+            }
+        }
+
+        if (!client->tx_len)
+            break;
+
+        if (client->tx_turn >= HTTP_TX_QUANTUM)
+        {
+            /* the stage goes out on the next turn */
+            http_tx_schedule(client);
+            http_tx_progress(client, &progress);
+            return;
+        }
+
+        if (http_tx_flush(client) < 0)
+        {
+            http_tx_progress(client, &progress);
+            return;
+        }
+
+        if (client->tx_wanted)
+        {
+            /* room for pico_http_reserve() again */
+            client->tx_wanted = 0;
+            client->server->wakeup(EV_HTTP_SENT, conn);
+            if (!find_client(conn))
+                return;
+        }
+    }
+
+    if (!http_tx_progress(client, &progress))
+        return;
+
+    if (client->state == HTTP_FLUSHING)
+        send_final(client);
+}
+
+/*
+ * Prepares a persistent connection for its next request. The bytes
+ * of the request just answered are dropped from the receive buffer,
+ * pipelined data behind them is kept.
+ */
+static void http_client_reset(struct http_client *client)
+{
+    uint16_t consumed = client->body_pos;
+
+    http_body_uncut(client);
+    memmove(client->rx_buf, client->rx_buf + consumed, (size_t)(client->rx_len - consumed));
+    client->rx_len = (uint16_t)(client->rx_len - consumed);
+    client->rx_buf[client->rx_len] = 0;
+    client->rx_scan = 0;
+    client->line_start = 0;
+    client->hdr_len = 0;
+    client->body_pos = 0;
+    client->body_paused = 0;
+    if (!client->pooled)
+        PICO_FREE(client->multipart);
+
+    client->multipart = NULL;
+    memset(client->headers, 0, sizeof(client->headers));
+    client->param_count = 0;
+    client->extra_len = 0;
+    client->tx_reserved = 0;
+    client->produce = NULL;
+    client->identity = 0;
+    client->etag = NULL;
+    client->last_modified = 0;
+    client->encoding = 0;
+#ifdef PICO_HTTP_SERVER_DEFLATE
+    client->compress = 0;
+#endif
+    http_deflate_end(client);
+    client->accept_ranges = 0;
+    client->auto_response = 0;
+    client->events = 0;
+    http_events_unsubscribe(client);
+    client->resource = NULL;
+    client->body = NULL;
+    client->method = 0;
+    client->keep_alive = 0;
+    client->requests++;
+    client->state = HTTP_WAIT_HDR;
+    /* a new request, pipelined or not, gets fresh deadlines */
+    http_wheel_remove(client);
+    client->timeout_kind = HTTP_TIMEOUT_NONE;
+    http_deadline_update(client, 0);
+}
+
+/* the response was written completely */
+void send_final(struct http_client *client)
+{
+    /* a body left unread is skipped if it was received completely */
+    if (client->keep_alive && client->body_state != HTTP_BODY_DONE &&
+        (client->body_state == HTTP_BODY_ERROR || http_body_read(client, NULL, 0xFFFFFFFFu) < 0 ||
+         client->body_state != HTTP_BODY_DONE))
+        client->keep_alive = 0;
+
+    if (!client->keep_alive)
+    {
+        /* the application never saw this request, so the server releases it */
+        if (client->auto_response)
+        {
+            http_client_expire(client);
+            return;
+        }
+
+        pico_socket_close(client->sck);
+        client->state = HTTP_CLOSED;
+        return;
+    }
+
+    http_client_reset(client);
+    /* the next request is parsed from the transmit run, so the application
+     * is not re-entered from inside the write path */
+    http_defer(client, HTTP_PENDING_REQUEST);
+}
+
+/* what the connection waits for, so which deadline applies */
+static uint8_t http_timeout_kind(struct http_client *client)
+{
+    if (client->state == HTTP_WAIT_HDR && !client->rx_len)
+        return HTTP_TIMEOUT_IDLE;
+
+    if (client->state == HTTP_WAIT_HDR || client->state == HTTP_WAIT_EOF_HDR)
+        return HTTP_TIMEOUT_HEADER;
+
+    if (http_body_pending(client))
+        return HTTP_TIMEOUT_BODY;
+
+    /* a closing WebSocket waits for the answer of the peer */
+    if (client->state == HTTP_WAIT_RESPONSE || (client->state == HTTP_WEBSOCKET && client->ws_closing))
+        return HTTP_TIMEOUT_RESPONSE;
+
+    if ((client->events && client->state == HTTP_WAIT_DATA) || client->state == HTTP_WEBSOCKET)
+        return HTTP_TIMEOUT_HEARTBEAT;
+
+    return HTTP_TIMEOUT_NONE;
+}
+
+static void http_wheel_remove(struct http_client *client)
+{
+    if (!client->wheel_link)
+        return;
+
+    *client->wheel_link = client->wheel_next;
+    if (client->wheel_next)
+        client->wheel_next->wheel_link = client->wheel_link;
+
+    client->wheel_next = NULL;
+    client->wheel_link = NULL;
+}
+
+/* files the connection in the slot of its deadline, relative to the current tick */
+static void http_wheel_insert(struct http_client *client)
+{
+    uint32_t delta = client->expires - wheel_now;
+    struct http_client **slot;
+
+    if (delta < HTTP_WHEEL_SLOTS)
+        slot = &wheel[0][client->expires & (HTTP_WHEEL_SLOTS - 1u)];
+    else
+        slot = &wheel[1][(client->expires >> HTTP_WHEEL_BITS) & (HTTP_WHEEL_SLOTS - 1u)];
+
+    client->wheel_next = *slot;
+    if (*slot)
+        (*slot)->wheel_link = &client->wheel_next;
+
+    client->wheel_link = slot;
+    *slot = client;
+}
+
+/* puts the connection on the wheel for the given deadline, 0 means no deadline */
+static void http_wheel_arm(struct http_client *client, uint8_t kind, uint32_t timeout_ms)
+{
+    uint32_t ticks = (timeout_ms + HTTP_SERVER_TICK_MS - 1u) / HTTP_SERVER_TICK_MS;
+
+    http_wheel_remove(client);
+    client->timeout_kind = kind;
+    if (kind == HTTP_TIMEOUT_NONE || !timeout_ms)
+        return;
+
+    if (ticks > HTTP_WHEEL_SPAN)
+        ticks = HTTP_WHEEL_SPAN;
+
+    client->expires = wheel_now + ticks;
+    http_wheel_insert(client);
+}
+
+/*
+ * Arms the deadline matching what the connection waits for. A header
+ * deadline runs from the first byte of the request and is not extended
+ * by the next ones, a body deadline restarts when the body moves and
+ * the heartbeat of an event stream or a WebSocket when something is sent.
+ */
+static void http_deadline_update(struct http_client *client, uint8_t restart)
+{
+    struct pico_http_server *srv = client->server;
+    uint8_t kind = http_timeout_kind(client);
+
+    if (kind == client->timeout_kind && !(restart && (kind == HTTP_TIMEOUT_BODY || kind == HTTP_TIMEOUT_HEARTBEAT)))
+        return;
+
+    switch (kind)
+    {
+    case HTTP_TIMEOUT_IDLE:
+        http_wheel_arm(client, kind, srv->keepalive_timeout);
+        break;
+    case HTTP_TIMEOUT_HEADER:
+        http_wheel_arm(client, kind, srv->header_timeout);
+        break;
+    case HTTP_TIMEOUT_BODY:
+        http_wheel_arm(client, kind, srv->body_timeout);
+        break;
+    case HTTP_TIMEOUT_RESPONSE:
+        http_wheel_arm(client, kind, srv->response_timeout);
+        break;
+    case HTTP_TIMEOUT_HEARTBEAT:
+        http_wheel_arm(client, kind, srv->event_heartbeat);
+        break;
+    default:
+        http_wheel_arm(client, HTTP_TIMEOUT_NONE, 0);
+        break;
+    }
+}
+
+/*
+ * Advances the wheel by one tick. Deadlines of the second level are
+ * spread on the first one when it starts a new turn. A connection whose
+ * deadline no longer matches its state is rearmed, the others expire,
+ * except the idle event streams and WebSockets which get a heartbeat.
+ */
+static void http_wheel_advance(void)
+{
+    struct http_client *client;
+    uint32_t slot;
+
+    wheel_now++;
+    slot = wheel_now & (HTTP_WHEEL_SLOTS - 1u);
+    if (!slot)
+    {
+        while ((client = wheel[1][(wheel_now >> HTTP_WHEEL_BITS) & (HTTP_WHEEL_SLOTS - 1u)]) != NULL)
+        {
+            http_wheel_remove(client);
+            http_wheel_insert(client);
+        }
+    }
+
+    /* the callbacks may release any connection, take them one at a time */
+    while ((client = wheel[0][slot]) != NULL)
+    {
+        http_wheel_remove(client);
+        if (client->timeout_kind == HTTP_TIMEOUT_HEARTBEAT && http_timeout_kind(client) == HTTP_TIMEOUT_HEARTBEAT)
+        {
+            http_heartbeat(client);
+        }
+        else if (http_timeout_kind(client) == client->timeout_kind)
+        {
+            dbg("Connection timed out\n");
+            client->timeout_kind = HTTP_TIMEOUT_NONE;
+            http_client_expire(client);
+        }
+        else
+        {
+            http_deadline_update(client, 0);
+        }
+    }
+}
+
+static void http_server_tick(pico_time now, void *arg)
+{
+    tick_running = 0;
+    if (!servers)
+        return;
+
+    http_tx_recover();
+    http_wheel_advance();
+    if (http_timers_needed())
+        http_tick_arm();
+    else
+        tick_last = PICO_TIME_MS();
+}
+
+/*
+ * Timers allocate, so they run only while a server without a connection
+ * pool listens; the others are driven by pico_http_server_poll().
+ */
+static uint8_t http_timers_needed(void)
+{
+    struct pico_http_server *srv;
+
+    for (srv = servers; srv; srv = srv->next)
+    {
+        if (!srv->pool)
+            return 1u;
+    }
+
+    return 0;
+}
+
+/*
+ * Runs the deadlines and the pending output of the pooled servers, which
+ * use no timer. The application calls it from its main loop, next to
+ * pico_stack_tick(); output submitted from the callbacks of the server
+ * is written at the end of the socket event without waiting for it.
+ */
+void pico_http_server_poll(void)
+{
+    pico_time now = PICO_TIME_MS();
+
+    http_tx_recover();
+    if (tick_running || !servers)
+    {
+        tick_last = now;
+        return;
+    }
+
+    while (now - tick_last >= HTTP_SERVER_TICK_MS && servers)
+    {
+        tick_last += HTTP_SERVER_TICK_MS;
+        http_wheel_advance();
+    }
+    http_tx_recover();
+}
+
+/* arms the next tick, the next socket event retries if no timer is left */
+static void http_tick_arm(void)
+{
+    tick_running = (uint8_t)(pico_timer_add(HTTP_SERVER_TICK_MS, http_server_tick, NULL) != 0);
+    if (!tick_running)
+        dbg("No timer for the server tick\n");
+}
+
+/*
+ * Compares a requested resource, which ends at the query string,
+ * with the path of an asset.
+ */
+static int http_asset_compare(const char *resource, const char *path)
+{
+    while (*resource && *resource != '?' && *resource == *path)
+    {
+        resource++;
+        path++;
+    }
+
+    if (*resource == '?')
+        return -(int)(uint8_t)*path;
+
+    return (int)(uint8_t)*resource - (int)(uint8_t)*path;
+}
+
+/* binary search in the asset table */
+static const struct pico_http_static_asset *http_find_asset(const struct pico_http_server *srv, const char *resource)
+{
+    int32_t low = 0, high = (int32_t)srv->asset_count - 1, mid;
+    int cmp;
+
+    while (low <= high)
+    {
+        mid = (low + high) / 2;
+        cmp = http_asset_compare(resource, srv->assets[mid].path);
+        if (!cmp)
+            return &srv->assets[mid];
+
+        if (cmp < 0)
+            high = mid - 1;
+        else
+            low = mid + 1;
+    }
+
+    return NULL;
+}
+
+/*
+ * Walks the route tree along the requested path, which is not copied.
+ * Static children are tried before the parameter child, so a failed
+ * static branch falls back to the parameter one.
+ */
+static struct http_route_node *http_route_match(struct http_client *client, struct http_route_node *node,
+                                                const char *path, uint16_t len, uint8_t count)
+{
+    struct http_route_node *child, *found;
+    uint16_t segment;
+
+    if (!len)
+    {
+        if (!node->handler[client->method - 1u])
+            return NULL;
+
+        client->param_count = count;
+        return node;
+    }
+
+    for (child = node->child; child; child = child->next)
+    {
+        if (child->label[0] != path[0])
+            continue;
+
+        if (child->label_len <= len && !memcmp(child->label, path, child->label_len))
+        {
+            found = http_route_match(client, child, path + child->label_len, (uint16_t)(len - child->label_len), count);
+            if (found)
+                return found;
+        }
+
+        break;
+    }
+
+    if (!node->param)
+        return NULL;
+
+    for (segment = 0; segment < len && path[segment] != '/'; segment++)
+        ;
+
+    if (!segment)
+        return NULL;
+
+    client->params[count].name = node->param->label + 1;
+    client->params[count].name_len = (uint8_t)(node->param->label_len - 1u);
+    client->params[count].offset = (uint16_t)(path - client->resource);
+    client->params[count].len = segment;
+    return http_route_match(client, node->param, path + segment, (uint16_t)(len - segment), (uint8_t)(count + 1u));
+}
+
+/*
+ * Hands a request to the handler of its route.
+ * Returns HTTP_RETURN_NOT_FOUND if no route matches.
+ */
+static int16_t http_route_dispatch(struct http_client *client)
+{
+    struct http_route_node *node;
+    uint16_t len;
+
+    if (!client->server->routes || !client->resource || !client->method || client->method > HTTP_ROUTE_METHODS)
+        return HTTP_RETURN_NOT_FOUND;
+
+    /* the query string is not part of the path */
+    len = (uint16_t)strcspn(client->resource, "?");
+    node = http_route_match(client, client->server->routes, client->resource, len, 0);
+    if (!node)
+    {
+        client->param_count = 0;
+        return HTTP_RETURN_NOT_FOUND;
+    }
+
+    node->handler[client->method - 1u](client->connectionID);
+    return HTTP_RETURN_OK;
+}
+
+static void http_route_free(struct http_route_node *node)
+{
+    struct http_route_node *next;
+
+    while (node)
+    {
+        next = node->next;
+        http_route_free(node->child);
+        http_route_free(node->param);
+        PICO_FREE(node);
+        node = next;
+    }
+}
+
+/*
+ * Answers a GET from the static asset table, the body is queued
+ * zero-copy. Returns HTTP_RETURN_NOT_FOUND when the resource is
+ * not in the table and the application has to handle it.
+ */
+static int16_t http_serve_asset(struct http_client *client)
+{
+    const struct pico_http_static_asset *asset;
+    const uint8_t *data;
+    uint32_t len;
+    int32_t length;
+
+    if (!client->server->asset_count || !client->resource)
+        return HTTP_RETURN_NOT_FOUND;
+
+    asset = http_find_asset(client->server, client->resource);
+    if (!asset)
+        return HTTP_RETURN_NOT_FOUND;
+
+    data = asset->data;
+    len = asset->len;
+    client->etag = asset->etag;
+    if (asset->gzip_data)
+    {
+        client->encoding = HTTP_ENCODING_VARY;
+        if (http_header_accepts(pico_http_get_header(client->connectionID, HTTP_HDR_ACCEPT_ENCODING, NULL), "gzip"))
+        {
+            /* other bytes, so another validator */
+            client->encoding |= HTTP_ENCODING_GZIP;
+            client->etag = asset->gzip_etag;
+            data = asset->gzip_data;
+            len = asset->gzip_len;
+        }
+    }
+
+    if (http_not_modified(client))
+    {
+        client->auto_response = 1u;
+        return (http_send_not_modified(client) == HTTP_RETURN_NOT_MODIFIED) ? HTTP_RETURN_OK : HTTP_RETURN_ERROR;
+    }
+
+    if (!client->etag)
+    {
+        /* a variant without its own validator is not sliced, a range
+         * could be mixed with the bytes of the other variant */
+        length = http_start_sized(client, HTTP_OK, HTTP_RESOURCE_FOUND | HTTP_STATIC_RESOURCE, asset->mimetype, len, NULL);
+        if (length >= 0 && len)
+            pico_http_submit_buffer(client->connectionID, (void *)data, len, HTTP_BUFFER_STATIC);
+    }
+    else
+    {
+        length = http_send_static(client, HTTP_RESOURCE_FOUND | HTTP_STATIC_RESOURCE, asset->mimetype, data, len);
+    }
+
+    if (length < 0)
+    {
+        /* left to the application */
+        client->etag = NULL;
+        client->encoding = 0;
+        client->accept_ranges = 0;
+        return HTTP_RETURN_NOT_FOUND;
+    }
+
+    client->auto_response = 1u;
+    return HTTP_RETURN_OK;
+}
+
+/* token buckets of the client address, a stale entry is taken over if it has none */
+static struct http_rate_bucket *http_rate_bucket(struct http_client *client)
+{
+    struct pico_http_server *srv = client->server;
+    struct http_rate_bucket *bucket, *oldest = NULL;
+    uint32_t hash = (client->peer * 2654435761u) >> 16;
+    uint8_t i, slot;
+
+    if (srv->rate[client->rate_slot].used && srv->rate[client->rate_slot].addr == client->peer)
+        return &srv->rate[client->rate_slot];
+
+    for (i = 0; i < HTTP_RATE_PROBE; i++)
+    {
+        slot = (uint8_t)((hash + i) & (HTTP_RATE_BUCKETS - 1u));
+        bucket = &srv->rate[slot];
+        if (bucket->used && bucket->addr == client->peer)
+        {
+            client->rate_slot = slot;
+            return bucket;
+        }
+
+        if (!oldest || !bucket->used || (oldest->used && bucket->last < oldest->last))
+        {
+            oldest = bucket;
+            client->rate_slot = slot;
+        }
+    }
+
+    /* a new address starts with full buckets */
+    oldest->addr = client->peer;
+    oldest->used = 1u;
+    oldest->last = PICO_TIME_MS();
+    oldest->requests = (uint32_t)srv->rate_requests * 1000u;
+    oldest->bytes = (int64_t)srv->rate_bytes * 1000;
+    return oldest;
+}
+
+/* adds the tokens earned since the last refill, the buckets hold one second */
+static void http_rate_refill(struct pico_http_server *srv, struct http_rate_bucket *bucket)
+{
+    pico_time now = PICO_TIME_MS();
+    uint32_t elapsed = (now - bucket->last > 1000u) ? 1000u : (uint32_t)(now - bucket->last);
+
+    /* thousandths, so that frequent refills of a small rate add up */
+    bucket->last = now;
+    bucket->requests += elapsed * srv->rate_requests;
+    if (bucket->requests > (uint32_t)srv->rate_requests * 1000u)
+        bucket->requests = (uint32_t)srv->rate_requests * 1000u;
+
+    bucket->bytes += (int64_t)elapsed * srv->rate_bytes;
+    if (bucket->bytes > (int64_t)srv->rate_bytes * 1000)
+        bucket->bytes = (int64_t)srv->rate_bytes * 1000;
+}
+
+/*
+ * Takes a request token of the client address, and charges the request
+ * header to its byte bucket. A client in byte debt is refused as well.
+ * Returns -1 if the request must be turned away.
+ */
+static int8_t http_rate_admit(struct http_client *client)
+{
+    struct pico_http_server *srv = client->server;
+    struct http_rate_bucket *bucket;
+
+    if (!srv->rate_requests && !srv->rate_bytes)
+        return 0;
+
+    bucket = http_rate_bucket(client);
+    http_rate_refill(srv, bucket);
+    if (srv->rate_requests && bucket->requests < 1000u)
+        return -1;
+
+    if (srv->rate_bytes && bucket->bytes <= 0)
+        return -1;
+
+    if (srv->rate_requests)
+        bucket->requests -= 1000u;
+
+    http_rate_charge(client, client->hdr_len);
+    return 0;
+}
+
+/* charges traffic of the connection to the byte bucket of its address */
+static void http_rate_charge(struct http_client *client, uint32_t bytes)
+{
+    struct http_rate_bucket *bucket;
+
+    if (!client->server->rate_bytes)
+        return;
+
+    bucket = http_rate_bucket(client);
+    bucket->bytes -= (int64_t)bytes * 1000;
+}
+
+/* appends to an event being formatted, or only counts when out is NULL */
+#define http_event_put(out, pos, src, n) \
+    do { if (out) memcpy((out) + (pos), (src), (n)); (pos) += (uint32_t)(n); } while (0)
+
+/*
+ * Writes an event in the text/event-stream format, or only measures it
+ * when out is NULL. Every line of the data gets its own "data:" field,
+ * a line ends with LF, CR or CRLF.
+ */
+static uint32_t http_event_format(uint8_t *out, const char *event, const char *id, const uint8_t *data, uint32_t len)
+{
+    uint32_t pos = 0, start = 0, i;
+
+    if (event)
+    {
+        http_event_put(out, pos, "event: ", 7u);
+        http_event_put(out, pos, event, strlen(event));
+        http_event_put(out, pos, "\n", 1u);
+    }
+
+    if (id)
+    {
+        http_event_put(out, pos, "id: ", 4u);
+        http_event_put(out, pos, id, strlen(id));
+        http_event_put(out, pos, "\n", 1u);
+    }
+
+    for (i = 0; i <= len; i++)
+    {
+        if (i < len && data[i] != '\n' && data[i] != '\r')
+            continue;
+
+        http_event_put(out, pos, "data: ", 6u);
+        http_event_put(out, pos, data + start, i - start);
+        http_event_put(out, pos, "\n", 1u);
+        if (i + 1u < len && data[i] == '\r' && data[i + 1u] == '\n')
+            i++;
+
+        start = i + 1u;
+    }
+
+    http_event_put(out, pos, "\n", 1u);
+    return pos;
+}
+
+/* field values of an event are single lines */
+static uint8_t http_event_field_valid(const char *value)
+{
+    return (uint8_t)(!value || !strpbrk(value, "\r\n"));
+}
+
+/*
+ * Answers the request with a text/event-stream response, kept open for
+ * the events sent with pico_http_send_event() or published on a channel.
+ * While no event is sent, a comment goes out every heartbeat period. The
+ * stream ends like any chunked response, with pico_http_submit_data()
+ * and a NULL buffer.
+ */
+int32_t pico_http_respond_events(uint16_t conn)
+{
+    struct http_client *client = find_client(conn);
+    int32_t length;
+
+    if (!client || client->state != HTTP_WAIT_RESPONSE)
+    {
+        dbg("Bad state for the client \n");
+        return HTTP_RETURN_ERROR;
+    }
+
+    if (pico_http_add_header(conn, "Cache-Control", "no-cache") < 0)
+        return HTTP_RETURN_ERROR;
+
+#ifdef PICO_HTTP_SERVER_DEFLATE
+    client->compress = 0;
+#endif
+    length = pico_http_respond_mimetype(conn, HTTP_RESOURCE_FOUND, "text/event-stream");
+    if (length > 0)
+    {
+        client->events = 1u;
+        http_deadline_update(client, 0);
+    }
+
+    return length;
+}
+
+/*
+ * Sends an event on a text/event-stream response. event and id are
+ * optional, the data is split in lines. Returns like
+ * pico_http_submit_buffer().
+ */
+int16_t pico_http_send_event(uint16_t conn, const char *event, const char *id, const void *data, uint32_t len)
+{
+    struct http_client *client = find_client(conn);
+    uint8_t *buf;
+    uint32_t size;
+    int16_t ret;
+
+    if (!client || !client->events || client->state != HTTP_WAIT_DATA || (!data && len) ||
+        !http_event_field_valid(event) || !http_event_field_valid(id))
+    {
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
+
+    size = http_event_format(NULL, event, id, data, len);
+    ret = http_chunk_alloc(client, size, &buf);
+    if (ret != HTTP_RETURN_OK)
+        return ret;
+
+    http_event_format(buf, event, id, data, len);
+    ret = http_chunk_submit(client, buf, size);
+    http_deadline_update(client, 1u);
+    return ret;
+}
+
+/* keeps an idle event stream or WebSocket open, then waits for the next period */
+static void http_heartbeat(struct http_client *client)
+{
+    static const char heartbeat[] = ":\n\n";
+    static const uint8_t ping[] = { 0x80u | HTTP_WS_PING, 0 };
+
+    if (!client->queue_count && client->state == HTTP_WEBSOCKET)
+        http_submit(client, (void *)ping, sizeof(ping), HTTP_BUFFER_STATIC);
+    else if (!client->queue_count)
+        http_submit(client, (void *)heartbeat, sizeof(heartbeat) - 1u, HTTP_BUFFER_STATIC);
+
+    client->timeout_kind = HTTP_TIMEOUT_NONE;
+    http_deadline_update(client, 0);
+}
+
+/*
+ * Creates a channel broadcasting events to the connections subscribed
+ * to it. The last history events are kept, for the subscribers coming
+ * back with a Last-Event-ID.
+ */
+struct pico_http_events *pico_http_events_create(uint16_t history)
+{
+    struct pico_http_events *ch;
+
+    ch = PICO_ZALLOC(sizeof(struct pico_http_events) + (uint32_t)history * sizeof(struct http_event *));
+    if (!ch)
+    {
+        pico_err = PICO_ERR_ENOMEM;
+        return NULL;
+    }
+
+    ch->history = (struct http_event **)(ch + 1);
+    ch->history_size = history;
+    return ch;
+}
+
+/* drops a reference to a published event */
+static void http_event_release(uint8_t *data)
+{
+    struct http_event *ev = (struct http_event *)(void *)(data - sizeof(struct http_event));
+
+    if (!--ev->refs)
+        PICO_FREE(ev);
+}
+
+static void http_events_unsubscribe(struct http_client *client)
+{
+    struct http_client **link;
+
+    if (!client->channel)
+        return;
+
+    for (link = &client->channel->subscribers; *link != client; link = &(*link)->channel_next)
+        ;
+
+    *link = client->channel_next;
+    client->channel = NULL;
+    client->channel_next = NULL;
+}
+
+/*
+ * Queues a serialized event on the subscribers of a channel in the given
+ * state, a subscriber that cannot take it is dropped. Returns how many
+ * subscribers took it.
+ */
+static int32_t http_events_fanout(struct pico_http_events *ch, struct http_event *ev, uint16_t state)
+{
+    struct http_client *client, *next;
+    int32_t count = 0;
+
+    for (client = ch->subscribers; client; client = next)
+    {
+        next = client->channel_next;
+        if (client->state != state || client->ws_closing)
+            continue;
+
+        if (http_submit(client, ev + 1, ev->len, HTTP_BUFFER_SHARED) < 0)
+        {
+            dbg("Subscriber too slow, dropped\n");
+            http_events_unsubscribe(client);
+            /* closed outside the publishing call */
+            http_defer(client, HTTP_PENDING_DROP);
+            continue;
+        }
+
+        ev->refs++;
+        count++;
+        http_deadline_update(client, 1u);
+    }
+
+    return count;
+}
+
+/*
+ * Subscribes a connection answered with pico_http_respond_events(), or
+ * an accepted WebSocket, to a channel. If the request came with a
+ * Last-Event-ID, the events of the history published after it are sent
+ * first, as one chunk.
+ */
+int16_t pico_http_events_subscribe(struct pico_http_events *ch, uint16_t conn)
+{
+    struct http_client *client = find_client(conn);
+    struct http_event *ev;
+    const char *value;
+    uint32_t last, size = 0;
+    uint16_t len, i;
+    uint8_t *buf;
+
+    if (!ch || !client || client->channel ||
+        (client->state != HTTP_WEBSOCKET && (!client->events || client->state != HTTP_WAIT_DATA)))
+    {
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
+
+    value = pico_http_get_header(conn, HTTP_HDR_LAST_EVENT_ID, &len);
+    if (value && http_parse_uint(value, len, &last) == 0)
+    {
+        for (i = 0; i < ch->history_count; i++)
+        {
+            ev = ch->history[(ch->history_head + i) % ch->history_size];
+            if ((int32_t)(ev->id - last) > 0)
+                size += ev->len;
+        }
+    }
+
+    if (size)
+    {
+        buf = PICO_ZALLOC(size);
+        if (!buf)
+        {
+            pico_err = PICO_ERR_ENOMEM;
+            return HTTP_RETURN_ERROR;
+        }
+
+        size = 0;
+        for (i = 0; i < ch->history_count; i++)
+        {
+            ev = ch->history[(ch->history_head + i) % ch->history_size];
+            if ((int32_t)(ev->id - last) > 0)
             {
-                int32_t length = construct_return_ok_header(retheader, HTTP_STATIC_RESOURCE, mimetype);
-                uint8_t rv = pico_socket_write(client->sck, retheader, length ); /* remove \0 */
-                PICO_FREE(retheader);
-                retheader = NULL;
-                return rv;
+                memcpy(buf + size, ev + 1, ev->len);
+                size += ev->len;
             }
         }
-        else
-        {
-            int32_t length;
-
-            length = pico_socket_write(client->sck, (const uint8_t *)return_fail_header, sizeof(return_fail_header) - 1); /* remove \0 */
-            pico_socket_close(client->sck);
-            client->state = HTTP_CLOSED;
-            return length;
 
+        if (pico_http_submit_buffer(conn, buf, size, HTTP_BUFFER_TAKE) < 0)
+        {
+            PICO_FREE(buf);
+            return HTTP_RETURN_ERROR;
         }
     }
-    else
-    {
-        dbg("Bad state for the client \n");
-        return HTTP_RETURN_ERROR;
-    }
+
+    client->channel = ch;
+    client->channel_next = ch->subscribers;
+    ch->subscribers = client;
+    return HTTP_RETURN_OK;
 }
 
 /*
- * API used to submit data to the client.
- * Server sends data only using Transfer-Encoding: chunked.
- *
- * With this function the user will submit a data chunk to
- * be sent. If it's static data the function will not allocate a buffer.
- * The function will send the chunk size in hex and the rest will
- * be sent using WR event from sockets.
- * After each transmision EV_HTTP_PROGRESS is called and at the
- * end of the chunk EV_HTTP_SENT is called.
- *
- * To let the client know this is the last chunk, the user
- * should pass a NULL buffer.
+ * Publishes an event to the event stream subscribers of a channel. The
+ * event is serialized once, with the next id of the channel, and the
+ * same buffer is queued on every subscriber. A subscriber whose send queue is full
+ * is closed : the browser reconnects and resumes from the history.
+ * Returns the number of subscribers the event was queued on.
  */
-int16_t pico_http_submit_data(uint16_t conn, void *buffer, uint16_t len)
+int32_t pico_http_events_publish(struct pico_http_events *ch, const char *event, const void *data, uint32_t len)
 {
+    struct http_event *ev;
+    char id[11];
+    uint32_t size;
+    int32_t count;
 
-    struct http_client *client = find_client(conn);
-    char chunk_str[10];
-    int16_t chunk_count;
-
-    if (!client)
+    if (!ch || (!data && len) || !http_event_field_valid(event))
     {
-        dbg("Wrong connection ID\n");
+        pico_err = PICO_ERR_EINVAL;
         return HTTP_RETURN_ERROR;
     }
 
-    if (client->state != HTTP_WAIT_DATA && client->state != HTTP_WAIT_STATIC_DATA)
+    /* 0 is skipped, so a Last-Event-ID of 0 asks for the whole history */
+    if (!++ch->last_id)
+        ch->last_id = 1u;
+
+    id[pico_itoa(ch->last_id, id)] = 0;
+    size = http_event_format(NULL, event, id, data, len);
+    ev = PICO_ZALLOC(sizeof(struct http_event) + size);
+    if (!ev)
     {
-        dbg("Client is in a different state than accepted\n");
+        pico_err = PICO_ERR_ENOMEM;
         return HTTP_RETURN_ERROR;
     }
 
-    if (client->buffer)
+    ev->refs = 1u;
+    ev->id = ch->last_id;
+    ev->len = size;
+    http_event_format((uint8_t *)(ev + 1), event, id, data, len);
+    count = http_events_fanout(ch, ev, HTTP_WAIT_DATA);
+    if (!ch->history_size)
     {
-        dbg("Already a buffer submited\n");
-        return HTTP_RETURN_ERROR;
+        http_event_release((uint8_t *)(ev + 1));
+        return count;
     }
 
-    if (!buffer)
+    if (ch->history_count == ch->history_size)
     {
-        len = 0;
+        http_event_release((uint8_t *)(ch->history[ch->history_head] + 1));
+        ch->history_head = (uint16_t)((ch->history_head + 1u) % ch->history_size);
+        ch->history_count--;
     }
 
-    if (len > 0)
-    {
-        if (client->state == HTTP_WAIT_STATIC_DATA)
-        {
-            client->buffer = buffer;
-        }
-        else
-        {
-            client->buffer = PICO_ZALLOC(len);
-            if (!client->buffer)
-            {
-                pico_err = PICO_ERR_ENOMEM;
-                return HTTP_RETURN_ERROR;
-            }
+    ch->history[(ch->history_head + ch->history_count) % ch->history_size] = ev;
+    ch->history_count++;
+    return count;
+}
 
-            /* taking over the buffer */
-            memcpy(client->buffer, buffer, len);
-        }
+/* releases a channel, its subscribers stay open */
+int16_t pico_http_events_destroy(struct pico_http_events *ch)
+{
+    if (!ch)
+    {
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
     }
-    else
-        client->buffer = NULL;
 
+    while (ch->subscribers)
+        http_events_unsubscribe(ch->subscribers);
 
-    client->buffer_size = len;
-    client->buffer_sent = 0;
+    while (ch->history_count)
+    {
+        http_event_release((uint8_t *)(ch->history[ch->history_head] + 1));
+        ch->history_head = (uint16_t)((ch->history_head + 1u) % ch->history_size);
+        ch->history_count--;
+    }
+
+    PICO_FREE(ch);
+    return HTTP_RETURN_OK;
+}
 
-    /* create the chunk size and send it */
-    if (len > 0)
+/* writes the header of an unmasked, final frame, returns its length */
+static uint8_t http_ws_header(uint8_t *out, uint8_t opcode, uint32_t len)
+{
+    out[0] = (uint8_t)(0x80u | opcode);
+    if (len < 126u)
     {
-        client->state = (client->state == HTTP_WAIT_DATA) ? HTTP_SENDING_DATA : HTTP_SENDING_STATIC_DATA;
-        chunk_count = pico_itoaHex(client->buffer_size, chunk_str);
-        chunk_str[chunk_count++] = '\r';
-        chunk_str[chunk_count++] = '\n';
-        pico_socket_write(client->sck, chunk_str, chunk_count);
+        out[1] = (uint8_t)len;
+        return 2u;
     }
-    else
+
+    if (len <= 0xFFFFu)
     {
-        send_final(client);
+        out[1] = 126u;
+        out[2] = (uint8_t)(len >> 8);
+        out[3] = (uint8_t)len;
+        return 4u;
     }
 
-    return HTTP_RETURN_OK;
+    out[1] = 127u;
+    memset(out + 2, 0, 4u);
+    out[6] = (uint8_t)(len >> 24);
+    out[7] = (uint8_t)(len >> 16);
+    out[8] = (uint8_t)(len >> 8);
+    out[9] = (uint8_t)len;
+    return 10u;
 }
 
 /*
- * When EV_HTTP_PROGRESS is triggered you can use this
- * function to check the state of the chunk.
+ * Ends an upgraded connection with a close frame, written behind what is
+ * already staged. Messages still queued are dropped. A status of 0 sends
+ * a close frame without a body.
  */
-
-int16_t pico_http_get_progress(uint16_t conn, uint16_t *sent, uint16_t *total)
+static void http_ws_end(struct http_client *client, uint16_t status)
 {
-    struct http_client *client = find_client(conn);
+    uint8_t frame[4] = { 0x80u | HTTP_WS_CLOSE, 0, (uint8_t)(status >> 8), (uint8_t)status };
 
-    if(!client)
-    {
-        dbg("Wrong connection id !\n");
-        return HTTP_RETURN_ERROR;
-    }
+    if (status)
+        frame[1] = 2u;
 
-    *sent = client->buffer_sent;
-    *total = client->buffer_size;
+    if (http_tx_flush(client) == 0)
+        pico_socket_write(client->sck, frame, 2 + frame[1]);
 
-    return HTTP_RETURN_OK;
+    http_client_expire(client);
 }
 
 /*
- * This API can be used to close either a client
- * or the server ( if you pass HTTP_SERVER_ID as a connection ID).
+ * Tells whether a peer may send a closing status, RFC 6455 7.4 : the
+ * defined codes, minus those reserved for the local side, and the ranges
+ * of libraries and applications.
  */
-int16_t pico_http_close(uint16_t conn)
+static uint8_t http_ws_status_valid(uint16_t status)
 {
-    /* close the server */
-    if (conn == HTTP_SERVER_ID)
-    {
-        if (server.state == HTTP_SERVER_LISTEN)
-        {
-            struct pico_tree_node *index, *tmp;
-            /* close the server */
-            pico_socket_close(server.sck);
-            server.sck = NULL;
+    return (uint8_t)((status >= 1000u && status <= 1003u) || (status >= 1007u && status <= 1014u) ||
+                     (status >= 3000u && status <= 4999u));
+}
 
-            /* destroy the tree */
-            pico_tree_foreach_safe(index, &pico_http_clients, tmp)
-            {
-                struct http_client *client = index->keyValue;
+/*
+ * Handles the frame at the start of the receive buffer. Frames of a
+ * client are masked, they are unmasked in place. Returns 1 once the frame
+ * was consumed, 0 if it is not complete yet, -1 if the connection went
+ * away.
+ */
+static int8_t http_ws_frame(struct http_client *client)
+{
+    uint8_t *frame = client->rx_buf;
+    uint16_t conn = client->connectionID;
+    uint32_t len, head = 2u, i;
+    uint16_t status;
+    uint8_t opcode, *data;
 
-                if (client->resource)
-                    PICO_FREE(client->resource);
+    if (client->rx_len < 2u)
+        return 0;
 
-                if (client->body)
-                    PICO_FREE(client->body);
+    opcode = frame[0] & 0x0Fu;
 
-                pico_socket_close(client->sck);
-                pico_tree_delete(&pico_http_clients, client);
-            }
+    /* extension bits without an extension, unmasked, or an unknown opcode */
+    if ((frame[0] & 0x70u) || !(frame[1] & 0x80u) || opcode > HTTP_WS_PONG ||
+        (opcode > HTTP_WS_BINARY && opcode < HTTP_WS_CLOSE) ||
+        (opcode >= HTTP_WS_CLOSE && (!(frame[0] & 0x80u) || (frame[1] & 0x7Fu) > HTTP_WS_CONTROL_MAX)))
+    {
+        dbg("Bad WebSocket frame\n");
+        http_ws_end(client, HTTP_WS_STATUS_PROTOCOL);
+        return -1;
+    }
 
-            server.state = HTTP_SERVER_CLOSED;
-            return HTTP_RETURN_OK;
-        }
-        else /* nothing to close */
-            return HTTP_RETURN_ERROR;
-    } /* close a connection in this case */
-    else
+    /* a continuation needs a message in progress, a new message waits for its end */
+    if (opcode < HTTP_WS_CLOSE && (opcode == HTTP_WS_CONTINUATION) != client->ws_fragmented)
     {
-        struct http_client *client = find_client(conn);
+        dbg("WebSocket fragments out of sequence\n");
+        http_ws_end(client, HTTP_WS_STATUS_PROTOCOL);
+        return -1;
+    }
 
-        if (!client)
-        {
-            dbg("Client not found..\n");
-            return HTTP_RETURN_ERROR;
-        }
+    len = frame[1] & 0x7Fu;
+    if (len == 126u)
+    {
+        head = 4u;
+        if (client->rx_len < head)
+            return 0;
 
-        pico_tree_delete(&pico_http_clients, client);
+        len = ((uint32_t)frame[2] << 8) | frame[3];
+    }
+    else if (len == 127u)
+    {
+        head = 10u;
+        if (client->rx_len < head)
+            return 0;
 
-        if (client->resource)
-            PICO_FREE(client->resource);
+        len = (frame[2] | frame[3] | frame[4] | frame[5]) ? 0xFFFFFFFFu :
+              ((uint32_t)frame[6] << 24) | ((uint32_t)frame[7] << 16) | ((uint32_t)frame[8] << 8) | frame[9];
+    }
 
-        if (client->state != HTTP_SENDING_STATIC_DATA && client->buffer)
-            PICO_FREE(client->buffer);
+    /* the mask */
+    head += 4u;
+    if (len > (uint32_t)client->rx_size - head)
+    {
+        dbg("WebSocket frame larger than the receive buffer\n");
+        http_ws_end(client, HTTP_WS_STATUS_TOO_BIG);
+        return -1;
+    }
 
-        if (client->body)
-            PICO_FREE(client->body);
+    if (client->rx_len < head + len)
+        return 0;
 
-        if (client->state != HTTP_CLOSED || !client->sck)
-            pico_socket_close(client->sck);
+    data = frame + head;
+    for (i = 0; i < len; i++)
+        data[i] ^= frame[head - 4u + (i & 3u)];
 
-        PICO_FREE(client);
-        return HTTP_RETURN_OK;
+    if (opcode == HTTP_WS_CLOSE && client->ws_closing)
+    {
+        /* the answer to our close frame */
+        http_client_expire(client);
+        return -1;
     }
-}
 
-static int32_t parse_request_consume_full_line(struct http_client *client, char *line)
-{
-    char c = 0;
-    uint32_t index = 0;
-    /* consume the full line */
-    while (consume_char(c) > 0) /* read char by char only the first line */
+    if (opcode == HTTP_WS_CLOSE)
     {
-        line[++index] = c;
-        if (c == '\n')
-            break;
+        /* the peer closes, a valid status is echoed */
+        status = (len < 2u) ? 0 : (uint16_t)((data[0] << 8) | data[1]);
+        if (len == 1u || (len >= 2u && !http_ws_status_valid(status)))
+            status = HTTP_WS_STATUS_PROTOCOL;
 
-        if (index >= HTTP_HEADER_MAX_LINE)
-        {
-            dbg("Size exceeded \n");
-            return HTTP_RETURN_ERROR;
-        }
+        http_ws_end(client, status);
+        return -1;
     }
-    return (int32_t)index;
-}
-
-static uint16_t parse_request_extract_function(char *line, uint8_t index, const char *method)
-{
-    uint8_t len = (uint8_t)strlen(method);
 
-    /* extract the function and the resource */
-    if (memcmp(line, method, len) || line[len] != ' ' || index < 10 || line[index] != '\n')
+    if (opcode == HTTP_WS_PING && !client->ws_closing)
     {
-        dbg("Wrong command or wrong ending\n");
-        return HTTP_RETURN_ERROR;
+        pico_http_websocket_send(conn, HTTP_WS_PONG, data, len);
+    }
+    else if (opcode < HTTP_WS_CLOSE)
+    {
+        client->ws_fragmented = (uint8_t)!(frame[0] & 0x80u);
+        client->ws_message(conn, opcode, data, len, (uint8_t)(frame[0] >> 7));
     }
 
-    return 0;
+    /* the connection may have been closed from the callback */
+    if (!find_client(conn))
+        return -1;
+
+    memmove(client->rx_buf, client->rx_buf + head + len, (size_t)(client->rx_len - head - len));
+    client->rx_len = (uint16_t)(client->rx_len - head - len);
+    return 1;
 }
 
-static int16_t parse_request_read_resource(struct http_client *client, uint32_t method_length, char *line)
+/* reads and dispatches the frames received on an upgraded connection */
+static int32_t http_ws_read(struct http_client *client)
 {
-    uint32_t index;
+    int8_t ret;
+    int32_t len;
 
-    /* start reading the resource */
-    index = (uint32_t)method_length + 1; /* go after ' ' */
-    while (line[index] != ' ')
+    for (;;)
     {
-        if (line[index] == '\n') /* no terminator ' ' */
+        while ((ret = http_ws_frame(client)) > 0)
+            ;
+
+        if (ret < 0)
+            return HTTP_RETURN_OK;
+
+        len = pico_socket_read(client->sck, client->rx_buf + client->rx_len, client->rx_size - client->rx_len);
+        if (len < 0)
         {
-            dbg("No terminator...\n");
-            return HTTP_RETURN_ERROR;
+            http_client_expire(client);
+            return HTTP_RETURN_OK;
         }
 
-        index++;
-    }
-    client->resource = PICO_ZALLOC(index - (uint32_t)method_length); /* allocate without the method in front + 1 which is \0 */
+        if (len == 0)
+            return HTTP_RETURN_OK;
 
-    if (!client->resource)
-    {
-        pico_err = PICO_ERR_ENOMEM;
-        return HTTP_RETURN_ERROR;
+        client->rx_len = (uint16_t)(client->rx_len + len);
     }
-
-    /* copy the resource */
-    memcpy(client->resource, line + method_length + 1, index - (uint32_t)method_length - 1); /* copy without the \0 which was already set by PICO_ZALLOC */
-    return 0;
 }
 
-static int32_t parse_request_get(struct http_client *client, char *line)
+/*
+ * Accepts a WebSocket upgrade request, after EV_HTTP_REQ. The key of the
+ * request is checked and answered with 101 Switching Protocols, headers
+ * added with pico_http_add_header() go with it. From then on the frame
+ * engine of the server owns the connection : every data frame received
+ * goes to message, unmasked, with its fin bit; continuation frames are
+ * passed as they come, out of sequence ones end the connection. Pings
+ * are answered by the server.
+ * Returns HTTP_RETURN_ERROR without answering when the request is not a
+ * valid upgrade, the application then responds as usual.
+ */
+int16_t pico_http_websocket_accept(uint16_t conn, void (*message)(uint16_t conn, uint8_t opcode, const uint8_t *data,
+                                                                  uint32_t len, uint8_t fin))
 {
-    int32_t ret;
+    struct http_client *client = find_client(conn);
+    const char *upgrade, *connection, *key, *version;
+    uint8_t input[HTTP_WS_KEY_LEN + sizeof(HTTP_WS_GUID) - 1u];
+    uint8_t digest[PICO_HTTP_SHA1_LEN];
+    char accept[HTTP_WS_ACCEPT_LEN + 1u];
+    uint16_t key_len = 0;
+    uint16_t consumed;
+
+    if (!client || !message || client->state != HTTP_WAIT_RESPONSE || client->method != HTTP_METHOD_GET ||
+        client->body_state != HTTP_BODY_DONE)
+    {
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
 
-    ret = parse_request_consume_full_line(client, line);
-    if (ret < 0)
-        return ret;
+    upgrade = pico_http_get_header(conn, HTTP_HDR_UPGRADE, NULL);
+    connection = pico_http_get_header(conn, HTTP_HDR_CONNECTION, NULL);
+    key = pico_http_get_header(conn, HTTP_HDR_SEC_WEBSOCKET_KEY, &key_len);
+    version = pico_http_get_header(conn, HTTP_HDR_SEC_WEBSOCKET_VERSION, NULL);
+    /* the key is 16 random bytes in base64 */
+    if (!http_header_has_token(upgrade, "websocket") || !http_header_has_token(connection, "upgrade") ||
+        key_len != HTTP_WS_KEY_LEN || key[HTTP_WS_KEY_LEN - 2u] != '=' || key[HTTP_WS_KEY_LEN - 1u] != '=' ||
+        !version || strcmp(version, "13") != 0)
+    {
+        dbg("Not a WebSocket upgrade\n");
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
 
-    ret = parse_request_extract_function(line, ret, "GET");
-    if (ret)
-        return ret;
+    if (http_fragment_len(http_hdr_switching) + HTTP_WS_ACCEPT_LEN + 4u + client->extra_len >
+        (uint32_t)(client->tx_cap - client->tx_len))
+    {
+        dbg("Response header too long\n");
+        return HTTP_RETURN_ERROR;
+    }
 
-    ret = parse_request_read_resource(client, strlen("GET"), line);
-    if (ret)
-        return ret;
+    memcpy(input, key, HTTP_WS_KEY_LEN);
+    memcpy(input + HTTP_WS_KEY_LEN, HTTP_WS_GUID, sizeof(HTTP_WS_GUID) - 1u);
+    pico_http_sha1(input, sizeof(input), digest);
+    pico_http_base64(digest, PICO_HTTP_SHA1_LEN, accept);
+    http_tx_append(client, http_hdr_switching, http_fragment_len(http_hdr_switching));
+    http_tx_append(client, accept, HTTP_WS_ACCEPT_LEN);
+    http_tx_append(client, "\r\n", 2u);
+    if (client->extra_len)
+        http_tx_append(client, client->extra_hdr, client->extra_len);
+    http_tx_append(client, "\r\n", 2u);
+    client->extra_len = 0;
+
+    /* the request is done with, frames may already follow it */
+    consumed = client->body_pos;
+    http_body_uncut(client);
+    memmove(client->rx_buf, client->rx_buf + consumed, (size_t)(client->rx_len - consumed));
+    client->rx_len = (uint16_t)(client->rx_len - consumed);
+    client->rx_scan = 0;
+    client->line_start = 0;
+    client->hdr_len = 0;
+    client->body_pos = 0;
+    memset(client->headers, 0, sizeof(client->headers));
+    client->param_count = 0;
+    client->resource = NULL;
+    client->body = NULL;
+    client->keep_alive = 0;
+    client->ws_message = message;
+    client->state = HTTP_WEBSOCKET;
+    http_deadline_update(client, 0);
+    http_tx_schedule(client);
+    /* frames that came right behind the handshake request */
+    if (client->rx_len)
+        http_defer(client, HTTP_PENDING_FRAMES);
 
-    client->state = HTTP_WAIT_EOF_HDR;
-    client->method = HTTP_METHOD_GET;
     return HTTP_RETURN_OK;
 }
 
-static int32_t parse_request_post(struct http_client *client, char *line)
+/*
+ * Sends a message on an accepted WebSocket, as a single frame : text,
+ * binary, ping or pong. Control frames carry at most 125 bytes. The data
+ * is copied. Returns like pico_http_submit_buffer().
+ */
+int16_t pico_http_websocket_send(uint16_t conn, uint8_t opcode, const void *data, uint32_t len)
 {
-    int32_t ret;
+    struct http_client *client = find_client(conn);
+    uint8_t header[HTTP_WS_HEADER_MAX];
+    uint8_t head, *frame;
+    int16_t ret;
 
-    ret = parse_request_consume_full_line(client, line);
-    if (ret < 0)
-        return ret;
+    if (!client || client->state != HTTP_WEBSOCKET || client->ws_closing || (!data && len) ||
+        (opcode != HTTP_WS_TEXT && opcode != HTTP_WS_BINARY && opcode != HTTP_WS_PING && opcode != HTTP_WS_PONG) ||
+        (opcode >= HTTP_WS_PING && len > HTTP_WS_CONTROL_MAX))
+    {
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
+    }
 
-    ret = parse_request_extract_function(line, ret, "POST");
-    if (ret)
+    head = http_ws_header(header, opcode, len);
+    ret = http_chunk_alloc(client, head + len, &frame);
+    if (ret != HTTP_RETURN_OK)
         return ret;
 
-    ret = parse_request_read_resource(client, strlen("POST"), line);
-    if (ret)
-        return ret;
+    memcpy(frame, header, head);
+    if (len)
+        memcpy(frame + head, data, len);
 
-    client->state = HTTP_WAIT_EOF_HDR;
-    client->method = HTTP_METHOD_POST;
-    return HTTP_RETURN_OK;
+    ret = http_chunk_submit(client, frame, head + len);
+    http_deadline_update(client, 1u);
+    return ret;
 }
 
-/* check the integrity of the request */
-int16_t parse_request(struct http_client *client)
+/*
+ * Starts the closing handshake of an accepted WebSocket. The close frame
+ * goes out behind the messages already queued, the connection is closed
+ * when the peer answers it, or after the response timeout. A status of
+ * 0 sends a close frame without a body.
+ */
+int16_t pico_http_websocket_close(uint16_t conn, uint16_t status)
 {
-    uint8_t c = 0;
-    char *line = (char *)PICO_ZALLOC(HTTP_HEADER_MAX_LINE);
-    if (!line)
-        {
-            pico_err = PICO_ERR_ENOMEM;
-            return HTTP_RETURN_ERROR;
-        }
+    struct http_client *client = find_client(conn);
+    uint8_t *frame;
+    int16_t ret;
 
-    /* read first line */
-    consume_char(c);
-    line[0] = c;
-    if (c == 'G')
-    { /* possible GET */
-        uint8_t rv = parse_request_get(client, line);
-        PICO_FREE(line);
-        line = NULL;
-        return rv;
-    }
-    else if (c == 'P')
-    { /* possible POST */
-        uint8_t rv = parse_request_post(client, line);
-        PICO_FREE(line);
-        line = NULL;
-        return rv;
+    if (!client || client->state != HTTP_WEBSOCKET || client->ws_closing)
+    {
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
     }
-    PICO_FREE(line);
-    line = NULL;
-    return HTTP_RETURN_ERROR;
-}
 
-int16_t read_remaining_header(struct http_client *client)
-{
-    uint8_t *line = PICO_ZALLOC(1000u);
-    if (!line)
-        {
-            pico_err = PICO_ERR_ENOMEM;
-            return HTTP_RETURN_ERROR;
-        }
-    int32_t count = 0;
-    int32_t len;
+    ret = http_chunk_alloc(client, status ? 4u : 2u, &frame);
+    if (ret != HTTP_RETURN_OK)
+        return ret;
 
-    while ((len = pico_socket_read(client->sck, line, 1000u)) > 0)
+    frame[0] = 0x80u | HTTP_WS_CLOSE;
+    frame[1] = status ? 2u : 0;
+    if (status)
     {
-        uint8_t c;
-        int32_t index = 0;
-        uint32_t body_len = 0;
-        /* parse the response */
-        while (index < len)
-        {
-            c = line[index++];
-            if (c != '\r' && c != '\n')
-                count++;
-
-            if (c == '\n')
-            {
-                if (!count)
-                {
-                    client->state = HTTP_EOF_HDR;
-                    /*dbg("End of header !\n");*/
-
-                    body_len = (uint32_t)(len - index);
-                    if (body_len > 0)
-                    {
-                        client->body = PICO_ZALLOC(body_len + 1u);
-                        if (client->body)
-                        {
-                            memcpy(client->body, line + index, body_len);
-                        }
-                        else
-                        {
-                            PICO_FREE(line);
-                            line = NULL;
-                            return HTTP_RETURN_ERROR;
-                        }
-                    }
-
-                    break;
-                }
-
-                count = 0;
-
-            }
-        }
+        frame[2] = (uint8_t)(status >> 8);
+        frame[3] = (uint8_t)status;
     }
-    PICO_FREE(line);
-    line = NULL;
-    return HTTP_RETURN_OK;
+
+    ret = http_chunk_submit(client, frame, 2u + frame[1]);
+    client->ws_closing = 1u;
+    http_deadline_update(client, 0);
+    return ret;
 }
 
-void send_data(struct http_client *client)
+/*
+ * Broadcasts a text or binary message to the WebSockets subscribed to a
+ * channel. The frame is built once and the same buffer is queued on
+ * every subscriber; messages are not kept in the history. Returns the
+ * number of subscribers the message was queued on.
+ */
+int32_t pico_http_websocket_publish(struct pico_http_events *ch, uint8_t opcode, const void *data, uint32_t len)
 {
-    uint16_t length;
-    while (client->buffer_sent < client->buffer_size &&
-           (length = (uint16_t)pico_socket_write(client->sck, (uint8_t *)client->buffer + client->buffer_sent, \
-                                                 client->buffer_size - client->buffer_sent)) > 0 )
+    struct http_event *ev;
+    uint8_t *frame;
+    int32_t count;
+
+    if (!ch || (!data && len) || (opcode != HTTP_WS_TEXT && opcode != HTTP_WS_BINARY))
     {
-        client->buffer_sent = (uint16_t)(client->buffer_sent + length);
-        server.wakeup(EV_HTTP_PROGRESS, client->connectionID);
+        pico_err = PICO_ERR_EINVAL;
+        return HTTP_RETURN_ERROR;
     }
-    if (client->buffer_sent == client->buffer_size && client->buffer_size)
-    {
-        /* send chunk trail */
-        if (pico_socket_write(client->sck, "\r\n", 2) > 0)
-        {
-            /* free the buffer */
-            if (client->state == HTTP_SENDING_DATA)
-            {
-                PICO_FREE(client->buffer);
-            }
-
-            client->buffer = NULL;
 
-            client->state = HTTP_WAIT_DATA;
-            server.wakeup(EV_HTTP_SENT, client->connectionID);
-        }
+    ev = PICO_ZALLOC(sizeof(struct http_event) + HTTP_WS_HEADER_MAX + len);
+    if (!ev)
+    {
+        pico_err = PICO_ERR_ENOMEM;
+        return HTTP_RETURN_ERROR;
     }
 
-}
+    frame = (uint8_t *)(ev + 1);
+    ev->refs = 1u;
+    ev->len = http_ws_header(frame, opcode, len);
+    if (len)
+        memcpy(frame + ev->len, data, len);
 
-void send_final(struct http_client *client)
-{
-    if (pico_socket_write(client->sck, "0\r\n\r\n", 5u) != 0)
-    {
-        pico_socket_close(client->sck);
-        client->state = HTTP_CLOSED;
-    }
-    else
-    {
-        client->state = HTTP_SENDING_FINAL;
-    }
+    ev->len += len;
+    count = http_events_fanout(ch, ev, HTTP_WEBSOCKET);
+    http_event_release(frame);
+    return count;
 }
 
 int32_t read_data(struct http_client *client)
 {
+    uint16_t conn;
+
     if (!client)
     {
         dbg("Wrong connection ID\n");
         return HTTP_RETURN_ERROR;
     }
 
-    if (client->state == HTTP_WAIT_HDR)
+    if (client->state == HTTP_WEBSOCKET)
+        return http_ws_read(client);
+
+    if (client->state == HTTP_WAIT_HDR || client->state == HTTP_WAIT_EOF_HDR)
     {
-        if (parse_request(client) < 0 || read_remaining_header(client) < 0)
-        {
+        if (read_header(client) < 0)
             return HTTP_RETURN_ERROR;
-        }
-    } /* continue with this in case the header comes line by line not a big chunk */
-    else if (client->state == HTTP_WAIT_EOF_HDR)
+    }
+    else if (client->state >= HTTP_WAIT_RESPONSE && client->state <= HTTP_SENDING_FINAL)
     {
-        if (read_remaining_header(client) < 0 )
-            return HTTP_RETURN_ERROR;
+        /* more of the request body arrived */
+        http_body_signal(client);
+
+        return HTTP_RETURN_OK;
     }
 
     if (client->state == HTTP_EOF_HDR)
     {
+        conn = client->connectionID;
         client->state = HTTP_WAIT_RESPONSE;
-        server.wakeup(EV_HTTP_REQ, client->connectionID);
+        if (http_rate_admit(client) < 0)
+        {
+            /* turned away before anything looks at the request */
+            pico_socket_write(client->sck, too_many_header, sizeof(too_many_header) - 1);
+            http_client_expire(client);
+            return HTTP_RETURN_OK;
+        }
+
+        if (client->method == HTTP_METHOD_GET && http_serve_asset(client) == HTTP_RETURN_OK)
+            return HTTP_RETURN_OK;
+
+        if (http_route_dispatch(client) == HTTP_RETURN_NOT_FOUND)
+            client->server->wakeup(EV_HTTP_REQ, conn);
+
+        /* the start of the body came with the header */
+        client = find_client(conn);
+        if (client && client->state != HTTP_WEBSOCKET && client->body_pos < client->rx_len)
+            http_body_signal(client);
     }
 
     return HTTP_RETURN_OK;
@@ -916,9 +5898,11 @@ int32_t read_data(struct http_client *client)
 
 struct http_client *find_client(uint16_t conn)
 {
-    struct http_client dummy = {
-        .connectionID = conn
-    };
+    struct http_client *client = conn_table[conn & (HTTP_CONN_SLOTS - 1u)];
+
+    /* the entry may have been reused by a later connection */
+    if (client && client->connectionID == conn)
+        return client;
 
-    return pico_tree_findKey(&pico_http_clients, &dummy);
+    return NULL;
 }
@@ -17,14 +17,128 @@
 #define HTTP_STATIC_RESOURCE        4u
 #define HTTP_CACHEABLE_RESOURCE      8u
 
+/* Ownership of a submitted buffer, see pico_http_submit_buffer() */
+#define HTTP_BUFFER_COPY            0u
+#define HTTP_BUFFER_STATIC          1u
+#define HTTP_BUFFER_TAKE            2u
+
+/* Priority classes of a connection, see pico_http_set_priority() */
+#define HTTP_PRIORITY_INTERACTIVE   0u
+#define HTTP_PRIORITY_BULK          1u
+
+/* WebSocket opcodes, see pico_http_websocket_send() */
+#define HTTP_WS_CONTINUATION        0u
+#define HTTP_WS_TEXT                1u
+#define HTTP_WS_BINARY              2u
+#define HTTP_WS_CLOSE               8u
+#define HTTP_WS_PING                9u
+#define HTTP_WS_PONG                10u
+
 /* Generic id for the server */
 #define HTTP_SERVER_ID                  0u
 
+/* Request headers indexed by the server, see pico_http_get_header() */
+#define HTTP_HDR_HOST                   0u
+#define HTTP_HDR_CONNECTION             1u
+#define HTTP_HDR_CONTENT_LENGTH         2u
+#define HTTP_HDR_CONTENT_TYPE           3u
+#define HTTP_HDR_TRANSFER_ENCODING      4u
+#define HTTP_HDR_ACCEPT_ENCODING        5u
+#define HTTP_HDR_IF_NONE_MATCH          6u
+#define HTTP_HDR_IF_MODIFIED_SINCE      7u
+#define HTTP_HDR_RANGE                  8u
+#define HTTP_HDR_IF_RANGE               9u
+#define HTTP_HDR_UPGRADE                10u
+#define HTTP_HDR_SEC_WEBSOCKET_KEY      11u
+#define HTTP_HDR_SEC_WEBSOCKET_VERSION  12u
+#define HTTP_HDR_LAST_EVENT_ID          13u
+#define HTTP_HDR_EXPECT                 14u
+#define HTTP_HDR_USER_AGENT             15u
+#define HTTP_HDR_ACCEPT                 16u
+#define HTTP_HDR_COOKIE                 17u
+#define HTTP_HDR_AUTHORIZATION          18u
+#define HTTP_HDR_ORIGIN                 19u
+#define HTTP_HDR_COUNT                  20u
+
+/*
+ * Entry of a compiled-in asset table, generated by pico_http_assets.sh
+ */
+struct pico_http_static_asset
+{
+    const char *path;           /* requested path, like "/index.html" */
+    const char *mimetype;
+    const char *etag;           /* strong validator, quoted */
+    const uint8_t *data;        /* identity content */
+    uint32_t len;
+    const uint8_t *gzip_data;   /* gzip variant, NULL if there is none */
+    uint32_t gzip_len;
+    const char *gzip_etag;      /* strong validator of the gzip variant, quoted */
+};
+
+/*
+ * Headers of a part of a multipart/form-data body, NULL when missing
+ */
+struct pico_http_part
+{
+    const char *name;           /* form field name */
+    const char *filename;       /* set for file uploads */
+    const char *content_type;
+};
+
+/*
+ * Settings of a server instance, see pico_http_server_create().
+ * Fields left to 0 take the compile time defaults.
+ */
+struct pico_http_server_config
+{
+    uint16_t port;                  /* first listener, 80 if 0 */
+    uint16_t backlog;               /* pending connections per listener */
+    uint16_t max_connections;       /* 0 for no limit */
+    uint8_t auto_accept;            /* EV_HTTP_CON reports connections the server accepted */
+    uint32_t keepalive_timeout_ms;
+    uint16_t keepalive_max_requests;
+    uint32_t send_highwater;        /* queued bytes per connection */
+    uint16_t rx_buffer_size;        /* per connection, the request header must fit */
+    uint16_t tx_buffer_size;        /* per connection, the response header must fit */
+    uint16_t pool_connections;      /* slots preallocated at creation, 0 allocates on accept */
+    uint32_t header_timeout_ms;     /* complete request header, from its first byte */
+    uint32_t body_timeout_ms;       /* gap in the request body */
+    uint32_t response_timeout_ms;   /* until the application answers */
+    uint16_t rate_requests;         /* per second and client address, 0 for no limit */
+    uint32_t rate_bytes;            /* per second and client address, 0 for no limit */
+    uint32_t event_heartbeat_ms;    /* comment on an idle text/event-stream response */
+    uint8_t deflate_window_bits;    /* 9 to 15, window of the response compression */
+    uint8_t deflate_mem_level;      /* 1 to 9, memory of the response compression */
+};
+
+struct pico_http_server;
+struct pico_http_events;
+
 /*
  * Server functions
  */
 int16_t pico_http_server_start(uint16_t port, void (*wakeup)(uint16_t ev, uint16_t conn));
 int32_t pico_http_server_accept(void);
+int16_t pico_http_server_set_keepalive(uint32_t timeout_ms, uint16_t max_requests);
+int16_t pico_http_server_set_admission(uint16_t max_connections, uint8_t auto_accept);
+int16_t pico_http_server_set_highwater(uint32_t bytes);
+int16_t pico_http_server_set_rate_limit(uint16_t requests_per_s, uint32_t bytes_per_s);
+int16_t pico_http_server_set_timeouts(uint32_t header_ms, uint32_t body_ms, uint32_t response_ms);
+int16_t pico_http_server_set_heartbeat(uint32_t heartbeat_ms);
+int16_t pico_http_server_set_assets(const struct pico_http_static_asset *assets, uint16_t count);
+int16_t pico_http_server_add_route(uint16_t method, const char *pattern, void (*handler)(uint16_t conn));
+
+/*
+ * Server instances, the calls above drive the default one
+ */
+struct pico_http_server *pico_http_server_create(const struct pico_http_server_config *config,
+                                                 void (*wakeup)(uint16_t ev, uint16_t conn));
+int16_t pico_http_server_listen(struct pico_http_server *srv, uint16_t port);
+int16_t pico_http_server_assets(struct pico_http_server *srv, const struct pico_http_static_asset *assets, uint16_t count);
+int16_t pico_http_server_route(struct pico_http_server *srv, uint16_t method, const char *pattern,
+                               void (*handler)(uint16_t conn));
+int16_t pico_http_server_destroy(struct pico_http_server *srv);
+void pico_http_server_poll(void);
 
 /*
  * Client functions
@@ -32,14 +146,48 @@ int32_t pico_http_server_accept(void);
 char *pico_http_get_resource(uint16_t conn);
 int16_t pico_http_get_method(uint16_t conn);
 char *pico_http_get_body(uint16_t conn);
-int16_t pico_http_get_progress(uint16_t conn, uint16_t *sent, uint16_t *total);
+int32_t pico_http_read_body(uint16_t conn, void *buf, uint16_t len);
+int16_t pico_http_body_complete(uint16_t conn);
+int16_t pico_http_pause_body(uint16_t conn, uint8_t pause);
+int16_t pico_http_multipart_start(uint16_t conn, void (*part)(uint16_t conn, const struct pico_http_part *part),
+                                  void (*data)(uint16_t conn, const uint8_t *data, uint16_t len));
+const char *pico_http_get_header(uint16_t conn, uint8_t header, uint16_t *len);
+const char *pico_http_get_param(uint16_t conn, const char *name, uint16_t *len);
+int16_t pico_http_get_progress(uint16_t conn, uint32_t *sent, uint32_t *total);
+int16_t pico_http_set_priority(uint16_t conn, uint8_t priority);
 
 /*
  * Handshake and data functions
  */
+int16_t pico_http_add_header(uint16_t conn, const char *name, const char *value);
+int16_t pico_http_compress(uint16_t conn);
+int16_t pico_http_set_validators(uint16_t conn, const char *etag, uint32_t last_modified);
 int32_t pico_http_respond_mimetype(uint16_t conn, uint16_t code, const char* mimetype);
 int32_t pico_http_respond(uint16_t conn, uint16_t code);
-int16_t pico_http_submit_data(uint16_t conn, void *buffer, uint16_t len);
+int32_t pico_http_respond_sized(uint16_t conn, uint16_t code, const char *mimetype, uint32_t total_len);
+int32_t pico_http_respond_static(uint16_t conn, uint16_t code, const char *mimetype, const void *data, uint32_t len);
+int16_t pico_http_submit_data(uint16_t conn, void *buffer, uint32_t len);
+int16_t pico_http_submit_buffer(uint16_t conn, void *buffer, uint32_t len, uint8_t ownership);
+uint8_t *pico_http_reserve(uint16_t conn, uint16_t *len);
+int16_t pico_http_commit(uint16_t conn, uint16_t len);
+int16_t pico_http_set_producer(uint16_t conn, int32_t (*produce)(uint16_t conn, uint8_t *buf, uint16_t len, void *arg),
+                               void *arg);
+int16_t pico_http_resume_producer(uint16_t conn);
 int16_t pico_http_close(uint16_t conn);
 
+/*
+ * Server-Sent Events and WebSockets, channels broadcast to both
+ */
+int32_t pico_http_respond_events(uint16_t conn);
+int16_t pico_http_send_event(uint16_t conn, const char *event, const char *id, const void *data, uint32_t len);
+struct pico_http_events *pico_http_events_create(uint16_t history);
+int16_t pico_http_events_subscribe(struct pico_http_events *ch, uint16_t conn);
+int32_t pico_http_events_publish(struct pico_http_events *ch, const char *event, const void *data, uint32_t len);
+int16_t pico_http_events_destroy(struct pico_http_events *ch);
+int16_t pico_http_websocket_accept(uint16_t conn, void (*message)(uint16_t conn, uint8_t opcode, const uint8_t *data,
+                                                                  uint32_t len, uint8_t fin));
+int16_t pico_http_websocket_send(uint16_t conn, uint8_t opcode, const void *data, uint32_t len);
+int16_t pico_http_websocket_close(uint16_t conn, uint16_t status);
+int32_t pico_http_websocket_publish(struct pico_http_events *ch, uint8_t opcode, const void *data, uint32_t len);
+
 #endif /* PICO_HTTP_SERVER_H_ */
@@ -61,7 +61,7 @@ struct pico_mime_map supported_mime_types[] = {
     {".ttf", "application/x-font-ttf"}
 };
 
-int pico_itoaHex(uint16_t port, char *ptr)
+int pico_itoaHex(uint32_t port, char *ptr)
 {
     int size = 0;
     int index;
@@ -162,3 +162,238 @@ const char* pico_http_get_mimetype(char* resourcename)
     }
     return NULL;
 }
+
+static const char http_weekdays[7][4] = {
+    "Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed"     /* 1970-01-01 was a Thursday */
+};
+
+static const char http_months[12][4] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+static void http_put_digits(char *ptr, uint32_t value, int digits)
+{
+    while (digits--)
+    {
+        ptr[digits] = (char)('0' + value % 10u);
+        value /= 10u;
+    }
+}
+
+static int32_t http_get_digits(const char *ptr, int digits)
+{
+    int32_t value = 0;
+
+    while (digits--)
+    {
+        if (*ptr < '0' || *ptr > '9')
+            return -1;
+
+        value = value * 10 + (*ptr++ - '0');
+    }
+    return value;
+}
+
+/*
+    Formats a time in seconds since the epoch as an HTTP date (IMF-fixdate), like
+    "Sun, 06 Nov 1994 08:49:37 GMT". The buffer must hold PICO_HTTP_DATE_LEN + 1 bytes.
+    Returns the length of the date.
+*/
+int pico_http_format_date(uint32_t time, char *ptr)
+{
+    uint32_t days = time / 86400u;
+    uint32_t secs = time % 86400u;
+    uint32_t doe, yoe, doy, mp, year, month, day;
+
+    /* civil date from the day count, eras of 400 years starting on March 1st */
+    days += 719468u;
+    doe = days % 146097u;
+    yoe = (doe - doe / 1460u + doe / 36524u - doe / 146096u) / 365u;
+    year = yoe + (days / 146097u) * 400u;
+    doy = doe - (365u * yoe + yoe / 4u - yoe / 100u);
+    mp = (5u * doy + 2u) / 153u;
+    day = doy - (153u * mp + 2u) / 5u + 1u;
+    month = (mp < 10u) ? mp + 3u : mp - 9u;
+    if (month <= 2u)
+        year++;
+
+    memcpy(ptr, http_weekdays[(time / 86400u) % 7u], 3);
+    memcpy(ptr + 3, ", ", 2);
+    http_put_digits(ptr + 5, day, 2);
+    ptr[7] = ' ';
+    memcpy(ptr + 8, http_months[month - 1u], 3);
+    ptr[11] = ' ';
+    http_put_digits(ptr + 12, year, 4);
+    ptr[16] = ' ';
+    http_put_digits(ptr + 17, secs / 3600u, 2);
+    ptr[19] = ':';
+    http_put_digits(ptr + 20, (secs / 60u) % 60u, 2);
+    ptr[22] = ':';
+    http_put_digits(ptr + 23, secs % 60u, 2);
+    memcpy(ptr + 25, " GMT", 4);
+    ptr[PICO_HTTP_DATE_LEN] = '\0';
+    return PICO_HTTP_DATE_LEN;
+}
+
+/*
+    Parses an HTTP date in the IMF-fixdate format, the one every current client sends.
+    Returns the time in seconds since the epoch, 0 if the date can not be parsed.
+*/
+uint32_t pico_http_parse_date(const char *ptr)
+{
+    int32_t day, year, hour, minute, second, month;
+    uint32_t era, yoe, doy, doe;
+
+    if (!ptr || strlen(ptr) < PICO_HTTP_DATE_LEN || ptr[3] != ',' || memcmp(ptr + 25, " GMT", 4) != 0)
+        return 0;
+
+    for (month = 0; month < 12; month++)
+    {
+        if (memcmp(ptr + 8, http_months[month], 3) == 0)
+            break;
+    }
+
+    day = http_get_digits(ptr + 5, 2);
+    year = http_get_digits(ptr + 12, 4);
+    hour = http_get_digits(ptr + 17, 2);
+    minute = http_get_digits(ptr + 20, 2);
+    second = http_get_digits(ptr + 23, 2);
+    if (month == 12 || day < 1 || day > 31 || year < 1970 || year > 2105 ||
+        hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 60)
+        return 0;
+
+    /* day count from the civil date, years starting on March 1st */
+    month++;
+    if (month <= 2)
+        year--;
+
+    era = (uint32_t)year / 400u;
+    yoe = (uint32_t)year - era * 400u;
+    doy = (153u * (uint32_t)(month > 2 ? month - 3 : month + 9) + 2u) / 5u + (uint32_t)day - 1u;
+    doe = yoe * 365u + yoe / 4u - yoe / 100u + doy;
+
+    return (era * 146097u + doe - 719468u) * 86400u + (uint32_t)(hour * 3600 + minute * 60 + second);
+}
+
+static uint32_t http_sha1_rol(uint32_t value, int bits)
+{
+    return (value << bits) | (value >> (32 - bits));
+}
+
+/* one 64 byte block of SHA-1 */
+static void http_sha1_block(uint32_t *h, const uint8_t *block)
+{
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[4 * i + 1] << 16) |
+               ((uint32_t)block[4 * i + 2] << 8) | (uint32_t)block[4 * i + 3];
+    for (i = 16; i < 80; i++)
+        w[i] = http_sha1_rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    a = h[0];
+    b = h[1];
+    c = h[2];
+    d = h[3];
+    e = h[4];
+    for (i = 0; i < 80; i++)
+    {
+        if (i < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999u;
+        }
+        else if (i < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1u;
+        }
+        else if (i < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDCu;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6u;
+        }
+
+        t = http_sha1_rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = http_sha1_rol(b, 30);
+        b = a;
+        a = t;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+/*
+    SHA-1 digest of a buffer, PICO_HTTP_SHA1_LEN bytes are written to digest.
+    Only meant for the WebSocket handshake, SHA-1 is not a secure hash anymore.
+*/
+void pico_http_sha1(const uint8_t *data, uint32_t len, uint8_t *digest)
+{
+    uint32_t h[5] = {
+        0x67452301u, 0xEFCDAB89u, 0x98BADCFEu, 0x10325476u, 0xC3D2E1F0u
+    };
+    uint8_t block[64];
+    uint64_t bits = (uint64_t)len * 8u;
+    uint32_t left = len;
+    int i;
+
+    for (; left >= 64u; left -= 64u, data += 64)
+        http_sha1_block(h, data);
+
+    /* the rest, 0x80, zeroes and the length in bits, in one or two blocks */
+    memcpy(block, data, left);
+    block[left++] = 0x80;
+    if (left > 56u)
+    {
+        memset(block + left, 0, 64u - left);
+        http_sha1_block(h, block);
+        left = 0;
+    }
+
+    memset(block + left, 0, 56u - left);
+    for (i = 0; i < 8; i++)
+        block[56 + i] = (uint8_t)(bits >> (56 - 8 * i));
+    http_sha1_block(h, block);
+
+    for (i = 0; i < 20; i++)
+        digest[i] = (uint8_t)(h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+/*
+    Base64 of a buffer, with padding. dst must hold 4 * ((len + 2) / 3) + 1 bytes.
+    Returns the length written, without the terminating NUL.
+*/
+uint32_t pico_http_base64(const uint8_t *src, uint32_t len, char *dst)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint32_t i, out = 0, v;
+
+    for (i = 0; i < len; i += 3u)
+    {
+        v = (uint32_t)src[i] << 16;
+        if (i + 1u < len)
+            v |= (uint32_t)src[i + 1u] << 8;
+        if (i + 2u < len)
+            v |= src[i + 2u];
+
+        dst[out++] = alphabet[(v >> 18) & 0x3Fu];
+        dst[out++] = alphabet[(v >> 12) & 0x3Fu];
+        dst[out++] = (i + 1u < len) ? alphabet[(v >> 6) & 0x3Fu] : '=';
+        dst[out++] = (i + 2u < len) ? alphabet[v & 0x3Fu] : '=';
+    }
+
+    dst[out] = '\0';
+    return out;
+}
@@ -86,6 +86,7 @@
 #define HTTP_RETURN_OK          0
 #define HTTP_RETURN_BUSY        1
 #define HTTP_RETURN_NOT_FOUND   2
+#define HTTP_RETURN_NOT_MODIFIED 3
 
 /* HTTP Methods */
 #define HTTP_METHOD_GET     1u
@@ -120,9 +121,19 @@ struct pico_http_uri
 };
 
 /* used for chunks */
-int pico_itoaHex(uint16_t port, char *ptr);
+int pico_itoaHex(uint32_t port, char *ptr);
 uint32_t pico_itoa(uint32_t port, char *ptr);
 void pico_http_url_decode(char *dst, const char *src);
 const char* pico_http_get_mimetype(char* resourcename);
 
+/* HTTP dates, like "Sun, 06 Nov 1994 08:49:37 GMT" */
+#define PICO_HTTP_DATE_LEN  29
+int pico_http_format_date(uint32_t time, char *ptr);
+uint32_t pico_http_parse_date(const char *ptr);
+
+/* used for the WebSocket handshake */
+#define PICO_HTTP_SHA1_LEN  20
+void pico_http_sha1(const uint8_t *data, uint32_t len, uint8_t *digest);
+uint32_t pico_http_base64(const uint8_t *src, uint32_t len, char *dst);
+
 #endif /* PICO_HTTP_UTIL_H_ */
@@ -0,0 +1,2454 @@
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "pico_stack.h"
+#include "pico_http_server.h"
+#include "pico_tcp.h"
+#include "pico_tree.h"
+#include "pico_socket.h"
+
+#include "pico_http_server.c"
+#include "check.h"
+
+volatile pico_err_t pico_err;
+
+#define RED     0
+#define BLACK 1
+/* By default the null leafs are black */
+struct pico_tree_node LEAF = {
+    NULL, /* key */
+    &LEAF, &LEAF, &LEAF, /* parent, left,right */
+    BLACK, /* color */
+};
+
+/* MOCKS */
+static struct pico_socket listen_socket;
+static struct pico_socket example_socket;
+static struct pico_socket other_listen[2];
+static struct pico_socket other_socket;
+static struct pico_socket *accept_socket = &example_socket;
+static int sockets_opened = 0;
+static struct pico_socket *last_closed = NULL;
+static int pending_conns = -1;  /* connections waiting on a listener, -1 is unlimited */
+static uint32_t accept_addr = 0x0100000A;
+static char rx_wire[4096];
+static uint32_t rx_wire_len = 0;
+static uint32_t rx_wire_read = 0;
+static char tx_wire[8192];
+static uint32_t tx_wire_len = 0;
+static int write_calls = 0;
+static int write_limit = -1;    /* bytes the socket accepts, -1 is unlimited */
+static uint16_t socket_mss = 1460;
+static int socket_closed = 0;
+static int req_ev_cnt = 0;
+static int error_ev_cnt = 0;
+static int sent_ev_cnt = 0;
+static int accept_on_con = 1;
+static uint16_t last_conn = 0;
+static int close_ev_cnt = 0;
+static int body_ev_cnt = 0;
+static int progress_ev_cnt = 0;
+
+#define MAX_TIMERS 16
+struct mock_timer {
+    pico_time expire;
+    void (*cb)(pico_time, void *);
+    void *arg;
+};
+static struct mock_timer timers[MAX_TIMERS];
+static int n_timers = 0;
+static int timers_fail = 0;     /* timer allocations left to fail */
+
+/* runs the timers pending now that expire within the given time,
+ * timers added by the callbacks wait for the next call */
+static void timers_fire(pico_time within)
+{
+    struct mock_timer due[MAX_TIMERS];
+    int i, n = 0;
+    for (i = 0; i < n_timers; i++)
+    {
+        if (timers[i].cb && timers[i].expire <= within)
+        {
+            due[n++] = timers[i];
+            timers[i].cb = NULL;
+        }
+    }
+    for (i = 0; i < n; i++)
+        due[i].cb(PICO_TIME_MS(), due[i].arg);
+}
+
+static int timers_armed(void)
+{
+    int i, n = 0;
+    for (i = 0; i < n_timers; i++)
+        n += timers[i].cb != NULL;
+    return n;
+}
+
+static void wire_reset(void)
+{
+    rx_wire_len = 0;
+    rx_wire_read = 0;
+    tx_wire_len = 0;
+    write_calls = 0;
+    write_limit = -1;
+    socket_closed = 0;
+    req_ev_cnt = 0;
+    error_ev_cnt = 0;
+    sent_ev_cnt = 0;
+    close_ev_cnt = 0;
+    body_ev_cnt = 0;
+    memset(tx_wire, 0, sizeof(tx_wire));
+}
+
+/* queue bytes as if a new segment arrived from the peer, then raise RD */
+static void wire_feed(const char *data)
+{
+    uint32_t len = (uint32_t)strlen(data);
+    memcpy(rx_wire + rx_wire_len, data, len);
+    rx_wire_len += len;
+    http_server_cbk(PICO_SOCK_EV_RD, &example_socket);
+}
+
+void cb(uint16_t ev, uint16_t conn)
+{
+    if (ev & EV_HTTP_CON)
+    {
+        if (accept_on_con)
+            last_conn = (uint16_t)pico_http_server_accept();
+    }
+    if (ev & EV_HTTP_REQ)
+    {
+        req_ev_cnt++;
+        last_conn = conn;
+    }
+    if (ev & EV_HTTP_ERROR)
+        error_ev_cnt++;
+    if (ev & EV_HTTP_SENT)
+        sent_ev_cnt++;
+    if (ev & EV_HTTP_CLOSE)
+        close_ev_cnt++;
+    if (ev & EV_HTTP_BODY)
+        body_ev_cnt++;
+    if (ev & EV_HTTP_PROGRESS)
+        progress_ev_cnt++;
+}
+
+uint32_t pico_timer_add(pico_time expire, void (*timer)(pico_time, void *), void *arg)
+{
+    int i;
+    if (timers_fail)
+    {
+        timers_fail--;
+        return 0;
+    }
+    for (i = 0; i < n_timers && timers[i].cb; i++)
+        ;
+    fail_if(i >= MAX_TIMERS);
+    timers[i].expire = expire;
+    timers[i].cb = timer;
+    timers[i].arg = arg;
+    if (i == n_timers)
+        n_timers++;
+    return (uint32_t)i + 1u;
+}
+
+uint16_t pico_tcp_get_socket_mss(struct pico_socket *s)
+{
+    return socket_mss;
+}
+
+uint32_t pico_rand(void)
+{
+    static uint32_t r = 0x1234;
+    return r++;
+}
+
+struct pico_socket *pico_socket_open(uint16_t net, uint16_t proto, void (*wakeup)(uint16_t ev, struct pico_socket *s))
+{
+    /* the default server gets listen_socket, the others other_listen */
+    struct pico_socket *s = sockets_opened ? &other_listen[(sockets_opened - 1) % 2] : &listen_socket;
+    sockets_opened++;
+    s->wakeup = wakeup;
+    return s;
+}
+
+int pico_socket_bind(struct pico_socket *s, void *local_addr, uint16_t *port)
+{
+    return 0;
+}
+
+int pico_socket_listen(struct pico_socket *s, const int backlog)
+{
+    return 0;
+}
+
+struct pico_socket *pico_socket_accept(struct pico_socket *s, void *orig, uint16_t *port)
+{
+    fail_if(s != &listen_socket && s != &other_listen[0] && s != &other_listen[1]);
+    if (pending_conns == 0)
+        return NULL;
+    if (pending_conns > 0)
+        pending_conns--;
+    ((struct pico_ip4 *)orig)->addr = accept_addr;
+    return accept_socket;
+}
+
+int pico_socket_close(struct pico_socket *s)
+{
+    socket_closed++;
+    last_closed = s;
+    return 0;
+}
+
+int pico_socket_read(struct pico_socket *s, void *buf, int len)
+{
+    uint32_t avail = rx_wire_len - rx_wire_read;
+    fail_if(s != &example_socket && s != &other_socket);
+    if ((uint32_t)len > avail)
+        len = (int)avail;
+    memcpy(buf, rx_wire + rx_wire_read, (size_t)len);
+    rx_wire_read += (uint32_t)len;
+    return len;
+}
+
+int pico_socket_write(struct pico_socket *s, const void *buf, int len)
+{
+    fail_if(buf == NULL);
+    fail_if(s != &example_socket && s != &other_socket);
+    if (write_limit >= 0 && len > write_limit)
+        len = write_limit;
+    if (write_limit > 0)
+        write_limit -= len;
+    if (!len)
+        return 0;
+    memcpy(tx_wire + tx_wire_len, buf, (size_t)len);
+    tx_wire_len += (uint32_t)len;
+    write_calls++;
+    return len;
+}
+
+/* the tree is only used as a list by the tests */
+void *pico_tree_insert(struct pico_tree *tree, void *key)
+{
+    struct pico_tree_node *node = pico_tree_findKey(tree, key) ? NULL : PICO_ZALLOC(sizeof(struct pico_tree_node));
+    if (!node)
+        return key;
+
+    node->keyValue = key;
+    node->rightChild = tree->root;
+    tree->root = node;
+    return NULL;
+}
+
+void *pico_tree_findKey(struct pico_tree *tree, void *key)
+{
+    struct pico_tree_node *node;
+    for (node = tree->root; node != &LEAF; node = node->rightChild)
+    {
+        if (tree->compare(node->keyValue, key) == 0)
+            return node->keyValue;
+    }
+    return NULL;
+}
+
+void *pico_tree_delete(struct pico_tree *tree, void *key)
+{
+    struct pico_tree_node **node = &tree->root;
+    while (*node != &LEAF)
+    {
+        if (tree->compare((*node)->keyValue, key) == 0)
+        {
+            struct pico_tree_node *del = *node;
+            *node = del->rightChild;
+            PICO_FREE(del);
+            return key;
+        }
+        node = &(*node)->rightChild;
+    }
+    return NULL;
+}
+
+struct pico_tree_node *pico_tree_firstNode(struct pico_tree_node *node)
+{
+    return node;
+}
+
+struct pico_tree_node *pico_tree_next(struct pico_tree_node *node)
+{
+    return node->rightChild;
+}
+
+static uint16_t open_connection(void)
+{
+    wire_reset();
+    if (default_server.state != HTTP_SERVER_LISTEN)
+        pico_http_server_start(0, cb);
+    http_server_cbk(PICO_SOCK_EV_CONN, &listen_socket);
+    return last_conn;
+}
+
+START_TEST(tc_parse_request_split)
+{
+    uint16_t conn = open_connection();
+    printf("\n\nStart: tc_parse_request_split\n");
+    fail_if(conn == 0);
+
+    wire_feed("GE");
+    fail_if(req_ev_cnt != 0);
+    wire_feed("T /index.html HT");
+    fail_if(req_ev_cnt != 0);
+    wire_feed("TP/1.1\r\nHost: 10.0.0.1\r");
+    fail_if(req_ev_cnt != 0);
+    wire_feed("\nAccept: */*\r\n\r");
+    fail_if(req_ev_cnt != 0);
+    wire_feed("\n");
+    fail_if(req_ev_cnt != 1);
+    fail_if(pico_http_get_method(conn) != HTTP_METHOD_GET);
+    fail_if(strcmp(pico_http_get_resource(conn), "/index.html") != 0);
+    fail_if(pico_http_get_body(conn) != NULL);
+    pico_http_close(conn);
+    printf("Stop: tc_parse_request_split\n");
+}
+END_TEST
+
+START_TEST(tc_parse_request_body)
+{
+    uint16_t conn = open_connection();
+    printf("\n\nStart: tc_parse_request_body\n");
+    wire_feed("POST /form HTTP/1.1\r\nContent-Length: 7\r\n\r\nkey=val");
+    fail_if(req_ev_cnt != 1);
+    fail_if(pico_http_get_method(conn) != HTTP_METHOD_POST);
+    fail_if(strcmp(pico_http_get_resource(conn), "/form") != 0);
+    fail_if(strcmp(pico_http_get_body(conn), "key=val") != 0);
+    pico_http_close(conn);
+    printf("Stop: tc_parse_request_body\n");
+}
+END_TEST
+
+START_TEST(tc_parse_request_errors)
+{
+    uint16_t conn;
+    char line[HTTP_HEADER_MAX_LINE + 16];
+    printf("\n\nStart: tc_parse_request_errors\n");
+
+    /* unsupported method */
+    conn = open_connection();
+    wire_feed("BREW /pot HTTP/1.1\r\n\r\n");
+    fail_if(req_ev_cnt != 0);
+    fail_if(error_ev_cnt != 1);
+    fail_if(memcmp(tx_wire, "HTTP/1.1 400", 12) != 0);
+    pico_http_close(conn);
+
+    /* missing protocol */
+    conn = open_connection();
+    wire_feed("GET /\r\n\r\n");
+    fail_if(error_ev_cnt != 1);
+    pico_http_close(conn);
+
+    /* an oversized request line is refused before its end arrives */
+    conn = open_connection();
+    memset(line, 'a', sizeof(line) - 1);
+    memcpy(line, "GET /", 5);
+    line[sizeof(line) - 1] = 0;
+    wire_feed(line);
+    fail_if(error_ev_cnt != 1);
+    pico_http_close(conn);
+    printf("Stop: tc_parse_request_errors\n");
+}
+END_TEST
+
+START_TEST(tc_request_header_index)
+{
+    uint16_t conn = open_connection();
+    uint16_t len = 0;
+    uint8_t id;
+    printf("\n\nStart: tc_request_header_index\n");
+
+    /* every known name maps to its own id */
+    for (id = 0; id < HTTP_HDR_COUNT; id++)
+        fail_if(http_header_id(http_header_names[id], (uint16_t)strlen(http_header_names[id])) != id);
+    fail_if(http_header_id("X-Forwarded-For", 15) != HTTP_HDR_NONE);
+    fail_if(http_header_id("Hosts", 5) != HTTP_HDR_NONE);
+
+    wire_feed("GET /data.json HTTP/1.1\r\nhOsT:   device.local \r\nX-Custom: 1\r\n"
+              "Accept-Encoding: gzip, deflate\r\nIf-None-Match:\"abc\"\n\r\n");
+    fail_if(req_ev_cnt != 1);
+    fail_if(strcmp(pico_http_get_header(conn, HTTP_HDR_HOST, &len), "device.local") != 0);
+    fail_if(len != 12);
+    fail_if(strcmp(pico_http_get_header(conn, HTTP_HDR_ACCEPT_ENCODING, NULL), "gzip, deflate") != 0);
+    fail_if(strcmp(pico_http_get_header(conn, HTTP_HDR_IF_NONE_MATCH, &len), "\"abc\"") != 0);
+    fail_if(len != 5);
+    fail_if(pico_http_get_header(conn, HTTP_HDR_CONTENT_LENGTH, &len) != NULL);
+    fail_if(pico_http_get_header(conn, HTTP_HDR_COUNT, &len) != NULL);
+    pico_http_close(conn);
+
+    /* a header line without a name is refused */
+    conn = open_connection();
+    wire_feed("GET / HTTP/1.1\r\n: nothing\r\n\r\n");
+    fail_if(error_ev_cnt != 1);
+    pico_http_close(conn);
+    printf("Stop: tc_request_header_index\n");
+}
+END_TEST
+
+/* answers the pending request with a single chunk */
+static void respond_hello(uint16_t conn)
+{
+    fail_if(pico_http_respond(conn, HTTP_RESOURCE_FOUND) < 0);
+    fail_if(pico_http_submit_data(conn, "hello", 5) != HTTP_RETURN_OK);
+    fail_if(pico_http_submit_data(conn, NULL, 0) != HTTP_RETURN_OK);
+    timers_fire(0);
+}
+
+START_TEST(tc_keepalive_pipelining)
+{
+    uint16_t conn = open_connection();
+    printf("\n\nStart: tc_keepalive_pipelining\n");
+
+    /* two pipelined requests in one segment */
+    wire_feed("GET /a HTTP/1.1\r\nHost: x\r\n\r\nPOST /b HTTP/1.1\r\nContent-Length: 3\r\n\r\nabcGET /c HTTP/1.1\r\n\r\n");
+    fail_if(req_ev_cnt != 1);
+    fail_if(strcmp(pico_http_get_resource(conn), "/a") != 0);
+    /* the bytes behind a bodyless request are the next request */
+    fail_if(pico_http_get_body(conn) != NULL);
+    respond_hello(conn);
+    fail_if(write_calls != 1);
+    fail_if(strstr(tx_wire, "Connection: keep-alive\r\n") == NULL);
+    fail_if(strstr(tx_wire, "0\r\n\r\n") == NULL);
+    fail_if(socket_closed != 0);
+
+    /* the next request is picked up from the buffer */
+    timers_fire(0);
+    fail_if(req_ev_cnt != 2);
+    fail_if(strcmp(pico_http_get_resource(conn), "/b") != 0);
+    /* the body stops at Content-Length, the pipelined request is kept */
+    fail_if(strcmp(pico_http_get_body(conn), "abc") != 0);
+    respond_hello(conn);
+    timers_fire(0);
+    fail_if(req_ev_cnt != 3);
+    fail_if(strcmp(pico_http_get_resource(conn), "/c") != 0);
+    fail_if(pico_http_get_body(conn) != NULL);
+    respond_hello(conn);
+    timers_fire(0);
+    fail_if(req_ev_cnt != 3);
+
+    /* without a timer, the next request is picked up on the next tick */
+    wire_feed("GET /e HTTP/1.1\r\n\r\nGET /f HTTP/1.1\r\n\r\n");
+    fail_if(req_ev_cnt != 4);
+    fail_if(pico_http_respond(conn, HTTP_RESOURCE_FOUND) < 0);
+    fail_if(pico_http_submit_data(conn, NULL, 0) != HTTP_RETURN_OK);
+    timers_fail = 1;
+    timers_fire(0);
+    fail_if(req_ev_cnt != 4 || find_client(conn)->pending != HTTP_PENDING_REQUEST);
+    timers_fire(HTTP_SERVER_TICK_MS);
+    fail_if(req_ev_cnt != 5 || strcmp(pico_http_get_resource(conn), "/f") != 0);
+    respond_hello(conn);
+    timers_fire(0);
+
+    /* a request split over segments after the reset */
+    wire_feed("GET /d HTTP/1.1\r\nConnection: close\r\n");
+    fail_if(req_ev_cnt != 5);
+    wire_feed("\r\n");
+    fail_if(req_ev_cnt != 6);
+    tx_wire_len = 0;
+    respond_hello(conn);
+    fail_if(strstr(tx_wire, "Connection: close\r\n") == NULL);
+    fail_if(socket_closed != 1);
+    pico_http_close(conn);
+    printf("Stop: tc_keepalive_pipelining\n");
+}
+END_TEST
+
+START_TEST(tc_keepalive_limits)
+{
+    uint16_t conn;
+    struct http_client *client;
+    printf("\n\nStart: tc_keepalive_limits\n");
+
+    /* HTTP/1.0 is not persistent */
+    conn = open_connection();
+    wire_feed("GET /a HTTP/1.0\r\n\r\n");
+    respond_hello(conn);
+    fail_if(socket_closed != 1);
+    pico_http_close(conn);
+
+    /* a body that is not fully buffered can not be skipped */
+    conn = open_connection();
+    wire_feed("POST /a HTTP/1.1\r\nContent-Length: 30\r\n\r\nabc");
+    respond_hello(conn);
+    fail_if(socket_closed != 1);
+    pico_http_close(conn);
+
+    /* the last allowed request closes the connection */
+    fail_if(pico_http_server_set_keepalive(1000, 0) != HTTP_RETURN_ERROR);
+    fail_if(pico_http_server_set_keepalive(1000, 2) != HTTP_RETURN_OK);
+    conn = open_connection();
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    respond_hello(conn);
+    fail_if(socket_closed != 0);
+    timers_fire(0);
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    fail_if(req_ev_cnt != 2);
+    respond_hello(conn);
+    fail_if(socket_closed != 1);
+    pico_http_close(conn);
+
+    /* idle connections are closed by the server */
+    conn = open_connection();
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    respond_hello(conn);
+    timers_fire(0);
+    client = find_client(conn);
+    fail_if(client == NULL || client->timeout_kind != HTTP_TIMEOUT_IDLE);
+    timers_fire(HTTP_SERVER_TICK_MS);
+    fail_if(socket_closed != 0);
+    timers_fire(HTTP_SERVER_TICK_MS);
+    fail_if(socket_closed != 1);
+    fail_if(close_ev_cnt != 1);
+    fail_if(find_client(conn) != NULL);
+    pico_http_server_set_keepalive(HTTP_KEEPALIVE_TIMEOUT_MS, HTTP_KEEPALIVE_MAX_REQUESTS);
+    printf("Stop: tc_keepalive_limits\n");
+}
+END_TEST
+
+START_TEST(tc_send_queue)
+{
+    uint16_t conn = open_connection();
+    char *taken;
+    uint32_t sent, total;
+    int i;
+    printf("\n\nStart: tc_send_queue\n");
+
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    fail_if(pico_http_respond(conn, HTTP_RESOURCE_FOUND) < 0);
+
+    /* chunks are queued while the socket is full */
+    write_limit = 0;
+    fail_if(pico_http_submit_data(conn, "first", 5) != HTTP_RETURN_OK);
+    taken = PICO_ZALLOC(6);
+    memcpy(taken, "second", 6);
+    fail_if(pico_http_submit_buffer(conn, taken, 6, HTTP_BUFFER_TAKE) != HTTP_RETURN_OK);
+    fail_if(pico_http_submit_buffer(conn, "third", 5, HTTP_BUFFER_STATIC) != HTTP_RETURN_OK);
+    fail_if(pico_http_get_progress(conn, &sent, &total) != HTTP_RETURN_OK);
+    fail_if(sent != 0 || total != 5);
+    fail_if(sent_ev_cnt != 0);
+    timers_fire(0);
+    fail_if(tx_wire_len != 0);
+    fail_if(sent_ev_cnt != 3);
+
+    /* partial writes resume where they stopped */
+    write_limit = 5;
+    http_server_cbk(PICO_SOCK_EV_WR, &example_socket);
+    fail_if(tx_wire_len != 5);
+    write_limit = -1;
+    http_server_cbk(PICO_SOCK_EV_WR, &example_socket);
+    fail_if(write_calls != 2);
+    fail_if(memcmp(tx_wire, "HTTP/1.1 200 OK\r\n", 17) != 0);
+    fail_if(memcmp(tx_wire + tx_wire_len - 31, "5\r\nfirst\r\n6\r\nsecond\r\n5\r\nthird\r\n", 31) != 0);
+
+    /* the high-water mark and a full queue are reported */
+    write_limit = 0;
+    fail_if(pico_http_server_set_highwater(10) != HTTP_RETURN_OK);
+    fail_if(pico_http_submit_data(conn, "12345", 5) != HTTP_RETURN_OK);
+    fail_if(pico_http_submit_data(conn, "12345", 5) != HTTP_RETURN_BUSY);
+    for (i = 2; i < HTTP_SEND_QUEUE_LEN; i++)
+        fail_if(pico_http_submit_data(conn, "1", 1) != HTTP_RETURN_BUSY);
+    fail_if(pico_http_submit_data(conn, "1", 1) != HTTP_RETURN_CONN_BUSY);
+    pico_http_server_set_highwater(HTTP_SEND_HIGH_WATER);
+
+    /* the final chunk waits for the queue to drain */
+    fail_if(pico_http_submit_data(conn, NULL, 0) != HTTP_RETURN_OK);
+    fail_if(pico_http_submit_data(conn, "late", 4) != HTTP_RETURN_ERROR);
+    tx_wire_len = 0;
+    write_calls = 0;
+    write_limit = -1;
+    timers_fire(0);
+    fail_if(write_calls != 1);
+    fail_if(memcmp(tx_wire + tx_wire_len - 5, "0\r\n\r\n", 5) != 0);
+    pico_http_close(conn);
+    printf("Stop: tc_send_queue\n");
+}
+END_TEST
+
+START_TEST(tc_write_coalescing)
+{
+    uint16_t conn;
+    static uint8_t big[2000];
+    char *payload;
+    uint32_t hdr;
+    int i;
+    printf("\n\nStart: tc_write_coalescing\n");
+
+    socket_mss = 536;
+    conn = open_connection();
+    fail_if(find_client(conn)->tx_size != 536);
+    wire_feed("GET /a HTTP/1.1\r\nConnection: close\r\n\r\n");
+    fail_if(pico_http_respond(conn, HTTP_RESOURCE_FOUND) < 0);
+    for (i = 0; i < 6; i++)
+        fail_if(pico_http_submit_data(conn, "0123456789", 10) != HTTP_RETURN_OK);
+    memset(big, 'x', sizeof(big));
+    fail_if(pico_http_submit_buffer(conn, big, sizeof(big), HTTP_BUFFER_STATIC) != HTTP_RETURN_OK);
+    fail_if(pico_http_submit_data(conn, NULL, 0) != HTTP_RETURN_OK);
+    fail_if(write_calls != 0);
+    timers_fire(0);
+
+    /* one full segment, the rest of the big payload in place, the trail */
+    fail_if(write_calls != 3);
+    hdr = (uint32_t)(strstr(tx_wire, "\r\n\r\n") + 4 - tx_wire);
+    fail_if(tx_wire_len != hdr + 6u * 15u + 5u + sizeof(big) + 2u + 5u);
+    fail_if(memcmp(tx_wire + hdr, "a\r\n0123456789\r\n", 15) != 0);
+    payload = tx_wire + hdr + 6u * 15u;
+    fail_if(memcmp(payload, "7d0\r\n", 5) != 0);
+    fail_if(memcmp(payload + 5, big, sizeof(big)) != 0);
+    fail_if(memcmp(payload + 5 + sizeof(big), "\r\n0\r\n\r\n", 7) != 0);
+    fail_if(sent_ev_cnt != 7);
+    fail_if(socket_closed != 1);
+    pico_http_close(conn);
+    socket_mss = 1460;
+    printf("Stop: tc_write_coalescing\n");
+}
+END_TEST
+
+START_TEST(tc_response_headers)
+{
+    uint16_t conn = open_connection();
+    char value[HTTP_EXTRA_HEADERS_SIZE];
+    printf("\n\nStart: tc_response_headers\n");
+
+    fail_if(pico_http_add_header(conn, "Set-Cookie", "a=1") != HTTP_RETURN_ERROR);
+    wire_feed("GET /style.css HTTP/1.1\r\n\r\n");
+    fail_if(pico_http_add_header(conn, "Set-Cookie", "a=1") != HTTP_RETURN_OK);
+    fail_if(pico_http_add_header(conn, "X-Frame-Options", "DENY") != HTTP_RETURN_OK);
+    memset(value, 'v', sizeof(value) - 1);
+    value[sizeof(value) - 1] = 0;
+    fail_if(pico_http_add_header(conn, "X-Big", value) != HTTP_RETURN_ERROR);
+    fail_if(pico_http_respond(conn, HTTP_RESOURCE_FOUND | HTTP_CACHEABLE_RESOURCE) <= 0);
+    fail_if(pico_http_add_header(conn, "X-Late", "1") != HTTP_RETURN_ERROR);
+    fail_if(pico_http_submit_data(conn, NULL, 0) != HTTP_RETURN_OK);
+    timers_fire(0);
+    fail_if(strcmp(tx_wire, "HTTP/1.1 200 OK\r\nHost: localhost\r\n"
+                   "Cache-control: public, max-age=86400\r\n"
+                   "Content-Type: text/css\r\n"
+                   "Transfer-Encoding: chunked\r\n"
+                   "Set-Cookie: a=1\r\nX-Frame-Options: DENY\r\n"
+                   "Connection: keep-alive\r\n\r\n0\r\n\r\n") != 0);
+    timers_fire(0);
+
+    /* added headers only apply to one response */
+    wire_reset();
+    wire_feed("GET /raw HTTP/1.1\r\n\r\n");
+    fail_if(req_ev_cnt != 1);
+    fail_if(pico_http_respond_mimetype(conn, HTTP_RESOURCE_FOUND, NULL) <= 0);
+    fail_if(pico_http_submit_data(conn, NULL, 0) != HTTP_RETURN_OK);
+    timers_fire(0);
+    fail_if(strcmp(tx_wire, "HTTP/1.1 200 OK\r\nHost: localhost\r\n"
+                   "Transfer-Encoding: chunked\r\n"
+                   "Connection: keep-alive\r\n\r\n0\r\n\r\n") != 0);
+    pico_http_close(conn);
+    printf("Stop: tc_response_headers\n");
+}
+END_TEST
+
+START_TEST(tc_respond_sized)
+{
+    uint16_t conn = open_connection();
+    const char *body;
+    printf("\n\nStart: tc_respond_sized\n");
+
+    wire_feed("GET /index.html HTTP/1.1\r\n\r\n");
+    fail_if(pico_http_respond_sized(conn, HTTP_RESOURCE_FOUND | HTTP_STATIC_RESOURCE, NULL, 11) <= 0);
+    fail_if(pico_http_submit_data(conn, NULL, 0) != HTTP_RETURN_ERROR);
+    fail_if(pico_http_submit_data(conn, "hello ", 6) != HTTP_RETURN_OK);
+    fail_if(pico_http_submit_data(conn, "world!", 6) != HTTP_RETURN_ERROR);
+    fail_if(pico_http_submit_data(conn, "world", 5) != HTTP_RETURN_OK);
+    fail_if(pico_http_submit_data(conn, NULL, 0) != HTTP_RETURN_OK);
+    timers_fire(0);
+    fail_if(write_calls != 1);
+    fail_if(strstr(tx_wire, "Content-Type: text/html\r\n") == NULL);
+    fail_if(strstr(tx_wire, "Content-Length: 11\r\n") == NULL);
+    fail_if(strstr(tx_wire, "Transfer-Encoding") != NULL);
+    body = strstr(tx_wire, "\r\n\r\n");
+    fail_if(body == NULL || strcmp(body + 4, "hello world") != 0);
+    fail_if(sent_ev_cnt != 2);
+    fail_if(socket_closed != 0);
+
+    /* the connection is reused right away, here for an empty body */
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /empty HTTP/1.1\r\n\r\n");
+    fail_if(req_ev_cnt != 1);
+    fail_if(pico_http_respond_sized(conn, HTTP_RESOURCE_FOUND, "text/plain", 0) <= 0);
+    timers_fire(0);
+    fail_if(strstr(tx_wire, "Content-Length: 0\r\n") == NULL);
+    fail_if(memcmp(tx_wire + tx_wire_len - 4, "\r\n\r\n", 4) != 0);
+
+    /* a chunked response follows on the same connection */
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    respond_hello(conn);
+    fail_if(strstr(tx_wire, "5\r\nhello\r\n0\r\n\r\n") == NULL);
+    pico_http_close(conn);
+    printf("Stop: tc_respond_sized\n");
+}
+END_TEST
+
+static const uint8_t asset_index[] = "<html>index</html>";
+static const uint8_t asset_index_gz[] = { 0x1f, 0x8b, 0x08, 0x00 };
+static const uint8_t asset_style[] = "body{}";
+
+/* sorted by path, like the generator does */
+static const struct pico_http_static_asset test_assets[] = {
+    { "/", "text/html", "\"0123\"", asset_index, 18, asset_index_gz, 4, "\"89ab\"" },
+    { "/index.html", "text/html", "\"0123\"", asset_index, 18, asset_index_gz, 4, NULL },
+    { "/style.css", "text/css", "\"4567\"", asset_style, 6, NULL, 0, NULL },
+};
+
+START_TEST(tc_static_assets)
+{
+    uint16_t conn = open_connection();
+    const char *body;
+    printf("\n\nStart: tc_static_assets\n");
+
+    fail_if(http_header_accepts("gzip, deflate", "gzip") != 1);
+    fail_if(http_header_accepts("deflate, GZIP;q=0.5", "gzip") != 1);
+    fail_if(http_header_accepts("gzip;q=0", "gzip") != 0);
+    fail_if(http_header_accepts("gzip; q=0.000, br", "gzip") != 0);
+    fail_if(http_header_accepts("x-gzip", "gzip") != 0);
+
+    pico_http_server_set_assets(test_assets, 3);
+
+    /* identity variant, the application is not involved */
+    wire_feed("GET /index.html?v=2 HTTP/1.1\r\n\r\n");
+    timers_fire(0);
+    fail_if(req_ev_cnt != 0);
+    fail_if(write_calls != 1);
+    fail_if(strstr(tx_wire, "Content-Type: text/html\r\n") == NULL);
+    fail_if(strstr(tx_wire, "ETag: \"0123\"\r\n") == NULL);
+    fail_if(strstr(tx_wire, "Vary: Accept-Encoding\r\n") == NULL);
+    fail_if(strstr(tx_wire, "Content-Encoding") != NULL);
+    fail_if(strstr(tx_wire, "Content-Length: 18\r\n") == NULL);
+    body = strstr(tx_wire, "\r\n\r\n");
+    fail_if(body == NULL || strcmp(body + 4, "<html>index</html>") != 0);
+
+    /* gzip variant, on the same connection */
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET / HTTP/1.1\r\nAccept-Encoding: gzip, deflate\r\n\r\n");
+    timers_fire(0);
+    fail_if(req_ev_cnt != 0);
+    fail_if(strstr(tx_wire, "Content-Encoding: gzip\r\n") == NULL);
+    fail_if(strstr(tx_wire, "Content-Length: 4\r\n") == NULL);
+    body = strstr(tx_wire, "\r\n\r\n");
+    fail_if(body == NULL || memcmp(body + 4, asset_index_gz, 4) != 0);
+    fail_if(strstr(tx_wire, "ETag: \"89ab\"\r\n") == NULL);
+    fail_if(strstr(tx_wire, "Vary: Accept-Encoding\r\n") == NULL);
+
+    /* a range validated against the identity variant gets the whole gzip one */
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET / HTTP/1.1\r\nAccept-Encoding: gzip\r\nRange: bytes=0-1\r\nIf-Range: \"0123\"\r\n\r\n");
+    timers_fire(0);
+    fail_if(strncmp(tx_wire, "HTTP/1.1 200", 12) != 0);
+    fail_if(strstr(tx_wire, "Content-Length: 4\r\n") == NULL);
+
+    /* a gzip variant without its own validator has none, and is not sliced */
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /index.html HTTP/1.1\r\nAccept-Encoding: gzip\r\nRange: bytes=0-1\r\n\r\n");
+    timers_fire(0);
+    fail_if(strncmp(tx_wire, "HTTP/1.1 200", 12) != 0);
+    fail_if(strstr(tx_wire, "ETag") != NULL || strstr(tx_wire, "Accept-Ranges") != NULL);
+    fail_if(strstr(tx_wire, "Content-Length: 4\r\n") == NULL);
+
+    /* unknown paths and other methods still reach the application */
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /style.cs HTTP/1.1\r\n\r\n");
+    fail_if(req_ev_cnt != 1);
+    respond_hello(conn);
+    timers_fire(0);
+    wire_reset();
+    wire_feed("POST /style.css HTTP/1.1\r\n\r\n");
+    fail_if(req_ev_cnt != 1);
+    respond_hello(conn);
+    timers_fire(0);
+
+    /* the server releases a closed connection it answered by itself */
+    wire_reset();
+    wire_feed("GET /style.css HTTP/1.1\r\nConnection: close\r\n\r\n");
+    timers_fire(0);
+    fail_if(strstr(tx_wire, "Vary") != NULL);
+    fail_if(socket_closed != 1);
+    fail_if(close_ev_cnt != 1);
+    fail_if(find_client(conn) != NULL);
+    pico_http_server_set_assets(NULL, 0);
+    printf("Stop: tc_static_assets\n");
+}
+END_TEST
+
+START_TEST(tc_conditional_get)
+{
+    uint16_t conn;
+    char date[PICO_HTTP_DATE_LEN + 1];
+    printf("\n\nStart: tc_conditional_get\n");
+
+    fail_if(pico_http_format_date(784111777u, date) != PICO_HTTP_DATE_LEN);
+    fail_if(strcmp(date, "Sun, 06 Nov 1994 08:49:37 GMT") != 0);
+    pico_http_format_date(0, date);
+    fail_if(strcmp(date, "Thu, 01 Jan 1970 00:00:00 GMT") != 0);
+    pico_http_format_date(951782400u, date);
+    fail_if(strcmp(date, "Tue, 29 Feb 2000 00:00:00 GMT") != 0);
+    fail_if(pico_http_parse_date("Sun, 06 Nov 1994 08:49:37 GMT") != 784111777u);
+    fail_if(pico_http_parse_date("Tue, 29 Feb 2000 00:00:00 GMT") != 951782400u);
+    fail_if(pico_http_parse_date("Sunday, 06-Nov-94 08:49:37 GMT") != 0);
+    fail_if(pico_http_parse_date("Sun, 06 Nov 1994 08:49:37 CET") != 0);
+
+    fail_if(http_etag_matches("\"a\", W/\"v1\"", "\"v1\"") != 1);
+    fail_if(http_etag_matches("\"v10\"", "\"v1\"") != 0);
+    fail_if(http_etag_matches("*", "\"v1\"") != 1);
+
+    /* matching entity tag, the server answers 304 by itself */
+    conn = open_connection();
+    wire_feed("GET /fw.bin HTTP/1.1\r\nIf-None-Match: \"v0\", \"v1\"\r\n\r\n");
+    fail_if(pico_http_set_validators(conn, "\"v1\"", 784111777u) != HTTP_RETURN_NOT_MODIFIED);
+    fail_if(pico_http_submit_data(conn, "data", 4) != HTTP_RETURN_ERROR);
+    timers_fire(0);
+    fail_if(strcmp(tx_wire, "HTTP/1.1 304 Not Modified\r\nHost: localhost\r\n"
+                   "ETag: \"v1\"\r\nLast-Modified: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+                   "Connection: keep-alive\r\n\r\n") != 0);
+
+    /* If-None-Match wins over If-Modified-Since */
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /fw.bin HTTP/1.1\r\nIf-None-Match: \"v0\"\r\nIf-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n\r\n");
+    fail_if(pico_http_set_validators(conn, "\"v1\"", 784111777u) != HTTP_RETURN_OK);
+    fail_if(pico_http_respond_sized(conn, HTTP_RESOURCE_FOUND, "application/octet-stream", 4) <= 0);
+    fail_if(pico_http_submit_data(conn, "data", 4) != HTTP_RETURN_OK);
+    timers_fire(0);
+    fail_if(strncmp(tx_wire, "HTTP/1.1 200 OK", 15) != 0);
+    fail_if(strstr(tx_wire, "ETag: \"v1\"\r\n") == NULL);
+
+    /* modification dates */
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /log HTTP/1.1\r\nIf-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n\r\n");
+    fail_if(pico_http_set_validators(conn, NULL, 784111777u) != HTTP_RETURN_NOT_MODIFIED);
+    timers_fire(0);
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /log HTTP/1.1\r\nIf-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n\r\n");
+    fail_if(pico_http_set_validators(conn, NULL, 784111778u) != HTTP_RETURN_OK);
+    respond_hello(conn);
+    fail_if(strstr(tx_wire, "Last-Modified: Sun, 06 Nov 1994 08:49:38 GMT\r\n") == NULL);
+
+    /* static assets are revalidated without the application */
+    timers_fire(0);
+    wire_reset();
+    pico_http_server_set_assets(test_assets, 3);
+    wire_feed("GET /style.css HTTP/1.1\r\nIf-None-Match: \"4567\"\r\n\r\n");
+    timers_fire(0);
+    fail_if(req_ev_cnt != 0);
+    fail_if(strncmp(tx_wire, "HTTP/1.1 304 Not Modified\r\n", 27) != 0);
+    fail_if(strstr(tx_wire, "Content-Length") != NULL);
+    pico_http_server_set_assets(NULL, 0);
+    pico_http_close(conn);
+    printf("Stop: tc_conditional_get\n");
+}
+END_TEST
+
+START_TEST(tc_byte_ranges)
+{
+    uint16_t conn = open_connection();
+    static const char data[] = "0123456789abcdefghij";
+    const char *body;
+    printf("\n\nStart: tc_byte_ranges\n");
+
+    /* no Range, the whole buffer */
+    wire_feed("GET /data.bin HTTP/1.1\r\n\r\n");
+    fail_if(pico_http_respond_static(conn, HTTP_RESOURCE_FOUND, NULL, data, 20) <= 0);
+    timers_fire(0);
+    fail_if(strncmp(tx_wire, "HTTP/1.1 200 OK", 15) != 0);
+    fail_if(strstr(tx_wire, "Accept-Ranges: bytes\r\n") == NULL);
+    fail_if(strstr(tx_wire, "Content-Length: 20\r\n") == NULL);
+
+    /* one range, sent from the buffer itself */
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /data.bin HTTP/1.1\r\nRange: bytes=5-9\r\n\r\n");
+    fail_if(pico_http_respond_static(conn, HTTP_RESOURCE_FOUND, NULL, data, 20) <= 0);
+    fail_if(pico_http_submit_data(conn, "x", 1) != HTTP_RETURN_ERROR);
+    timers_fire(0);
+    fail_if(strncmp(tx_wire, "HTTP/1.1 206 Partial Content\r\n", 30) != 0);
+    fail_if(strstr(tx_wire, "Accept-Ranges") != NULL);
+    fail_if(strstr(tx_wire, "Content-Range: bytes 5-9/20\r\n") == NULL);
+    fail_if(strstr(tx_wire, "Content-Length: 5\r\n") == NULL);
+    body = strstr(tx_wire, "\r\n\r\n");
+    fail_if(body == NULL || strcmp(body + 4, "56789") != 0);
+
+    /* suffix and open ranges, clamped to the buffer */
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /data.bin HTTP/1.1\r\nRange: bytes=-3\r\n\r\n");
+    pico_http_respond_static(conn, HTTP_RESOURCE_FOUND, NULL, data, 20);
+    timers_fire(0);
+    fail_if(strstr(tx_wire, "Content-Range: bytes 17-19/20\r\n") == NULL);
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /data.bin HTTP/1.1\r\nRange: bytes=15-100\r\n\r\n");
+    pico_http_respond_static(conn, HTTP_RESOURCE_FOUND, NULL, data, 20);
+    timers_fire(0);
+    fail_if(strstr(tx_wire, "Content-Range: bytes 15-19/20\r\n") == NULL);
+
+    /* several ranges, a multipart body of the announced length */
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /data.bin HTTP/1.1\r\nRange: bytes=0-1, 18-\r\n\r\n");
+    pico_http_respond_static(conn, HTTP_RESOURCE_FOUND, "text/plain", data, 20);
+    timers_fire(0);
+    fail_if(strstr(tx_wire, "Content-Type: multipart/byteranges; boundary=" HTTP_RANGE_BOUNDARY "\r\n") == NULL);
+    body = strstr(tx_wire, "\r\n\r\n");
+    fail_if(body == NULL);
+    fail_if(strcmp(body + 4, "\r\n--" HTTP_RANGE_BOUNDARY "\r\nContent-Type: text/plain\r\n"
+                   "Content-Range: bytes 0-1/20\r\n\r\n01"
+                   "\r\n--" HTTP_RANGE_BOUNDARY "\r\nContent-Type: text/plain\r\n"
+                   "Content-Range: bytes 18-19/20\r\n\r\nij"
+                   "\r\n--" HTTP_RANGE_BOUNDARY "--\r\n") != 0);
+    fail_if(strstr(tx_wire, "Content-Length: 200\r\n") == NULL);
+
+    /* nothing satisfiable */
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /data.bin HTTP/1.1\r\nRange: bytes=20-30\r\n\r\n");
+    pico_http_respond_static(conn, HTTP_RESOURCE_FOUND, NULL, data, 20);
+    timers_fire(0);
+    fail_if(strcmp(tx_wire, "HTTP/1.1 416 Range Not Satisfiable\r\nHost: localhost\r\n"
+                   "Content-Range: bytes */20\r\nContent-Length: 0\r\n"
+                   "Connection: keep-alive\r\n\r\n") != 0);
+
+    /* malformed headers and a changed entity are answered in full */
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /data.bin HTTP/1.1\r\nRange: bytes=9-5\r\n\r\n");
+    pico_http_respond_static(conn, HTTP_RESOURCE_FOUND, NULL, data, 20);
+    timers_fire(0);
+    fail_if(strncmp(tx_wire, "HTTP/1.1 200 OK", 15) != 0);
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /data.bin HTTP/1.1\r\nRange: bytes=0-1\r\nIf-Range: \"v0\"\r\n\r\n");
+    pico_http_set_validators(conn, "\"v1\"", 0);
+    pico_http_respond_static(conn, HTTP_RESOURCE_FOUND, NULL, data, 20);
+    timers_fire(0);
+    fail_if(strncmp(tx_wire, "HTTP/1.1 200 OK", 15) != 0);
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /data.bin HTTP/1.1\r\nRange: bytes=0-1\r\nIf-Range: \"v1\"\r\n\r\n");
+    pico_http_set_validators(conn, "\"v1\"", 0);
+    pico_http_respond_static(conn, HTTP_RESOURCE_FOUND, NULL, data, 20);
+    timers_fire(0);
+    fail_if(strncmp(tx_wire, "HTTP/1.1 206", 12) != 0);
+
+    /* static assets are sliced by the server */
+    timers_fire(0);
+    wire_reset();
+    pico_http_server_set_assets(test_assets, 3);
+    wire_feed("GET /style.css HTTP/1.1\r\nRange: bytes=0-3\r\n\r\n");
+    timers_fire(0);
+    fail_if(req_ev_cnt != 0);
+    body = strstr(tx_wire, "\r\n\r\n");
+    fail_if(body == NULL || strcmp(body + 4, "body") != 0);
+    pico_http_server_set_assets(NULL, 0);
+    pico_http_close(conn);
+    printf("Stop: tc_byte_ranges\n");
+}
+END_TEST
+
+START_TEST(tc_request_body_stream)
+{
+    uint16_t conn = open_connection();
+    char buf[32];
+    uint32_t size = 0;
+    printf("\n\nStart: tc_request_body_stream\n");
+
+    fail_if(http_parse_hex("1aF;name=v", 10, &size) != 0 || size != 0x1AFu);
+    fail_if(http_parse_hex("", 0, &size) == 0);
+    fail_if(http_parse_hex("12g", 3, &size) == 0);
+    fail_if(http_parse_hex("123456789", 9, &size) == 0);
+
+    /* the start of the body comes with the header */
+    wire_feed("POST /up HTTP/1.1\r\nContent-Length: 10\r\n\r\n01234");
+    fail_if(req_ev_cnt != 1 || body_ev_cnt != 1);
+    fail_if(pico_http_read_body(conn, buf, 3) != 3 || memcmp(buf, "012", 3) != 0);
+    fail_if(pico_http_read_body(conn, buf, sizeof(buf)) != 2 || memcmp(buf, "34", 2) != 0);
+    fail_if(pico_http_read_body(conn, buf, sizeof(buf)) != 0);
+    fail_if(pico_http_body_complete(conn) != 0);
+
+    /* paused, the rest stays in the socket */
+    fail_if(pico_http_pause_body(conn, 1) != HTTP_RETURN_OK);
+    wire_feed("56789");
+    fail_if(body_ev_cnt != 1);
+    fail_if(rx_wire_read != rx_wire_len - 5);
+    pico_http_pause_body(conn, 0);
+    timers_fire(0);
+    fail_if(body_ev_cnt != 2);
+    fail_if(pico_http_read_body(conn, buf, sizeof(buf)) != 5 || memcmp(buf, "56789", 5) != 0);
+    fail_if(pico_http_body_complete(conn) != 1);
+    respond_hello(conn);
+    fail_if(strstr(tx_wire, "Connection: keep-alive\r\n") == NULL);
+    timers_fire(0);
+
+    /* chunked body, framing split over segments, then a pipelined request */
+    wire_reset();
+    wire_feed("POST /up HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhel");
+    fail_if(req_ev_cnt != 1);
+    fail_if(pico_http_get_body(conn) != NULL);
+    fail_if(pico_http_read_body(conn, buf, sizeof(buf)) != 3);
+    wire_feed("lo\r\n6;ext=1\r");
+    fail_if(body_ev_cnt != 2);
+    fail_if(pico_http_read_body(conn, buf + 3, sizeof(buf)) != 2);
+    wire_feed("\n world\r\n0\r\nX-Sum: 1\r\n\r\nGET /next HTTP/1.1\r\n\r\n");
+    fail_if(pico_http_read_body(conn, buf + 5, sizeof(buf)) != 6);
+    fail_if(memcmp(buf, "hello world", 11) != 0);
+    fail_if(pico_http_body_complete(conn) != 1);
+    respond_hello(conn);
+    fail_if(strstr(tx_wire, "Connection: keep-alive\r\n") == NULL);
+    timers_fire(0);
+    fail_if(req_ev_cnt != 2);
+    fail_if(strcmp(pico_http_get_resource(conn), "/next") != 0);
+    respond_hello(conn);
+    timers_fire(0);
+
+    /* an unfinished chunked body closes the connection */
+    wire_reset();
+    wire_feed("POST /up HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhel");
+    respond_hello(conn);
+    fail_if(strstr(tx_wire, "Connection: close\r\n") == NULL);
+    fail_if(socket_closed != 1);
+    pico_http_close(conn);
+
+    /* malformed framing and unsupported codings */
+    conn = open_connection();
+    wire_feed("POST /up HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n");
+    fail_if(pico_http_read_body(conn, buf, sizeof(buf)) != HTTP_RETURN_ERROR);
+    fail_if(pico_http_read_body(conn, buf, sizeof(buf)) != HTTP_RETURN_ERROR);
+    pico_http_close(conn);
+    conn = open_connection();
+    wire_feed("POST /up HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n");
+    fail_if(req_ev_cnt != 0 || error_ev_cnt != 1);
+    pico_http_close(conn);
+    printf("Stop: tc_request_body_stream\n");
+}
+END_TEST
+
+static char mp_log[512];
+static uint32_t mp_log_len = 0;
+static int mp_pause_at = -1;
+
+/* records the callbacks as "[name|filename|type]" and the data */
+static void mp_part(uint16_t conn, const struct pico_http_part *part)
+{
+    if (!part)
+    {
+        mp_log_len += (uint32_t)sprintf(mp_log + mp_log_len, "[end]");
+        return;
+    }
+    mp_log_len += (uint32_t)sprintf(mp_log + mp_log_len, "[%s|%s|%s]", part->name ? part->name : "-",
+                                    part->filename ? part->filename : "-", part->content_type ? part->content_type : "-");
+}
+
+static void mp_data(uint16_t conn, const uint8_t *data, uint16_t len)
+{
+    memcpy(mp_log + mp_log_len, data, len);
+    mp_log_len += len;
+    mp_log[mp_log_len] = 0;
+    if (mp_pause_at >= 0 && mp_log_len >= (uint32_t)mp_pause_at)
+    {
+        pico_http_pause_body(conn, 1);
+        mp_pause_at = -1;
+    }
+}
+
+START_TEST(tc_multipart_upload)
+{
+    uint16_t conn = open_connection();
+    struct http_multipart mp;
+    static const char body[] =
+        "preamble\r\n--XyZ\r\n"
+        "Content-Disposition: form-data; name=\"fw\"; filename=\"fw.bin\"\r\n"
+        "Content-Type: application/octet-stream\r\n\r\n"
+        "\r\n--Xy binary \r\n--XyY\r\n--XyZ  \r\n"
+        "content-disposition: form-data; name=note\r\n\r\n"
+        "hi\r\n--XyZ--\r\nepilogue";
+    static const char expected[] =
+        "[fw|fw.bin|application/octet-stream]\r\n--Xy binary \r\n--XyY[note|-|-]hi[end]";
+    char header[128];
+    uint32_t i;
+    printf("\n\nStart: tc_multipart_upload\n");
+
+    /* Horspool search */
+    memset(&mp, 0, sizeof(mp));
+    memcpy(mp.delim, "\r\n--ab", 6);
+    mp.delim_len = 6;
+    memset(mp.skip, 6, sizeof(mp.skip));
+    for (i = 0; i < 5; i++)
+        mp.skip[mp.delim[i]] = (uint8_t)(5 - i);
+    fail_if(http_multipart_find(&mp, (const uint8_t *)"xx\r\n--a\r\n--ab", 13) != 7);
+    fail_if(http_multipart_find(&mp, (const uint8_t *)"\r\n--a", 6) != -1);
+
+    /* the body arrives a few bytes at a time */
+    mp_log_len = 0;
+    sprintf(header, "POST /upload HTTP/1.1\r\nContent-Type: multipart/form-data; boundary=\"XyZ\"\r\n"
+            "Content-Length: %u\r\n\r\n", (unsigned)(sizeof(body) - 1));
+    wire_feed(header);
+    fail_if(req_ev_cnt != 1);
+    fail_if(pico_http_multipart_start(conn, mp_part, mp_data) != HTTP_RETURN_OK);
+    fail_if(pico_http_multipart_start(conn, mp_part, mp_data) != HTTP_RETURN_ERROR);
+    timers_fire(0);
+    for (i = 0; i < sizeof(body) - 1; i += 7)
+    {
+        char piece[8] = { 0 };
+        memcpy(piece, body + i, (sizeof(body) - 1 - i < 7) ? sizeof(body) - 1 - i : 7);
+        wire_feed(piece);
+    }
+    fail_if(strcmp(mp_log, expected) != 0);
+    fail_if(body_ev_cnt != 0);
+    fail_if(pico_http_body_complete(conn) != 1);
+    respond_hello(conn);
+    fail_if(strstr(tx_wire, "Connection: keep-alive\r\n") == NULL);
+    timers_fire(0);
+
+    /* paused from the data callback, in one segment */
+    wire_reset();
+    mp_log_len = 0;
+    mp_pause_at = 40;
+    sprintf(header, "POST /upload HTTP/1.1\r\nContent-Type: multipart/form-data; boundary=XyZ\r\n"
+            "Content-Length: %u\r\n\r\n", (unsigned)(sizeof(body) - 1));
+    wire_feed(header);
+    pico_http_multipart_start(conn, mp_part, mp_data);
+    wire_feed(body);
+    timers_fire(0);
+    fail_if(mp_log_len < 40 || mp_log_len >= sizeof(expected) - 1);
+    pico_http_pause_body(conn, 0);
+    timers_fire(0);
+    fail_if(strcmp(mp_log, expected) != 0);
+    respond_hello(conn);
+    timers_fire(0);
+
+    /* a truncated body is refused */
+    wire_reset();
+    wire_feed("POST /upload HTTP/1.1\r\nContent-Type: multipart/form-data; boundary=XyZ\r\n"
+              "Content-Length: 11\r\n\r\n--XyZ\r\n\r\nab");
+    fail_if(pico_http_multipart_start(conn, mp_part, mp_data) != HTTP_RETURN_OK);
+    timers_fire(0);
+    fail_if(error_ev_cnt != 1);
+    fail_if(strncmp(tx_wire, "HTTP/1.1 400", 12) != 0);
+    pico_http_close(conn);
+
+    /* not a multipart body */
+    conn = open_connection();
+    wire_feed("POST /upload HTTP/1.1\r\nContent-Length: 2\r\n\r\nab");
+    fail_if(pico_http_multipart_start(conn, mp_part, mp_data) != HTTP_RETURN_ERROR);
+    pico_http_close(conn);
+    printf("Stop: tc_multipart_upload\n");
+}
+END_TEST
+
+static char route_log[128];
+
+/* records the route and its parameters as "name:param=value,..." */
+static void route_record(uint16_t conn, const char *route, const char *p1, const char *p2)
+{
+    const char *value;
+    uint16_t len = 0;
+    int n = sprintf(route_log, "%s", route);
+    if (p1 && (value = pico_http_get_param(conn, p1, &len)) != NULL)
+        n += sprintf(route_log + n, ":%s=%.*s", p1, (int)len, value);
+    if (p2 && (value = pico_http_get_param(conn, p2, &len)) != NULL)
+        n += sprintf(route_log + n, ",%s=%.*s", p2, (int)len, value);
+    respond_hello(conn);
+}
+
+static void route_root(uint16_t conn)
+{
+    route_record(conn, "root", NULL, NULL);
+}
+
+static void route_users(uint16_t conn)
+{
+    route_record(conn, "users", NULL, NULL);
+}
+
+static void route_new_user(uint16_t conn)
+{
+    route_record(conn, "new_user", NULL, NULL);
+}
+
+static void route_user(uint16_t conn)
+{
+    route_record(conn, "user", "id", "nope");
+}
+
+static void route_post(uint16_t conn)
+{
+    route_record(conn, "post", "id", "post");
+}
+
+static void route_latest(uint16_t conn)
+{
+    route_record(conn, "latest", NULL, NULL);
+}
+
+static void route_section(uint16_t conn)
+{
+    route_record(conn, "section", "section", NULL);
+}
+
+/* feeds a request and returns what the route handler recorded */
+static const char *route_request(const char *request)
+{
+    route_log[0] = 0;
+    wire_reset();
+    wire_feed(request);
+    timers_fire(0);
+    return route_log;
+}
+
+START_TEST(tc_route_dispatch)
+{
+    uint16_t conn = open_connection();
+    printf("\n\nStart: tc_route_dispatch\n");
+
+    fail_if(pico_http_server_add_route(HTTP_METHOD_GET, "/", route_root) != HTTP_RETURN_OK);
+    fail_if(pico_http_server_add_route(HTTP_METHOD_GET, "/api/users/:id/posts/:post", route_post) != HTTP_RETURN_OK);
+    fail_if(pico_http_server_add_route(HTTP_METHOD_GET, "/api/users", route_users) != HTTP_RETURN_OK);
+    fail_if(pico_http_server_add_route(HTTP_METHOD_POST, "/api/users", route_new_user) != HTTP_RETURN_OK);
+    fail_if(pico_http_server_add_route(HTTP_METHOD_GET, "/api/users/:id", route_user) != HTTP_RETURN_OK);
+    fail_if(pico_http_server_add_route(HTTP_METHOD_GET, "/api/uploads/latest", route_latest) != HTTP_RETURN_OK);
+    fail_if(pico_http_server_add_route(HTTP_METHOD_GET, "/api/:section/x", route_section) != HTTP_RETURN_OK);
+
+    /* duplicates, conflicting parameter names and bad patterns */
+    fail_if(pico_http_server_add_route(HTTP_METHOD_GET, "/api/users", route_users) != HTTP_RETURN_ALREADYIN);
+    fail_if(pico_http_server_add_route(HTTP_METHOD_GET, "/api/users/:uid/a", route_users) != HTTP_RETURN_ERROR);
+    fail_if(pico_http_server_add_route(HTTP_METHOD_GET, "/api/a:b", route_users) != HTTP_RETURN_ERROR);
+    fail_if(pico_http_server_add_route(HTTP_METHOD_GET, "api", route_users) != HTTP_RETURN_ERROR);
+    fail_if(pico_http_server_add_route(3, "/api", route_users) != HTTP_RETURN_ERROR);
+
+    fail_if(strcmp(route_request("GET / HTTP/1.1\r\n\r\n"), "root") != 0);
+    fail_if(strcmp(route_request("GET /api/users HTTP/1.1\r\n\r\n"), "users") != 0);
+    fail_if(strcmp(route_request("POST /api/users HTTP/1.1\r\n\r\n"), "new_user") != 0);
+    fail_if(strcmp(route_request("GET /api/users/42?full=1 HTTP/1.1\r\n\r\n"), "user:id=42") != 0);
+    fail_if(strcmp(route_request("GET /api/users/7/posts/abc HTTP/1.1\r\n\r\n"), "post:id=7,post=abc") != 0);
+    fail_if(strcmp(route_request("GET /api/uploads/latest HTTP/1.1\r\n\r\n"), "latest") != 0);
+    /* the static branch fails deeper, the parameter one is tried */
+    fail_if(strcmp(route_request("GET /api/uploads/x HTTP/1.1\r\n\r\n"), "section:section=uploads") != 0);
+    fail_if(strcmp(route_request("GET /api/users/x HTTP/1.1\r\n\r\n"), "user:id=x") != 0);
+    fail_if(req_ev_cnt != 0);
+
+    /* no route, the request reaches the application */
+    fail_if(strcmp(route_request("GET /api/users/ HTTP/1.1\r\n\r\n"), "") != 0);
+    fail_if(req_ev_cnt != 1);
+    fail_if(pico_http_get_param(conn, "id", NULL) != NULL);
+    respond_hello(conn);
+    timers_fire(0);
+    fail_if(strcmp(route_request("POST /api/users/1 HTTP/1.1\r\n\r\n"), "") != 0);
+    fail_if(req_ev_cnt != 1);
+    respond_hello(conn);
+    timers_fire(0);
+    fail_if(strcmp(route_request("GET /apix HTTP/1.1\r\n\r\n"), "") != 0);
+    fail_if(req_ev_cnt != 1);
+    respond_hello(conn);
+    timers_fire(0);
+
+    http_route_free(default_server.routes);
+    default_server.routes = NULL;
+    pico_http_close(conn);
+    printf("Stop: tc_route_dispatch\n");
+}
+END_TEST
+
+static uint16_t other_conn = 0;
+static int other_con_ev_cnt = 0;
+static int other_req_ev_cnt = 0;
+
+static void other_cb(uint16_t ev, uint16_t conn)
+{
+    int32_t accepted;
+    if (ev & EV_HTTP_CON)
+    {
+        other_con_ev_cnt++;
+        accepted = pico_http_server_accept();
+        if (accepted > 0)
+            other_conn = (uint16_t)accepted;
+    }
+    if (ev & EV_HTTP_REQ)
+        other_req_ev_cnt++;
+}
+
+static void route_telemetry(uint16_t conn)
+{
+    respond_hello(conn);
+}
+
+START_TEST(tc_server_instances)
+{
+    struct pico_http_server_config config;
+    struct pico_http_server *srv;
+    uint16_t conn = open_connection();
+    printf("\n\nStart: tc_server_instances\n");
+
+    memset(&config, 0, sizeof(config));
+    config.rx_buffer_size = 100;
+    fail_if(pico_http_server_create(&config, other_cb) != NULL);
+    config.port = 8080;
+    config.max_connections = 1;
+    config.keepalive_max_requests = 1;
+    config.rx_buffer_size = 512;
+    srv = pico_http_server_create(&config, other_cb);
+    fail_if(srv == NULL);
+    fail_if(srv->rx_size != 512 || srv->tx_size != HTTP_TX_BUFFER_SIZE || srv->backlog != BACKLOG);
+    fail_if(pico_http_server_listen(srv, 8081) != HTTP_RETURN_OK);
+    fail_if(pico_http_server_listen(srv, 8082) != HTTP_RETURN_ERROR);
+    fail_if(pico_http_server_route(srv, HTTP_METHOD_GET, "/metrics", route_telemetry) != HTTP_RETURN_OK);
+
+    /* the connection belongs to the instance it was accepted on */
+    accept_socket = &other_socket;
+    http_server_cbk(PICO_SOCK_EV_CONN, &other_listen[1]);
+    fail_if(other_con_ev_cnt != 1 || other_conn == 0 || other_conn == conn);
+    fail_if(find_client(other_conn)->server != srv);
+    fail_if(find_client(other_conn)->rx_size != 512);
+    fail_if(find_client(conn)->server != &default_server);
+
+    /* its limits apply, not the ones of the default server */
+    socket_closed = 0;
+    http_server_cbk(PICO_SOCK_EV_CONN, &other_listen[0]);
+    fail_if(other_con_ev_cnt != 2 || socket_closed != 1);
+    fail_if(strncmp(tx_wire, "HTTP/1.1 503 ", 13) != 0);
+    accept_socket = &example_socket;
+    tx_wire_len = 0;
+    memset(tx_wire, 0, sizeof(tx_wire));
+
+    strcpy(rx_wire, "GET /metrics HTTP/1.1\r\n\r\n");
+    rx_wire_len = (uint32_t)strlen(rx_wire);
+    http_server_cbk(PICO_SOCK_EV_RD, &other_socket);
+    fail_if(other_req_ev_cnt != 0 || req_ev_cnt != 0);
+    fail_if(strstr(tx_wire, "Connection: close\r\n") == NULL);
+
+    /* routes are per instance */
+    wire_reset();
+    wire_feed("GET /metrics HTTP/1.1\r\n\r\n");
+    fail_if(req_ev_cnt != 1);
+    respond_hello(conn);
+    fail_if(strstr(tx_wire, "Connection: keep-alive\r\n") == NULL);
+    timers_fire(0);
+
+    fail_if(pico_http_server_destroy(srv) != HTTP_RETURN_OK);
+    fail_if(find_client(other_conn) != NULL);
+    fail_if(find_client(conn) == NULL);
+    fail_if(pico_http_server_destroy(NULL) != HTTP_RETURN_ERROR);
+    pico_http_close(conn);
+    printf("Stop: tc_server_instances\n");
+}
+END_TEST
+
+START_TEST(tc_connection_pool)
+{
+    struct pico_http_server_config config;
+    struct pico_http_server *srv;
+    struct http_client *client;
+    uint8_t *a, *b, *c, *d;
+    static char chunk[HTTP_POOL_COPY_SIZE + 1];
+    printf("\n\nStart: tc_connection_pool\n");
+
+    wire_reset();
+    memset(&config, 0, sizeof(config));
+    config.port = 8080;
+    config.max_connections = 4;
+    config.pool_connections = 1;
+    srv = pico_http_server_create(&config, other_cb);
+    fail_if(srv == NULL || srv->pool == NULL);
+    fail_if(srv->max_connections != 1);
+
+    /* the connection is the slot of the arena, the next one is refused */
+    accept_socket = &other_socket;
+    http_server_cbk(PICO_SOCK_EV_CONN, srv->sck[0]);
+    client = find_client(other_conn);
+    fail_if(client == NULL || !client->pooled || (uint8_t *)client != srv->pool);
+    fail_if(client->rx_buf < srv->pool || client->tx_buf + srv->tx_size > srv->pool + srv->pool_slot_size);
+    other_con_ev_cnt = 0;
+    other_req_ev_cnt = 0;
+    socket_closed = 0;
+    http_server_cbk(PICO_SOCK_EV_CONN, srv->sck[0]);
+    fail_if(other_con_ev_cnt != 1 || socket_closed != 1);
+
+    strcpy(rx_wire, "GET /a HTTP/1.1\r\n\r\n");
+    rx_wire_len = (uint32_t)strlen(rx_wire);
+    http_server_cbk(PICO_SOCK_EV_RD, &other_socket);
+    fail_if(other_req_ev_cnt != 1);
+    fail_if(pico_http_add_header(other_conn, "X-Slot", "1") != HTTP_RETURN_OK);
+    fail_if(client->extra_hdr < (char *)srv->pool || client->extra_hdr > (char *)client->copy_buf);
+    fail_if(pico_http_respond(other_conn, HTTP_RESOURCE_FOUND) < 0);
+
+    /* copies are limited by the room of the slot */
+    write_limit = 0;
+    memset(chunk, 'p', sizeof(chunk));
+    fail_if(pico_http_submit_buffer(other_conn, chunk, 1000, HTTP_BUFFER_COPY) != HTTP_RETURN_OK);
+    fail_if(pico_http_submit_buffer(other_conn, chunk, 1000, HTTP_BUFFER_COPY) != HTTP_RETURN_OK);
+    fail_if(pico_http_submit_buffer(other_conn, chunk, 1000, HTTP_BUFFER_COPY) != HTTP_RETURN_CONN_BUSY);
+    fail_if(pico_http_submit_buffer(other_conn, chunk, sizeof(chunk), HTTP_BUFFER_COPY) != HTTP_RETURN_ERROR);
+    write_limit = -1;
+    http_server_cbk(PICO_SOCK_EV_WR, &other_socket);
+    fail_if(client->queue_count != 0 || client->copy_count != 0);
+    fail_if(strstr(tx_wire, "X-Slot: 1\r\n") == NULL);
+    fail_if(memcmp(tx_wire + tx_wire_len - 1010, "p\r\n3e8\r\np", 9) != 0);
+
+    /* the copy room is a ring, released in queue order */
+    a = http_copy_alloc(client, 1000);
+    b = http_copy_alloc(client, 1000);
+    fail_if(a != client->copy_buf || b != a + 1000);
+    fail_if(http_copy_alloc(client, 100) != NULL);
+    http_copy_release(client, a, 1000);
+    c = http_copy_alloc(client, 600);
+    fail_if(c != client->copy_buf);
+    fail_if(http_copy_alloc(client, 500) != NULL);
+    d = http_copy_alloc(client, 400);
+    fail_if(d != c + 600);
+    http_copy_release(client, b, 1000);
+    fail_if(client->copy_start != 0 || client->copy_limit != 0);
+    http_copy_release(client, c, 600);
+    fail_if(client->copy_start != 600);
+    http_copy_release(client, d, 400);
+    fail_if(client->copy_count != 0);
+
+    /* closing gives the slot back */
+    pico_http_close(other_conn);
+    fail_if(srv->pool_free != client || srv->connections != 0);
+    http_server_cbk(PICO_SOCK_EV_CONN, srv->sck[0]);
+    fail_if(find_client(other_conn) != client || !client->pooled);
+
+    /* events are built in the copy room as well */
+    wire_reset();
+    strcpy(rx_wire, "GET /ev HTTP/1.1\r\nAccept: text/event-stream\r\n\r\n");
+    rx_wire_len = (uint32_t)strlen(rx_wire);
+    http_server_cbk(PICO_SOCK_EV_RD, &other_socket);
+    fail_if(pico_http_respond_events(other_conn) < 0);
+    fail_if(pico_http_send_event(other_conn, "t", NULL, "1", 1) != HTTP_RETURN_OK);
+    fail_if(client->copy_count != 1);
+    http_server_cbk(PICO_SOCK_EV_WR, &other_socket);
+    fail_if(client->queue_count != 0 || client->copy_count != 0);
+    fail_if(strstr(tx_wire, "event: t\ndata: 1\n\n") == NULL);
+    accept_socket = &example_socket;
+
+    fail_if(pico_http_server_destroy(srv) != HTTP_RETURN_OK);
+    printf("Stop: tc_connection_pool\n");
+}
+END_TEST
+
+START_TEST(tc_pool_timers)
+{
+    struct pico_http_server_config config;
+    struct pico_http_server *srv;
+    uint16_t conn;
+    int armed;
+    printf("\n\nStart: tc_pool_timers\n");
+
+    /* alone, a pooled server arms no timer */
+    wire_reset();
+    if (default_server.state == HTTP_SERVER_LISTEN)
+        pico_http_close(HTTP_SERVER_ID);
+    timers_fire(HTTP_SERVER_TICK_MS);
+    fail_if(tick_running);
+    armed = timers_armed();
+    memset(&config, 0, sizeof(config));
+    config.port = 8080;
+    config.pool_connections = 2;
+    config.header_timeout_ms = 2 * HTTP_SERVER_TICK_MS;
+    srv = pico_http_server_create(&config, other_cb);
+    fail_if(srv == NULL);
+
+    accept_socket = &other_socket;
+    other_req_ev_cnt = 0;
+    http_server_cbk(PICO_SOCK_EV_CONN, srv->sck[0]);
+    conn = other_conn;
+    strcpy(rx_wire, "GET /a HTTP/1.1\r\n\r\n");
+    rx_wire_len = (uint32_t)strlen(rx_wire);
+    http_server_cbk(PICO_SOCK_EV_RD, &other_socket);
+    fail_if(other_req_ev_cnt != 1);
+
+    /* answered outside of the callbacks, it is written by the poll */
+    fail_if(pico_http_respond_static(conn, HTTP_RESOURCE_FOUND, "text/plain", "hi", 2) < 0);
+    fail_if(tx_wire_len != 0);
+    pico_http_server_poll();
+    fail_if(tx_wire_len == 0 || memcmp(tx_wire + tx_wire_len - 6, "\r\n\r\nhi", 6) != 0);
+    fail_if(timers_armed() != armed);
+
+    /* and the deadlines advance with it */
+    http_server_cbk(PICO_SOCK_EV_CONN, srv->sck[0]);
+    fail_if(other_conn == conn);
+    wire_reset();
+    strcpy(rx_wire, "GE");
+    rx_wire_len = 2;
+    http_server_cbk(PICO_SOCK_EV_RD, &other_socket);
+    pico_http_server_poll();
+    fail_if(find_client(other_conn) == NULL);
+    tick_last = PICO_TIME_MS() - 5 * HTTP_SERVER_TICK_MS;
+    pico_http_server_poll();
+    fail_if(find_client(other_conn) != NULL || socket_closed != 1);
+    fail_if(find_client(conn) == NULL);
+    fail_if(timers_armed() != armed);
+    accept_socket = &example_socket;
+
+    fail_if(pico_http_server_destroy(srv) != HTTP_RETURN_OK);
+
+    /* the default server gets its listener back for the next tests */
+    sockets_opened = 0;
+    fail_if(pico_http_server_start(0, cb) != HTTP_RETURN_OK);
+    fail_if(!tick_running);
+    printf("Stop: tc_pool_timers\n");
+}
+END_TEST
+
+START_TEST(tc_connection_ids)
+{
+    uint16_t conn = open_connection();
+    uint16_t ids[HTTP_CONN_SLOTS];
+    uint16_t first = conn;
+    uint32_t i;
+    printf("\n\nStart: tc_connection_ids\n");
+
+    /* the ID carries the table entry and its generation */
+    fail_if(conn == HTTP_SERVER_ID || (conn >> HTTP_CONN_SLOT_BITS) == 0);
+    fail_if(conn_table[conn & (HTTP_CONN_SLOTS - 1u)] != find_client(conn));
+    fail_if((uint16_t)(uintptr_t)example_socket.priv != conn);
+    pico_http_close(conn);
+    fail_if(find_client(conn) != NULL);
+
+    /* a late event of its socket does not reach the released connection */
+    close_ev_cnt = 0;
+    http_server_cbk(PICO_SOCK_EV_CLOSE, &example_socket);
+    fail_if(close_ev_cnt != 0);
+
+    /* a reused entry does not answer for the stale ID */
+    for (i = 0; i < HTTP_CONN_SLOTS; i++)
+    {
+        conn = open_connection();
+        fail_if(conn == first);
+        fail_if(find_client(first) != NULL);
+        if ((conn & (HTTP_CONN_SLOTS - 1u)) == (first & (HTTP_CONN_SLOTS - 1u)))
+            break;
+
+        pico_http_close(conn);
+    }
+    fail_if(i == HTTP_CONN_SLOTS);
+    fail_if(find_client(conn) == NULL);
+    pico_http_close(conn);
+
+    /* the table bounds the open connections */
+    for (i = 0; i < HTTP_CONN_SLOTS; i++)
+    {
+        ids[i] = open_connection();
+        fail_if(find_client(ids[i]) == NULL);
+    }
+    socket_closed = 0;
+    http_server_cbk(PICO_SOCK_EV_CONN, &listen_socket);
+    fail_if(socket_closed != 1 || pico_err != PICO_ERR_EAGAIN);
+    for (i = 0; i < HTTP_CONN_SLOTS; i++)
+        pico_http_close(ids[i]);
+    printf("Stop: tc_connection_ids\n");
+}
+END_TEST
+
+START_TEST(tc_write_fairness)
+{
+    uint16_t bulk = open_connection();
+    uint16_t small;
+    static uint8_t big[7000];
+    char *hi, *data;
+    int runs;
+    printf("\n\nStart: tc_write_fairness\n");
+
+    accept_socket = &other_socket;
+    http_server_cbk(PICO_SOCK_EV_CONN, &listen_socket);
+    small = last_conn;
+    accept_socket = &example_socket;
+    fail_if(small == bulk);
+
+    wire_feed("GET /download HTTP/1.1\r\n\r\n");
+    fail_if(pico_http_set_priority(bulk, HTTP_PRIORITIES) != HTTP_RETURN_ERROR);
+    fail_if(pico_http_set_priority(bulk, HTTP_PRIORITY_BULK) != HTTP_RETURN_OK);
+    memset(big, 'x', sizeof(big));
+    fail_if(pico_http_respond_sized(bulk, HTTP_RESOURCE_FOUND, "application/octet-stream", sizeof(big)) < 0);
+    fail_if(pico_http_submit_buffer(bulk, big, sizeof(big), HTTP_BUFFER_STATIC) != HTTP_RETURN_OK);
+
+    wire_feed("GET /status HTTP/1.1\r\n\r\n");
+    http_server_cbk(PICO_SOCK_EV_RD, &other_socket);
+    fail_if(req_ev_cnt != 2);
+    fail_if(pico_http_respond(small, HTTP_RESOURCE_FOUND) < 0);
+    fail_if(pico_http_submit_data(small, "hello", 5) != HTTP_RETURN_OK);
+    fail_if(pico_http_submit_data(small, NULL, 0) != HTTP_RETURN_OK);
+
+    /* the interactive answer goes out first, the download gets a quantum per run */
+    progress_ev_cnt = 0;
+    timers_fire(0);
+    hi = strstr(tx_wire, "hello");
+    data = memchr(tx_wire, 'x', tx_wire_len);
+    fail_if(hi == NULL || data == NULL || hi > data);
+    fail_if(tx_wire + tx_wire_len - data > (long)HTTP_TX_QUANTUM);
+    fail_if(progress_ev_cnt != 2);
+    fail_if(find_client(bulk)->tx_ready != 1);
+
+    for (runs = 1; runs < 10 && find_client(bulk)->state != HTTP_WAIT_HDR; runs++)
+        timers_fire(0);
+    fail_if(runs != 2);
+    fail_if(memcmp(tx_wire + tx_wire_len - 10, "xxxxxxxxxx", 10) != 0);
+
+    /* without a timer, the run happens on the next socket event */
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /status HTTP/1.1\r\n\r\n");
+    timers_fail = 1;
+    fail_if(pico_http_respond(bulk, HTTP_RESOURCE_FOUND) < 0);
+    fail_if(tx_run_scheduled != 0 || tx_wire_len != 0);
+    fail_if(pico_http_submit_data(bulk, "hello", 5) != HTTP_RETURN_OK);
+    fail_if(pico_http_submit_data(bulk, NULL, 0) != HTTP_RETURN_OK);
+    wire_feed("");
+    fail_if(strstr(tx_wire, "hello") == NULL);
+
+    pico_http_close(small);
+    pico_http_close(bulk);
+    printf("Stop: tc_write_fairness\n");
+}
+END_TEST
+
+START_TEST(tc_timeouts)
+{
+    uint16_t conn;
+    int i;
+    printf("\n\nStart: tc_timeouts\n");
+
+    fail_if(pico_http_server_set_timeouts(1000, 1000, 1000) != HTTP_RETURN_OK);
+
+    /* the header deadline runs from the first byte, trickling does not extend it */
+    conn = open_connection();
+    fail_if(find_client(conn)->timeout_kind != HTTP_TIMEOUT_IDLE);
+    wire_feed("GET /a HT");
+    fail_if(find_client(conn)->timeout_kind != HTTP_TIMEOUT_HEADER);
+    timers_fire(HTTP_SERVER_TICK_MS);
+    wire_feed("TP/1.1\r\n");
+    fail_if(socket_closed != 0);
+    timers_fire(HTTP_SERVER_TICK_MS);
+    fail_if(socket_closed != 1 || close_ev_cnt != 1);
+    fail_if(find_client(conn) != NULL);
+
+    /* the body deadline restarts when the body moves */
+    conn = open_connection();
+    wire_feed("POST /u HTTP/1.1\r\nContent-Length: 10\r\n\r\nabc");
+    fail_if(req_ev_cnt != 1 || find_client(conn)->timeout_kind != HTTP_TIMEOUT_BODY);
+    timers_fire(HTTP_SERVER_TICK_MS);
+    wire_feed("de");
+    timers_fire(HTTP_SERVER_TICK_MS);
+    fail_if(socket_closed != 0);
+    timers_fire(HTTP_SERVER_TICK_MS);
+    fail_if(socket_closed != 1 || find_client(conn) != NULL);
+
+    /* the application has to start answering in time */
+    conn = open_connection();
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    fail_if(find_client(conn)->timeout_kind != HTTP_TIMEOUT_RESPONSE);
+    timers_fire(HTTP_SERVER_TICK_MS);
+    timers_fire(HTTP_SERVER_TICK_MS);
+    fail_if(socket_closed != 1 || find_client(conn) != NULL);
+
+    /* an answer moves the connection to the keep-alive deadline */
+    conn = open_connection();
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    timers_fire(HTTP_SERVER_TICK_MS);
+    respond_hello(conn);
+    timers_fire(0);
+    fail_if(find_client(conn)->timeout_kind != HTTP_TIMEOUT_IDLE);
+    for (i = 0; i < 4; i++)
+        timers_fire(HTTP_SERVER_TICK_MS);
+    fail_if(socket_closed != 0);
+    pico_http_close(conn);
+
+    /* deadlines further than a turn of the first level go through the second one */
+    pico_http_server_set_timeouts(HTTP_WHEEL_SLOTS * HTTP_SERVER_TICK_MS * 2u, 0, 0);
+    conn = open_connection();
+    wire_feed("GET /a HT");
+    for (i = 0; i < (int)HTTP_WHEEL_SLOTS * 2 - 1; i++)
+        timers_fire(HTTP_SERVER_TICK_MS);
+    fail_if(socket_closed != 0);
+    timers_fire(HTTP_SERVER_TICK_MS);
+    fail_if(socket_closed != 1 || find_client(conn) != NULL);
+
+    /* 0 disables a deadline */
+    conn = open_connection();
+    wire_feed("GET /a HT");
+    for (i = 0; i < 4; i++)
+        timers_fire(HTTP_SERVER_TICK_MS);
+    fail_if(socket_closed != 0 || find_client(conn) == NULL);
+    pico_http_close(conn);
+
+    /* a tick without a timer is armed again by the next socket event */
+    pico_http_server_set_timeouts(1000, 1000, 1000);
+    conn = open_connection();
+    wire_feed("GET /a HT");
+    timers_fail = 1;
+    timers_fire(HTTP_SERVER_TICK_MS);
+    fail_if(tick_running != 0);
+    wire_feed("");
+    fail_if(tick_running != 1);
+    timers_fire(HTTP_SERVER_TICK_MS);
+    fail_if(socket_closed != 1 || find_client(conn) != NULL);
+
+    pico_http_server_set_timeouts(HTTP_HEADER_TIMEOUT_MS, HTTP_BODY_TIMEOUT_MS, HTTP_RESPONSE_TIMEOUT_MS);
+    printf("Stop: tc_timeouts\n");
+}
+END_TEST
+
+static uint16_t auto_conns[4];
+static int auto_con_cnt = 0;
+
+static void auto_cb(uint16_t ev, uint16_t conn)
+{
+    if ((ev & EV_HTTP_CON) && auto_con_cnt < 4)
+        auto_conns[auto_con_cnt++] = conn;
+}
+
+START_TEST(tc_admission)
+{
+    struct pico_http_server_config config;
+    struct pico_http_server *srv;
+    printf("\n\nStart: tc_admission\n");
+
+    wire_reset();
+    memset(&config, 0, sizeof(config));
+    config.port = 8080;
+    config.max_connections = 2;
+    config.auto_accept = 1;
+    srv = pico_http_server_create(&config, auto_cb);
+    fail_if(srv == NULL);
+
+    /* every pending connection is taken, the ones over the limit are shed */
+    accept_socket = &other_socket;
+    pending_conns = 3;
+    http_server_cbk(PICO_SOCK_EV_CONN, srv->sck[0]);
+    fail_if(pending_conns != 0);
+    fail_if(auto_con_cnt != 2 || srv->connections != 2);
+    fail_if(find_client(auto_conns[0]) == NULL || find_client(auto_conns[1]) == NULL);
+    fail_if(socket_closed != 1);
+    fail_if(strstr(tx_wire, "HTTP/1.1 503 Service Unavailable\r\n") == NULL);
+    fail_if(strstr(tx_wire, "Retry-After: " HTTP_RETRY_AFTER "\r\n") == NULL);
+
+    /* room again once a connection is closed */
+    pico_http_close(auto_conns[0]);
+    socket_closed = 0;
+    pending_conns = 1;
+    http_server_cbk(PICO_SOCK_EV_CONN, srv->sck[0]);
+    fail_if(auto_con_cnt != 3 || srv->connections != 2);
+    fail_if(socket_closed != 0);
+
+    pending_conns = -1;
+    accept_socket = &example_socket;
+    fail_if(pico_http_server_destroy(srv) != HTTP_RETURN_OK);
+
+    /* a connection the application does not accept is dropped, the
+     * listener stays open */
+    open_connection();
+    accept_on_con = 0;
+    socket_closed = 0;
+    pending_conns = 1;
+    http_server_cbk(PICO_SOCK_EV_CONN, &listen_socket);
+    fail_if(pending_conns != 0 || socket_closed != 1 || last_closed != &example_socket);
+    fail_if(default_server.state != HTTP_SERVER_LISTEN || default_server.sck[0] != &listen_socket);
+    accept_on_con = 1;
+    pending_conns = -1;
+    fail_if(open_connection() == 0);
+    printf("Stop: tc_admission\n");
+}
+END_TEST
+
+START_TEST(tc_rate_limit)
+{
+    uint16_t conn;
+    struct http_rate_bucket *bucket;
+    int i;
+    printf("\n\nStart: tc_rate_limit\n");
+
+    /* two requests per second for each address */
+    fail_if(pico_http_server_set_rate_limit(2, 0) != HTTP_RETURN_OK);
+    conn = open_connection();
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    respond_hello(conn);
+    timers_fire(0);
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    respond_hello(conn);
+    timers_fire(0);
+    tx_wire_len = 0;
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    fail_if(req_ev_cnt != 2);
+    fail_if(strncmp(tx_wire, "HTTP/1.1 429 Too Many Requests\r\n", 32) != 0);
+    fail_if(close_ev_cnt != 1 || find_client(conn) != NULL);
+
+    /* the other addresses have their own buckets */
+    accept_addr = 0x0200000A;
+    conn = open_connection();
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    fail_if(req_ev_cnt != 1);
+    pico_http_close(conn);
+
+    /* the buckets refill with time */
+    accept_addr = 0x0100000A;
+    conn = open_connection();
+    bucket = http_rate_bucket(find_client(conn));
+    fail_if(bucket->addr != 0x0100000A || bucket->requests >= 1000u);
+    bucket->last -= 1000u;
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    fail_if(req_ev_cnt != 1);
+    pico_http_close(conn);
+
+    /* request headers and responses are charged to the byte bucket */
+    pico_http_server_set_rate_limit(0, 1000);
+    conn = open_connection();
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    respond_hello(conn);
+    timers_fire(0);
+    bucket = http_rate_bucket(find_client(conn));
+    fail_if(bucket->bytes > ((int64_t)(1000u - 19u - tx_wire_len) + 50) * 1000 ||
+            bucket->bytes < (int64_t)(1000u - 19u - tx_wire_len) * 1000);
+    bucket->bytes = 0;
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    fail_if(req_ev_cnt != 1 || find_client(conn) != NULL);
+
+    /* a small rate refilled every millisecond still earns its bytes */
+    pico_http_server_set_rate_limit(0, 500);
+    conn = open_connection();
+    bucket = http_rate_bucket(find_client(conn));
+    bucket->bytes = 0;
+    for (i = 0; i < 10; i++)
+    {
+        bucket->last -= 1u;
+        http_rate_refill(&default_server, bucket);
+    }
+    fail_if(bucket->bytes != 5000);
+    pico_http_close(conn);
+
+    /* the address 0 gets buckets of its own, not a free entry */
+    pico_http_server_set_rate_limit(2, 0);
+    accept_addr = 0;
+    conn = open_connection();
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    fail_if(req_ev_cnt != 1);
+    bucket = http_rate_bucket(find_client(conn));
+    fail_if(!bucket->used || bucket->addr != 0 || bucket->requests >= 2000u);
+    pico_http_close(conn);
+    accept_addr = 0x0100000A;
+
+    pico_http_server_set_rate_limit(0, 0);
+    printf("Stop: tc_rate_limit\n");
+}
+END_TEST
+
+START_TEST(tc_reserve_commit)
+{
+    uint16_t conn = open_connection();
+    uint8_t *room;
+    uint16_t len;
+    printf("\n\nStart: tc_reserve_commit\n");
+
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    fail_if(pico_http_reserve(conn, &len) != NULL);
+    fail_if(pico_http_respond(conn, HTTP_RESOURCE_FOUND) < 0);
+
+    /* rendered in place, framed on commit, sent with the header */
+    room = pico_http_reserve(conn, &len);
+    fail_if(room == NULL);
+    fail_if(len != find_client(conn)->tx_size - find_client(conn)->tx_len - HTTP_RESERVE_FRAMING);
+    len = (uint16_t)snprintf((char *)room, len, "{\"a\":%d}", 1);
+    fail_if(pico_http_commit(conn, len) != HTTP_RETURN_OK);
+    fail_if(pico_http_commit(conn, len) != HTTP_RETURN_ERROR);
+    fail_if(pico_http_submit_data(conn, NULL, 0) != HTTP_RETURN_OK);
+    timers_fire(0);
+    fail_if(write_calls != 1);
+    fail_if(strstr(tx_wire, "\r\n\r\n0007\r\n{\"a\":1}\r\n0\r\n\r\n") == NULL);
+
+    /* not behind queued chunks */
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    fail_if(pico_http_respond(conn, HTTP_RESOURCE_FOUND) < 0);
+    fail_if(pico_http_submit_data(conn, "queued", 6) != HTTP_RETURN_OK);
+    fail_if(pico_http_reserve(conn, &len) != NULL || pico_err != PICO_ERR_EAGAIN);
+    timers_fire(0);
+    fail_if(sent_ev_cnt != 1);
+
+    /* a full stage is reported, then drained */
+    room = pico_http_reserve(conn, &len);
+    fail_if(room == NULL);
+    memset(room, 'r', len);
+    fail_if(pico_http_commit(conn, len) != HTTP_RETURN_OK);
+    fail_if(pico_http_reserve(conn, &len) != NULL || pico_err != PICO_ERR_EAGAIN);
+    timers_fire(0);
+    fail_if(sent_ev_cnt != 2);
+    fail_if(memcmp(tx_wire + tx_wire_len - 4, "rr\r\n", 4) != 0);
+    fail_if(pico_http_reserve(conn, &len) == NULL);
+    fail_if(pico_http_commit(conn, 0) != HTTP_RETURN_OK);
+    fail_if(pico_http_submit_data(conn, NULL, 0) != HTTP_RETURN_OK);
+    timers_fire(0);
+
+    /* no framing for a sized body, the room stops at its length */
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    fail_if(pico_http_respond_sized(conn, HTTP_RESOURCE_FOUND, "text/plain", 5) < 0);
+    room = pico_http_reserve(conn, &len);
+    fail_if(room == NULL || len != 5);
+    memcpy(room, "hello", 5);
+    fail_if(pico_http_commit(conn, 5) != HTTP_RETURN_OK);
+    timers_fire(0);
+    fail_if(memcmp(tx_wire + tx_wire_len - 9, "\r\n\r\nhello", 9) != 0);
+    pico_http_close(conn);
+    printf("Stop: tc_reserve_commit\n");
+}
+END_TEST
+
+static uint16_t produced_records;
+static uint16_t produced_stop;
+
+/* fills the room with records, nothing ready at produced_stop */
+static int32_t record_producer(uint16_t conn, uint8_t *buf, uint16_t len, void *arg)
+{
+    uint16_t total = *(uint16_t *)arg;
+    int32_t n = 0;
+
+    if (produced_records == total)
+        return 0;
+    if (produced_records == produced_stop)
+    {
+        produced_stop = 0;
+        return -1;
+    }
+
+    while (produced_records < total && produced_records != produced_stop && len - n >= 8)
+    {
+        n += sprintf((char *)buf + n, "rec%04u\n", produced_records);
+        produced_records++;
+    }
+    return n;
+}
+
+/* claims more than the room it was given */
+static int32_t overrun_producer(uint16_t conn, uint8_t *buf, uint16_t len, void *arg)
+{
+    return (int32_t)len + 1;
+}
+
+START_TEST(tc_producer)
+{
+    uint16_t conn = open_connection();
+    uint16_t total = 600;
+    printf("\n\nStart: tc_producer\n");
+
+    wire_feed("GET /log HTTP/1.1\r\n\r\n");
+    fail_if(pico_http_set_producer(conn, record_producer, &total) != HTTP_RETURN_ERROR);
+    fail_if(pico_http_respond(conn, HTTP_RESOURCE_FOUND) < 0);
+    produced_records = 0;
+    produced_stop = 300;
+    fail_if(pico_http_set_producer(conn, record_producer, &total) != HTTP_RETURN_OK);
+
+    /* filled up to the stop, then waits for a resume */
+    timers_fire(0);
+    fail_if(produced_records != 300);
+    fail_if(find_client(conn)->state != HTTP_WAIT_DATA);
+    timers_fire(0);
+    fail_if(produced_records != 300);
+    fail_if(strstr(tx_wire, "rec0299\n") == NULL);
+
+    /* the rest, then the final chunk */
+    fail_if(pico_http_resume_producer(conn) != HTTP_RETURN_OK);
+    timers_fire(0);
+    timers_fire(0);
+    fail_if(produced_records != total);
+    fail_if(strstr(tx_wire, "rec0599\n\r\n0\r\n\r\n") == NULL);
+    fail_if(find_client(conn)->produce != NULL);
+    fail_if(pico_http_resume_producer(conn) != HTTP_RETURN_ERROR);
+
+    /* a sized body stops at its length */
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /log HTTP/1.1\r\n\r\n");
+    fail_if(pico_http_respond_sized(conn, HTTP_RESOURCE_FOUND, "text/plain", 24) < 0);
+    produced_records = 0;
+    produced_stop = 0xFFFF;
+    fail_if(pico_http_set_producer(conn, record_producer, &total) != HTTP_RETURN_OK);
+    timers_fire(0);
+    timers_fire(0);
+    fail_if(produced_records != 3);
+    fail_if(memcmp(tx_wire + tx_wire_len - 28, "\r\n\r\nrec0000\nrec0001\nrec0002\n", 28) != 0);
+    pico_http_close(conn);
+
+    /* a producer past its room resets the connection */
+    conn = open_connection();
+    wire_feed("GET /log HTTP/1.1\r\n\r\n");
+    fail_if(pico_http_respond(conn, HTTP_RESOURCE_FOUND) < 0);
+    fail_if(pico_http_set_producer(conn, overrun_producer, NULL) != HTTP_RETURN_OK);
+    timers_fire(0);
+    fail_if(find_client(conn) != NULL || close_ev_cnt != 1 || socket_closed != 1);
+    printf("Stop: tc_producer\n");
+}
+END_TEST
+
+START_TEST(tc_events)
+{
+    uint16_t a = open_connection();
+    uint16_t b, c;
+    struct pico_http_events *ch;
+    struct http_event *ev;
+    int i;
+    printf("\n\nStart: tc_events\n");
+
+    pico_http_server_set_heartbeat(1000);
+    accept_socket = &other_socket;
+    http_server_cbk(PICO_SOCK_EV_CONN, &listen_socket);
+    b = last_conn;
+    accept_socket = &example_socket;
+
+    /* framing helpers on a single stream */
+    wire_feed("GET /events HTTP/1.1\r\nAccept: text/event-stream\r\n\r\n");
+    fail_if(pico_http_send_event(a, NULL, NULL, "x", 1) != HTTP_RETURN_ERROR);
+    fail_if(pico_http_respond_events(a) < 0);
+    fail_if(find_client(a)->timeout_kind != HTTP_TIMEOUT_HEARTBEAT);
+    fail_if(pico_http_send_event(a, "bad\nname", NULL, "x", 1) != HTTP_RETURN_ERROR);
+    fail_if(pico_http_send_event(a, "temp", "7", "21.5\r\nC", 7) != HTTP_RETURN_OK);
+    timers_fire(0);
+    fail_if(strstr(tx_wire, "Content-Type: text/event-stream\r\n") == NULL);
+    fail_if(strstr(tx_wire, "Cache-Control: no-cache\r\n") == NULL);
+    fail_if(strstr(tx_wire, "event: temp\nid: 7\ndata: 21.5\ndata: C\n\n") == NULL);
+
+    /* a comment keeps the idle stream open */
+    tx_wire_len = 0;
+    memset(tx_wire, 0, sizeof(tx_wire));
+    timers_fire(HTTP_SERVER_TICK_MS);
+    timers_fire(HTTP_SERVER_TICK_MS);
+    timers_fire(0);
+    fail_if(strstr(tx_wire, "3\r\n:\n\n\r\n") == NULL);
+    fail_if(socket_closed != 0);
+
+    /* one serialized event, queued on every subscriber */
+    wire_feed("GET /events HTTP/1.1\r\n\r\n");
+    http_server_cbk(PICO_SOCK_EV_RD, &other_socket);
+    fail_if(pico_http_respond_events(b) < 0);
+    ch = pico_http_events_create(2);
+    fail_if(ch == NULL);
+    fail_if(pico_http_events_subscribe(ch, a) != HTTP_RETURN_OK);
+    fail_if(pico_http_events_subscribe(ch, a) != HTTP_RETURN_ERROR);
+    fail_if(pico_http_events_subscribe(ch, b) != HTTP_RETURN_OK);
+    fail_if(pico_http_events_publish(ch, "tick", "1", 1) != 2);
+    ev = ch->history[0];
+    fail_if(ev->refs != 3);
+    fail_if(find_client(a)->queue[find_client(a)->queue_head].data != find_client(b)->queue[find_client(b)->queue_head].data);
+    tx_wire_len = 0;
+    memset(tx_wire, 0, sizeof(tx_wire));
+    timers_fire(0);
+    fail_if(ev->refs != 1);
+    fail_if(strstr(tx_wire, "event: tick\nid: 1\ndata: 1\n\n") == NULL);
+    fail_if(strstr(strstr(tx_wire, "id: 1\n") + 1, "id: 1\n") == NULL);
+    fail_if(pico_http_events_publish(ch, NULL, "2", 1) != 2);
+    fail_if(pico_http_events_publish(ch, NULL, "3", 1) != 2);
+    fail_if(ch->history_count != 2 || ch->history[ch->history_head]->id != 2);
+    timers_fire(0);
+
+    /* a subscriber coming back gets what it missed */
+    pico_http_close(b);
+    accept_socket = &other_socket;
+    http_server_cbk(PICO_SOCK_EV_CONN, &listen_socket);
+    c = last_conn;
+    accept_socket = &example_socket;
+    wire_feed("GET /events HTTP/1.1\r\nLast-Event-ID: 2\r\n\r\n");
+    http_server_cbk(PICO_SOCK_EV_RD, &other_socket);
+    fail_if(pico_http_respond_events(c) < 0);
+    tx_wire_len = 0;
+    memset(tx_wire, 0, sizeof(tx_wire));
+    fail_if(pico_http_events_subscribe(ch, c) != HTTP_RETURN_OK);
+    timers_fire(0);
+    fail_if(strstr(tx_wire, "id: 3\ndata: 3\n\n") == NULL || strstr(tx_wire, "id: 2\n") != NULL);
+
+    /* a subscriber that does not keep up is dropped */
+    close_ev_cnt = 0;
+    for (i = 0; i < HTTP_SEND_QUEUE_LEN; i++)
+        fail_if(pico_http_events_publish(ch, NULL, "x", 1) != 2);
+    fail_if(pico_http_events_publish(ch, NULL, "x", 1) != 0);
+    fail_if(ch->subscribers != NULL);
+    timers_fire(0);
+    fail_if(find_client(a) != NULL || find_client(c) != NULL || close_ev_cnt != 2);
+    fail_if(pico_http_events_destroy(ch) != HTTP_RETURN_OK);
+    pico_http_server_set_heartbeat(HTTP_EVENT_HEARTBEAT_MS);
+    printf("Stop: tc_events\n");
+}
+END_TEST
+
+static const char ws_request[] =
+    "GET /chat HTTP/1.1\r\nHost: server.example.com\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+static char ws_data[32];
+static uint32_t ws_len = 0;
+static uint8_t ws_opcode = 0;
+static uint8_t ws_fin = 0;
+
+static void ws_message(uint16_t conn, uint8_t opcode, const uint8_t *data, uint32_t len, uint8_t fin)
+{
+    fail_if(len >= sizeof(ws_data));
+    memcpy(ws_data, data, len);
+    ws_len = len;
+    ws_opcode = opcode;
+    ws_fin = fin;
+}
+
+/* same as wire_feed, for the connection of the given socket */
+static void wire_feed_sock(struct pico_socket *s, const char *data, uint32_t len)
+{
+    memcpy(rx_wire + rx_wire_len, data, len);
+    rx_wire_len += len;
+    http_server_cbk(PICO_SOCK_EV_RD, s);
+}
+
+START_TEST(tc_websocket)
+{
+    uint16_t a = open_connection();
+    uint16_t b, version;
+    struct pico_http_events *ch;
+    printf("\n\nStart: tc_websocket\n");
+
+    pico_http_server_set_heartbeat(1000);
+
+    /* the handshake of RFC 6455 */
+    wire_feed(ws_request);
+    version = find_client(a)->headers[HTTP_HDR_SEC_WEBSOCKET_VERSION].offset;
+    find_client(a)->headers[HTTP_HDR_SEC_WEBSOCKET_VERSION].offset = 0;
+    fail_if(pico_http_websocket_accept(a, ws_message) != HTTP_RETURN_ERROR);
+    find_client(a)->headers[HTTP_HDR_SEC_WEBSOCKET_VERSION].offset = version;
+    fail_if(pico_http_websocket_accept(a, ws_message) != HTTP_RETURN_OK);
+    fail_if(pico_http_submit_data(a, "x", 1) != HTTP_RETURN_ERROR);
+    timers_fire(0);
+    fail_if(strncmp(tx_wire, "HTTP/1.1 101 Switching Protocols\r\n", 34) != 0);
+    fail_if(strstr(tx_wire, "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n\r\n") == NULL);
+
+    /* masked frames in, unmasked frames out */
+    wire_feed("\x81\x85\x37\xfa\x21\x3d\x7f\x9f\x4d\x51\x58");
+    fail_if(ws_opcode != HTTP_WS_TEXT || ws_len != 5 || memcmp(ws_data, "Hello", 5) != 0 || !ws_fin);
+    tx_wire_len = 0;
+    fail_if(pico_http_websocket_send(a, HTTP_WS_TEXT, "Hi", 2) != HTTP_RETURN_OK);
+    fail_if(pico_http_websocket_send(a, HTTP_WS_CLOSE, NULL, 0) != HTTP_RETURN_ERROR);
+    timers_fire(0);
+    fail_if(tx_wire_len != 4 || memcmp(tx_wire, "\x81\x02Hi", 4) != 0);
+
+    /* a ping is answered with its payload */
+    tx_wire_len = 0;
+    wire_feed("\x89\x82\x01\x02\x03\x04Ik");
+    timers_fire(0);
+    fail_if(tx_wire_len != 4 || memcmp(tx_wire, "\x8a\x02Hi", 4) != 0);
+
+    /* one frame, queued on every subscriber */
+    accept_socket = &other_socket;
+    http_server_cbk(PICO_SOCK_EV_CONN, &listen_socket);
+    b = last_conn;
+    accept_socket = &example_socket;
+    wire_feed_sock(&other_socket, ws_request, sizeof(ws_request) - 1);
+    fail_if(pico_http_websocket_accept(b, ws_message) != HTTP_RETURN_OK);
+    timers_fire(0);
+    ch = pico_http_events_create(0);
+    fail_if(pico_http_events_subscribe(ch, a) != HTTP_RETURN_OK);
+    fail_if(pico_http_events_subscribe(ch, b) != HTTP_RETURN_OK);
+    fail_if(pico_http_events_publish(ch, NULL, "x", 1) != 0);
+    fail_if(pico_http_websocket_publish(ch, HTTP_WS_BINARY, "x", 1) != 2);
+    fail_if(find_client(a)->queue[find_client(a)->queue_head].data != find_client(b)->queue[find_client(b)->queue_head].data);
+    tx_wire_len = 0;
+    timers_fire(0);
+    fail_if(tx_wire_len != 6 || memcmp(tx_wire, "\x82\x01x\x82\x01x", 6) != 0);
+
+    /* an unmasked frame ends the connection */
+    tx_wire_len = 0;
+    close_ev_cnt = 0;
+    wire_feed_sock(&other_socket, "\x81\x02Hi", 4);
+    fail_if(tx_wire_len != 4 || memcmp(tx_wire, "\x88\x02\x03\xea", 4) != 0);
+    fail_if(find_client(b) != NULL || close_ev_cnt != 1 || ch->subscribers != find_client(a));
+
+    /* an idle connection is pinged */
+    tx_wire_len = 0;
+    timers_fire(HTTP_SERVER_TICK_MS);
+    timers_fire(HTTP_SERVER_TICK_MS);
+    fail_if(find_client(a) == NULL);
+    timers_fire(0);
+    fail_if(tx_wire_len != 2 || memcmp(tx_wire, "\x89\x00", 2) != 0);
+
+    /* the closing handshake, started by the server */
+    tx_wire_len = 0;
+    fail_if(pico_http_websocket_close(a, 1000) != HTTP_RETURN_OK);
+    fail_if(pico_http_websocket_send(a, HTTP_WS_TEXT, "x", 1) != HTTP_RETURN_ERROR);
+    timers_fire(0);
+    fail_if(tx_wire_len != 4 || memcmp(tx_wire, "\x88\x02\x03\xe8", 4) != 0);
+    wire_feed("\x88\x82\x01\x02\x03\x04\x02\xea");
+    fail_if(find_client(a) != NULL || close_ev_cnt != 2 || tx_wire_len != 4);
+    fail_if(pico_http_events_destroy(ch) != HTTP_RETURN_OK);
+    pico_http_server_set_heartbeat(HTTP_EVENT_HEARTBEAT_MS);
+    printf("Stop: tc_websocket\n");
+}
+END_TEST
+
+/* an upgraded connection on example_socket */
+static uint16_t ws_open(void)
+{
+    uint16_t conn = open_connection();
+
+    wire_feed(ws_request);
+    fail_if(pico_http_websocket_accept(conn, ws_message) != HTTP_RETURN_OK);
+    timers_fire(0);
+    tx_wire_len = 0;
+    return conn;
+}
+
+START_TEST(tc_websocket_protocol)
+{
+    static const struct {
+        const char *frames;
+        uint32_t len;
+        const char *reply;
+        uint32_t reply_len;
+    } cases[] = {
+        /* closing statuses : valid ones are echoed, an empty body too */
+        { "\x88\x82\0\0\0\0\x03\xe8", 8, "\x88\x02\x03\xe8", 4 },
+        { "\x88\x82\0\0\0\0\x0b\xb8", 8, "\x88\x02\x0b\xb8", 4 },
+        { "\x88\x80\0\0\0\0", 6, "\x88\x00", 2 },
+        /* reserved, unassigned and truncated ones are a protocol error */
+        { "\x88\x82\0\0\0\0\x03\xed", 8, "\x88\x02\x03\xea", 4 },
+        { "\x88\x82\0\0\0\0\x03\xee", 8, "\x88\x02\x03\xea", 4 },
+        { "\x88\x82\0\0\0\0\x03\xf7", 8, "\x88\x02\x03\xea", 4 },
+        { "\x88\x82\0\0\0\0\x03\xe7", 8, "\x88\x02\x03\xea", 4 },
+        { "\x88\x81\0\0\0\0\x03", 7, "\x88\x02\x03\xea", 4 },
+        /* a continuation without a message, a message inside another */
+        { "\x80\x81\0\0\0\0a", 7, "\x88\x02\x03\xea", 4 },
+        { "\x01\x81\0\0\0\0a\x81\x81\0\0\0\0b", 14, "\x88\x02\x03\xea", 4 },
+    };
+    uint16_t conn;
+    uint32_t i;
+    printf("\n\nStart: tc_websocket_protocol\n");
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        conn = ws_open();
+        wire_feed_sock(&example_socket, cases[i].frames, cases[i].len);
+        fail_if(find_client(conn) != NULL);
+        fail_if(tx_wire_len != cases[i].reply_len || memcmp(tx_wire, cases[i].reply, cases[i].reply_len) != 0);
+    }
+
+    /* a fragmented message, with a ping between its frames */
+    conn = ws_open();
+    wire_feed_sock(&example_socket, "\x01\x81\0\0\0\0a\x89\x80\0\0\0\0\x80\x81\0\0\0\0b", 20);
+    fail_if(find_client(conn) == NULL || find_client(conn)->ws_fragmented);
+    fail_if(ws_opcode != HTTP_WS_CONTINUATION || ws_len != 1 || ws_data[0] != 'b' || !ws_fin);
+    pico_http_close(conn);
+    printf("Stop: tc_websocket_protocol\n");
+}
+END_TEST
+
+#ifdef PICO_HTTP_SERVER_DEFLATE
+/* joins the chunks of a response body, returns its length */
+static uint32_t wire_dechunk(const char *body, uint8_t *out)
+{
+    uint32_t len = 0, size;
+    char *end;
+
+    for (;;)
+    {
+        size = (uint32_t)strtoul(body, &end, 16);
+        if (!size)
+            return len;
+
+        body = strstr(end, "\r\n") + 2;
+        memcpy(out + len, body, size);
+        len += size;
+        body += size + 2;
+    }
+}
+
+START_TEST(tc_deflate)
+{
+    uint16_t conn = open_connection();
+    static char plain[6000];
+    static uint8_t packed[4096];
+    static uint8_t unpacked[8192];
+    uint32_t packed_len, i, header_end;
+    uint16_t len;
+    z_stream zs;
+    printf("\n\nStart: tc_deflate\n");
+
+    for (i = 0; i < sizeof(plain); i++)
+        plain[i] = "{\"sensor\":12,\"value\":3.25},"[i % 28];
+
+    /* submitted in two parts, flushed when the queue runs dry */
+    wire_feed("GET /a HTTP/1.1\r\nAccept-Encoding: deflate;q=0.5, gzip\r\n\r\n");
+    fail_if(pico_http_compress(conn) != 1);
+    fail_if(pico_http_respond(conn, HTTP_RESOURCE_FOUND) < 0);
+    fail_if(pico_http_reserve(conn, &len) != NULL);
+    fail_if(pico_http_submit_data(conn, plain, 3000) != HTTP_RETURN_OK);
+    timers_fire(0);
+    fail_if(strstr(tx_wire, "Content-Encoding: gzip\r\n") == NULL);
+    fail_if(strstr(tx_wire, "Vary: Accept-Encoding\r\n") == NULL);
+    header_end = (uint32_t)(strstr(tx_wire, "\r\n\r\n") + 4 - tx_wire);
+    fail_if(tx_wire_len <= header_end);
+    fail_if(pico_http_submit_data(conn, plain + 3000, 3000) != HTTP_RETURN_OK);
+    fail_if(pico_http_submit_data(conn, NULL, 0) != HTTP_RETURN_OK);
+    timers_fire(0);
+    timers_fire(0);
+    fail_if(find_client(conn)->deflate != NULL);
+    fail_if(memcmp(tx_wire + tx_wire_len - 5, "0\r\n\r\n", 5) != 0);
+
+    packed_len = wire_dechunk(tx_wire + header_end, packed);
+    fail_if(packed_len == 0 || packed_len > 1000);
+    memset(&zs, 0, sizeof(zs));
+    fail_if(inflateInit2(&zs, 31) != Z_OK);
+    zs.next_in = packed;
+    zs.avail_in = packed_len;
+    zs.next_out = unpacked;
+    zs.avail_out = sizeof(unpacked);
+    fail_if(inflate(&zs, Z_FINISH) != Z_STREAM_END);
+    fail_if(zs.total_out != sizeof(plain) || memcmp(unpacked, plain, sizeof(plain)) != 0);
+    inflateEnd(&zs);
+
+    /* deflate only, then nothing acceptable */
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /a HTTP/1.1\r\nAccept-Encoding: deflate, gzip;q=0\r\n\r\n");
+    fail_if(pico_http_compress(conn) != 1);
+    fail_if(pico_http_respond(conn, HTTP_RESOURCE_FOUND) < 0);
+    fail_if(pico_http_submit_data(conn, plain, 100) != HTTP_RETURN_OK);
+    fail_if(pico_http_submit_data(conn, NULL, 0) != HTTP_RETURN_OK);
+    timers_fire(0);
+    fail_if(strstr(tx_wire, "Content-Encoding: deflate\r\n") == NULL);
+    timers_fire(0);
+    wire_reset();
+    wire_feed("GET /a HTTP/1.1\r\n\r\n");
+    fail_if(pico_http_compress(conn) != 0);
+    fail_if(pico_http_respond(conn, HTTP_RESOURCE_FOUND) < 0);
+    fail_if(pico_http_submit_data(conn, plain, 28) != HTTP_RETURN_OK);
+    timers_fire(0);
+    fail_if(strstr(tx_wire, "Content-Encoding") != NULL);
+    fail_if(strstr(tx_wire, "\r\n1c\r\n{\"sensor\"") == NULL);
+    pico_http_close(conn);
+    printf("Stop: tc_deflate\n");
+}
+END_TEST
+#endif
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_parse_request_split = tcase_create("Unit test for parse_request_split");
+    TCase *TCase_parse_request_body = tcase_create("Unit test for parse_request_body");
+    TCase *TCase_parse_request_errors = tcase_create("Unit test for parse_request_errors");
+    TCase *TCase_request_header_index = tcase_create("Unit test for request_header_index");
+    TCase *TCase_keepalive_pipelining = tcase_create("Unit test for keepalive_pipelining");
+    TCase *TCase_keepalive_limits = tcase_create("Unit test for keepalive_limits");
+    TCase *TCase_send_queue = tcase_create("Unit test for send_queue");
+    TCase *TCase_write_coalescing = tcase_create("Unit test for write_coalescing");
+    TCase *TCase_response_headers = tcase_create("Unit test for response_headers");
+    TCase *TCase_respond_sized = tcase_create("Unit test for respond_sized");
+    TCase *TCase_static_assets = tcase_create("Unit test for static_assets");
+    TCase *TCase_conditional_get = tcase_create("Unit test for conditional_get");
+    TCase *TCase_byte_ranges = tcase_create("Unit test for byte_ranges");
+    TCase *TCase_request_body_stream = tcase_create("Unit test for request_body_stream");
+    TCase *TCase_multipart_upload = tcase_create("Unit test for multipart_upload");
+    TCase *TCase_route_dispatch = tcase_create("Unit test for route_dispatch");
+    TCase *TCase_server_instances = tcase_create("Unit test for server_instances");
+    TCase *TCase_connection_pool = tcase_create("Unit test for connection_pool");
+    TCase *TCase_pool_timers = tcase_create("Unit test for pool_timers");
+    TCase *TCase_connection_ids = tcase_create("Unit test for connection_ids");
+    TCase *TCase_write_fairness = tcase_create("Unit test for write_fairness");
+    TCase *TCase_timeouts = tcase_create("Unit test for timeouts");
+    TCase *TCase_admission = tcase_create("Unit test for admission");
+    TCase *TCase_rate_limit = tcase_create("Unit test for rate_limit");
+    TCase *TCase_reserve_commit = tcase_create("Unit test for reserve_commit");
+    TCase *TCase_producer = tcase_create("Unit test for producer");
+    TCase *TCase_events = tcase_create("Unit test for events");
+    TCase *TCase_websocket = tcase_create("Unit test for websocket");
+    TCase *TCase_websocket_protocol = tcase_create("Unit test for websocket_protocol");
+#ifdef PICO_HTTP_SERVER_DEFLATE
+    TCase *TCase_deflate = tcase_create("Unit test for deflate");
+#endif
+
+    tcase_add_test(TCase_parse_request_split, tc_parse_request_split);
+    suite_add_tcase(s, TCase_parse_request_split);
+    tcase_add_test(TCase_parse_request_body, tc_parse_request_body);
+    suite_add_tcase(s, TCase_parse_request_body);
+    tcase_add_test(TCase_parse_request_errors, tc_parse_request_errors);
+    suite_add_tcase(s, TCase_parse_request_errors);
+    tcase_add_test(TCase_request_header_index, tc_request_header_index);
+    suite_add_tcase(s, TCase_request_header_index);
+    tcase_add_test(TCase_keepalive_pipelining, tc_keepalive_pipelining);
+    suite_add_tcase(s, TCase_keepalive_pipelining);
+    tcase_add_test(TCase_keepalive_limits, tc_keepalive_limits);
+    suite_add_tcase(s, TCase_keepalive_limits);
+    tcase_add_test(TCase_send_queue, tc_send_queue);
+    suite_add_tcase(s, TCase_send_queue);
+    tcase_add_test(TCase_write_coalescing, tc_write_coalescing);
+    suite_add_tcase(s, TCase_write_coalescing);
+    tcase_add_test(TCase_response_headers, tc_response_headers);
+    suite_add_tcase(s, TCase_response_headers);
+    tcase_add_test(TCase_respond_sized, tc_respond_sized);
+    suite_add_tcase(s, TCase_respond_sized);
+    tcase_add_test(TCase_static_assets, tc_static_assets);
+    suite_add_tcase(s, TCase_static_assets);
+    tcase_add_test(TCase_conditional_get, tc_conditional_get);
+    suite_add_tcase(s, TCase_conditional_get);
+    tcase_add_test(TCase_byte_ranges, tc_byte_ranges);
+    suite_add_tcase(s, TCase_byte_ranges);
+    tcase_add_test(TCase_request_body_stream, tc_request_body_stream);
+    suite_add_tcase(s, TCase_request_body_stream);
+    tcase_add_test(TCase_multipart_upload, tc_multipart_upload);
+    suite_add_tcase(s, TCase_multipart_upload);
+    tcase_add_test(TCase_route_dispatch, tc_route_dispatch);
+    suite_add_tcase(s, TCase_route_dispatch);
+    tcase_add_test(TCase_server_instances, tc_server_instances);
+    suite_add_tcase(s, TCase_server_instances);
+    tcase_add_test(TCase_connection_pool, tc_connection_pool);
+    suite_add_tcase(s, TCase_connection_pool);
+    tcase_add_test(TCase_pool_timers, tc_pool_timers);
+    suite_add_tcase(s, TCase_pool_timers);
+    tcase_add_test(TCase_connection_ids, tc_connection_ids);
+    suite_add_tcase(s, TCase_connection_ids);
+    tcase_add_test(TCase_write_fairness, tc_write_fairness);
+    suite_add_tcase(s, TCase_write_fairness);
+    tcase_add_test(TCase_timeouts, tc_timeouts);
+    suite_add_tcase(s, TCase_timeouts);
+    tcase_add_test(TCase_admission, tc_admission);
+    suite_add_tcase(s, TCase_admission);
+    tcase_add_test(TCase_rate_limit, tc_rate_limit);
+    suite_add_tcase(s, TCase_rate_limit);
+    tcase_add_test(TCase_reserve_commit, tc_reserve_commit);
+    suite_add_tcase(s, TCase_reserve_commit);
+    tcase_add_test(TCase_producer, tc_producer);
+    suite_add_tcase(s, TCase_producer);
+    tcase_add_test(TCase_events, tc_events);
+    suite_add_tcase(s, TCase_events);
+    tcase_add_test(TCase_websocket, tc_websocket);
+    suite_add_tcase(s, TCase_websocket);
+    tcase_add_test(TCase_websocket_protocol, tc_websocket_protocol);
+    suite_add_tcase(s, TCase_websocket_protocol);
+#ifdef PICO_HTTP_SERVER_DEFLATE
+    tcase_add_test(TCase_deflate, tc_deflate);
+    suite_add_tcase(s, TCase_deflate);
+#endif
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
@@ -2,6 +2,7 @@
 rm -f /tmp/pico-modules-mem-report-*
 
 ./build/test/units/modunit_libhttp_client.elf || exit 1
+./build/test/units/modunit_libhttp_server.elf || exit 1
 
 MAXMEM=`cat /tmp/pico-modules-mem-report-* | sort -r -n |head -1`
 echo